@@ -0,0 +1,913 @@
+/*
+ * Keep-Cool micro benchmarks
+ * Copyright (C) 2026 The keep-cool contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Built by "make bench" against keep-cool.c (compiled without its main)
+ * and the simulated SMC, so it runs on any host. With -j the results are
+ * printed as a JSON array, one object per benchmark ("make bench-json"),
+ * to be compared release to release.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include "keep-cool.h"
+
+#define BENCH_LOOKUPS         4000000
+#define BENCH_OLD_CACHE_SIZE  100
+#define BENCH_SPEED_ROUNDS    1000
+#define BENCH_TRACE_FILE      "/tmp/kc-bench.trace"
+#define BENCH_OPS             2000000
+#define BENCH_PRINT_OPS       200000
+#define BENCH_TICK_KEYS       12              /* 8 sensors, min and actual speeds of 2 fans */
+#define BENCH_ENUM_SMC        "sim:50:1000"   /* 50 us per SMC call, 1000 extra keys */
+
+/* Thermal plant: a heat sink cooled by one fan, sampled once per second */
+#define PLANT_DURATION        1800      /* s */
+#define PLANT_STEPS           10        /* physics steps per sample */
+#define PLANT_AMBIENT         25.0      /* ºC */
+#define PLANT_CAPACITY        60.0      /* J/ºC */
+#define PLANT_G0              0.25      /* W/ºC, passive */
+#define PLANT_G1              0.00025   /* W/ºC per rpm */
+#define PLANT_FAN_MIN         1200      /* rpm, hardware minimum */
+#define PLANT_FAN_MAX         6200      /* rpm */
+#define PLANT_FAN_TAU         2.0       /* s, fan spin up */
+#define PLANT_IDLE            15.0      /* W */
+#define PLANT_BURST           60.0      /* W */
+
+typedef struct {
+    UInt32                key;
+    SMCKeyData_keyInfo_t  keyInfo;
+} BenchScanEntry_t;
+
+static volatile int g_benchSpinLock = 0;
+static volatile UInt32 g_benchSink = 0;
+
+/* Cumulative cpu ticks of the simulated machine, for the bench load source */
+static UInt64 g_plantBusy = 0;
+static UInt64 g_plantTotal = 0;
+
+static UInt64 BenchNowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (UInt64)ts.tv_sec * 1000000000ULL + (UInt64)ts.tv_nsec;
+}
+
+static int g_benchJSON = 0;
+static int g_benchResults = 0;
+
+/*
+ * Allocations are counted by wrapping the glibc allocator, which keep-cool.c
+ * calls through the symbols below. Elsewhere they aren't counted.
+ */
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+static volatile UInt64 g_benchAllocs = 0;
+
+void *malloc(size_t size)
+{
+    g_benchAllocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    g_benchAllocs++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    g_benchAllocs++;
+    return __libc_realloc(ptr, size);
+}
+
+#define BenchAllocs()   ((long long)g_benchAllocs)
+#else
+#define BenchAllocs()   ((long long)-1)
+#endif
+
+// Prints the metrics of a benchmark, given as name / value pairs ended by
+// NULL, as a JSON object. Negative values are unknown.
+static void BenchJSON(const char *bench, ...)
+{
+    const char *key;
+    double     value;
+    va_list    ap;
+
+    printf("%s\n  {\"bench\": \"%s\"", g_benchResults++ ? "," : "[", bench);
+    va_start(ap, bench);
+    while ((key = va_arg(ap, const char *)) != NULL)
+    {
+        value = va_arg(ap, double);
+        if (value < 0.0)
+            printf(", \"%s\": null", key);
+        else
+            printf(", \"%s\": %.6g", key, value);
+    }
+    va_end(ap);
+    printf("}");
+}
+
+// Reports ops calls of an operation, started at start (ns) with allocs
+// allocations done so far
+static void BenchOp(const char *bench, UInt64 start, UInt64 ops, long long allocs)
+{
+    UInt64 elapsed = BenchNowNs() - start;
+    double allocsPerOp = allocs < 0 ? -1.0 : (double)(BenchAllocs() - allocs) / ops;
+
+    if (g_benchJSON)
+        BenchJSON(bench, "ns_per_op", (double)elapsed / ops, "allocs_per_op", allocsPerOp, NULL);
+    else if (allocs < 0)
+        printf("%-32s: %8.1f ns/op\n", bench, (double)elapsed / ops);
+    else
+        printf("%-32s: %8.1f ns/op  %5.2f allocs/op\n", bench, (double)elapsed / ops, allocsPerOp);
+}
+
+// The key info cache as it was: a linear scan under a spin lock
+static int BenchScanLookup(BenchScanEntry_t *cache, int count, UInt32 key, SMCKeyData_keyInfo_t *keyInfo)
+{
+    int i, found = 0;
+
+    while (__sync_lock_test_and_set(&g_benchSpinLock, 1))
+        ;
+    for (i = 0; i < count; ++i)
+    {
+        if (key == cache[i].key)
+        {
+            *keyInfo = cache[i].keyInfo;
+            found = 1;
+            break;
+        }
+    }
+    __sync_lock_release(&g_benchSpinLock);
+    return found;
+}
+
+static void BenchKeyInfoCache(int count)
+{
+    BenchScanEntry_t     *scan = calloc(count, sizeof(BenchScanEntry_t));
+    UInt32               *order = calloc(BENCH_LOOKUPS, sizeof(UInt32));
+    SMCKeyData_keyInfo_t keyInfo;
+    UInt32               seed = 12345, sum = 0;
+    UInt64               start;
+    double               scanNs, hashNs;
+    char                 key[5], bench[64];
+    int                  i;
+
+    SMCKeyInfoCacheReset();
+    SMCKeyInfoCacheReserve(count);
+    for (i = 0; i < count; i++)
+    {
+        snprintf(key, sizeof(key), "%c%03X", 'A' + (i >> 12), i & 0xfff);
+        scan[i].key = _strtoul(key, 4, 16);
+        scan[i].keyInfo.dataSize = 2;
+        scan[i].keyInfo.dataType = _strtoul(DATATYPE_SP78, 4, 16);
+        SMCKeyInfoCacheInsert(scan[i].key, &scan[i].keyInfo);
+    }
+    for (i = 0; i < BENCH_LOOKUPS; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        order[i] = scan[(seed >> 8) % count].key;
+    }
+
+    start = BenchNowNs();
+    for (i = 0; i < BENCH_LOOKUPS; i++)
+        sum += BenchScanLookup(scan, count, order[i], &keyInfo) + keyInfo.dataSize;
+    scanNs = (double)(BenchNowNs() - start) / BENCH_LOOKUPS;
+
+    start = BenchNowNs();
+    for (i = 0; i < BENCH_LOOKUPS; i++)
+        sum += SMCKeyInfoCacheLookup(order[i], &keyInfo) + keyInfo.dataSize;
+    hashNs = (double)(BenchNowNs() - start) / BENCH_LOOKUPS;
+
+    g_benchSink += sum;
+    snprintf(bench, sizeof(bench), "keyinfo lookup %d keys", count);
+    if (g_benchJSON)
+        BenchJSON(bench, "scan_ns_per_op", scanNs, "hash_ns_per_op", hashNs, NULL);
+    else
+        printf("keyinfo lookup %5d keys: scan %8.1f ns/op  hash %6.1f ns/op  (old cache hit ratio %3.0f%%)\n",
+               count, scanNs, hashNs,
+               100.0 * (count < BENCH_OLD_CACHE_SIZE ? count : BENCH_OLD_CACHE_SIZE) / count);
+
+    SMCKeyInfoCacheReset();
+    free(order);
+    free(scan);
+}
+
+// Evaluating a speed algorithm against loading its compiled table, for a
+// sweep of every sensor code from 30ºC to 100ºC
+// A user curve (-u) given by its points, or NULL for a builtin algorithm
+static void BenchSpeedCurve(const char *name, UInt16 (*algorithm)(void *), char *points)
+{
+    KC_Status_t state;
+    SInt32      first = 30 * KC_TEMP_SCALE, last = 100 * KC_TEMP_SCALE, code;
+    UInt32      sum = 0, mismatches = 0, ops, i;
+    UInt64      start;
+    double      evalNs, tableNs, buildUs;
+    char        bench[64];
+
+    memset(&state, 0, sizeof(state));
+    state.min_temp = KC_DEF_MIN_TEMP;
+    state.max_temp = KC_DEF_MAX_TEMP;
+    state.max_speed = 6200;
+    state.delta_v = (double)(state.max_speed - KC_FAN_MIN_SPEED);
+    state.compute_fan_speed = algorithm;
+    if (points != NULL && KCParseUserCurve(points, &state) != kIOReturnSuccess)
+        return;
+
+    start = BenchNowNs();
+    KCBuildSpeedTable(&state, &state.speed_table);
+    buildUs = (double)(BenchNowNs() - start) / 1000.0;
+
+    ops = BENCH_SPEED_ROUNDS * (UInt32)(last - first);
+    start = BenchNowNs();
+    for (i = 0; i < BENCH_SPEED_ROUNDS; i++)
+        for (code = first; code < last; code++)
+        {
+            state.cur_temp = (double)code / KC_TEMP_SCALE;
+            sum += (*algorithm)((void *)&state);
+        }
+    evalNs = (double)(BenchNowNs() - start) / ops;
+
+    start = BenchNowNs();
+    for (i = 0; i < BENCH_SPEED_ROUNDS; i++)
+        for (code = first; code < last; code++)
+        {
+            state.cur_temp = (double)code / KC_TEMP_SCALE;
+            sum += KCComputeFanSpeed(&state);
+        }
+    tableNs = (double)(BenchNowNs() - start) / ops;
+
+    for (code = first; code < last; code++)
+    {
+        state.cur_temp = (double)code / KC_TEMP_SCALE;
+        mismatches += (*algorithm)((void *)&state) != KCComputeFanSpeed(&state);
+    }
+
+    g_benchSink += sum;
+    snprintf(bench, sizeof(bench), "speed curve %s", name);
+    if (g_benchJSON)
+        BenchJSON(bench, "eval_ns_per_op", evalNs, "table_ns_per_op", tableNs, "build_us", buildUs,
+                  "mismatches", (double)mismatches, NULL);
+    else
+        printf("speed curve %-12s: eval %6.1f ns/op  table %5.1f ns/op  (built in %.0f us, %u mismatches)\n",
+               name, evalNs, tableNs, buildUs, mismatches);
+    KCFreeSpeedTable(&state);
+}
+
+static kern_return_t BenchLoadOpen(void)
+{
+    return kIOReturnSuccess;
+}
+
+static kern_return_t BenchLoadRead(UInt64 *busy, UInt64 *total)
+{
+    *busy = g_plantBusy;
+    *total = g_plantTotal;
+    return kIOReturnSuccess;
+}
+
+static void BenchLoadClose(void)
+{
+}
+
+static KC_LoadSource_t g_benchLoad = { "bench", BenchLoadOpen, BenchLoadRead, BenchLoadClose };
+
+// Heat (W) produced at time t: idle, then phases of load, with some noise
+static double PlantLoad(int t, UInt32 *seed)
+{
+    double load;
+
+    if (t < 300)       load = 15.0;
+    else if (t < 900)  load = 28.0;
+    else if (t < 1200) load = 55.0;
+    else if (t < 1500) load = 28.0;
+    else               load = 15.0;
+    *seed = *seed * 1103515245 + 12345;
+    return load + ((*seed >> 16) % 600) / 100.0 - 3.0;
+}
+
+// Heat (W) produced at time t: 90 s bursts of compile jobs every 5 minutes
+static double PlantBursts(int t, UInt32 *seed)
+{
+    return (t % 300) >= 200 && (t % 300) < 290 ? PLANT_BURST : PLANT_IDLE;
+}
+
+// Runs a speed algorithm in closed loop against the thermal plant, through
+// the same speed computation and write elision as SMCSetFanSpeed, with the
+// load feed-forward when gain isn't 0. With a filter, the sensor reads
+// with +/-0.25ºC of noise and goes through the filter stage.
+static void BenchThermalLoad(const char *name, UInt16 (*algorithm)(void *),
+                             double (*profile)(int, UInt32 *), double gain, char *filter)
+{
+    KC_Status_t state;
+    KC_FanState_t *fan = &state.fan[0];
+    UInt32      seed = 4321, writes = 0, hot = 0;
+    double      temp = 45.0, rpm = PLANT_FAN_MIN, target, load, dt = 1.0 / PLANT_STEPS;
+    double      rpm_sum = 0.0, temp_sum = 0.0, temp_max = 0.0, over_sum = 0.0;
+    UInt16      newSpeed;
+    char        bench[64];
+    int         t, i;
+
+    memset(&state, 0, sizeof(state));
+    state.min_temp = KC_DEF_MIN_TEMP;
+    state.max_temp = KC_DEF_MAX_TEMP;
+    state.max_speed = PLANT_FAN_MAX;
+    state.delta_v = (double)(state.max_speed - KC_FAN_MIN_SPEED);
+    state.compute_fan_speed = algorithm;
+    state.num_fans = 1;
+    state.deadband = KC_FAN_DEADBAND;
+    state.hysteresis = KC_FAN_HYSTERESIS;
+    state.pid.target = KC_PID_TARGET;
+    state.pid.kp = KC_PID_KP;
+    state.pid.ki = KC_PID_KI;
+    state.pid.kd = KC_PID_KD;
+    state.pid.tau = KC_PID_TAU;
+    fan->max_speed = PLANT_FAN_MAX;
+    state.load.gain = gain;
+    state.load.source = gain > 0.0 ? &g_benchLoad : NULL;
+    g_plantBusy = g_plantTotal = 0;
+    if (filter != NULL)
+    {
+        state.num_sensors = 1;
+        state.sensors[0].weight = 1.0;
+        KCParseFilter(filter, &state);
+    }
+
+    for (t = 0; t < PLANT_DURATION; t++)
+    {
+        // sample, with the sensor resolution
+        state.cur_temp = (double)KCTemperatureCode(temp) / KC_TEMP_SCALE;
+        if (filter != NULL)
+        {
+            seed = seed * 1103515245 + 12345;
+            state.sensors[0].raw = state.cur_temp + ((seed >> 16) % 3) * 0.25 - 0.25;
+            state.sensors[0].temp = KCFilterSample(&state.filter, 0, state.sensors[0].raw);
+            state.cur_temp = KCAggregateSensors(&state, ~0U);
+        }
+        state.sample_time = (UInt64)(t + 1) * 1000000;
+        KCUpdateFanTemperatures(&state);
+        KCSampleLoad(&state, state.sample_time);
+        newSpeed = KCComputeFanSpeedOf(&state, 0);
+        state.writes = writes;
+        KCFilterAccount(&state, 0, newSpeed);
+        if (KCFanNeedsWrite(&state, fan, newSpeed))
+        {
+            fan->last_direction = newSpeed > fan->min_speed ? 1 : -1;
+            fan->min_speed = newSpeed;
+            writes++;
+        }
+
+        // the SMC keeps the fan between its hardware limits
+        target = fan->min_speed < PLANT_FAN_MIN ? PLANT_FAN_MIN : fan->min_speed;
+        load = (*profile)(t, &seed);
+        g_plantBusy += (UInt64)(100.0 * fmin(1.0, fmax(0.0, (load - PLANT_IDLE) / (PLANT_BURST - PLANT_IDLE))));
+        g_plantTotal += 100;
+        for (i = 0; i < PLANT_STEPS; i++)
+        {
+            rpm += (target - rpm) * dt / PLANT_FAN_TAU;
+            temp += (load - (PLANT_G0 + PLANT_G1 * rpm) * (temp - PLANT_AMBIENT)) * dt / PLANT_CAPACITY;
+        }
+
+        rpm_sum += rpm;
+        temp_sum += temp;
+        if (temp > KC_PID_TARGET)
+            over_sum += (temp - KC_PID_TARGET) * (temp - KC_PID_TARGET);
+        if (temp > temp_max)
+            temp_max = temp;
+        if (temp > KC_PID_TARGET + 2.0)
+            hot++;
+    }
+
+    snprintf(bench, sizeof(bench), "thermal load %s", name);
+    if (g_benchJSON)
+        BenchJSON(bench, "avg_rpm", rpm_sum / PLANT_DURATION, "avg_temp", temp_sum / PLANT_DURATION,
+                  "max_temp", temp_max, "rms_over_target", sqrt(over_sum / PLANT_DURATION),
+                  "s_over_target", (double)hot, "writes", (double)writes,
+                  "speed_changes", filter != NULL ? (double)state.filter.changes : -1.0,
+                  "raw_speed_changes", filter != NULL ? (double)state.filter.raw_changes : -1.0,
+                  "raw_writes", filter != NULL ? (double)state.filter.raw_writes : -1.0, NULL);
+    else
+        printf("thermal load %-14s: avg %4.0f rpm  avg %5.2fºC  max %5.2fºC  rms over %.0fºC %5.2fºC  %4u s over %.0fºC  %3u writes\n",
+               name, rpm_sum / PLANT_DURATION, temp_sum / PLANT_DURATION, temp_max, KC_PID_TARGET,
+               sqrt(over_sum / PLANT_DURATION), hot, KC_PID_TARGET + 2.0, writes);
+    if (!g_benchJSON && filter != NULL && state.filter.mode != KC_FILTER_NONE)
+        printf("thermal load %-14s: %llu speed changes, %llu unfiltered; %u writes, %llu unfiltered\n",
+               name, (unsigned long long)state.filter.changes, (unsigned long long)state.filter.raw_changes,
+               writes, (unsigned long long)state.filter.raw_writes);
+    KCFreeSpeedTable(&state);
+}
+
+// Cost that recording a tick adds to the control loop: filling a record and
+// pushing it in the ring (less ticks than the ring holds, so none is dropped)
+static void BenchTrace(void)
+{
+    KC_Status_t state;
+    UInt64      start;
+    long long   allocs;
+    int         i;
+
+    memset(&state, 0, sizeof(state));
+    state.num_sensors = 3;
+    state.num_fans = 2;
+    state.cur_temp = 58.5;
+    state.debug = !g_benchJSON;
+    state.trace_file = BENCH_TRACE_FILE;
+    state.trace_size = KC_TRACE_MIN_SIZE;
+    unlink(BENCH_TRACE_FILE);
+    if (KCTraceOpen(&state) != kIOReturnSuccess)
+    {
+        fprintf(stderr, "trace: can't open %s\n", BENCH_TRACE_FILE);
+        return;
+    }
+
+    allocs = BenchAllocs();
+    start = BenchNowNs();
+    for (i = 0; i < KC_TRACE_RING - 1; i++)
+    {
+        state.sample_time = i;
+        KCTraceTick(&state, 0, 0, 0, 0);
+    }
+    BenchOp("trace record", start, KC_TRACE_RING - 1, allocs);
+    KCTraceClose(&state);
+    unlink(BENCH_TRACE_FILE);
+}
+
+// The byte conversion helpers every SMC read and write goes through
+static void BenchConversions(void)
+{
+    unsigned char bytes[4] = { 0x54, 0x43, 0x30, 0x50 };
+    char          str[5];
+    UInt32        sum = 0, i;
+    UInt64        start;
+    long long     allocs;
+    float         fsum = 0.0;
+
+    allocs = BenchAllocs();
+    start = BenchNowNs();
+    for (i = 0; i < BENCH_OPS; i++)
+    {
+        bytes[3] = (unsigned char)i;
+        sum += _strtoul((char *)bytes, 4, 16);
+    }
+    BenchOp("_strtoul 4 bytes", start, BENCH_OPS, allocs);
+
+    allocs = BenchAllocs();
+    start = BenchNowNs();
+    for (i = 0; i < BENCH_OPS; i++)
+    {
+        bytes[1] = (unsigned char)i;
+        fsum += _strtof(bytes, 2, 2);
+    }
+    BenchOp("_strtof fpe2", start, BENCH_OPS, allocs);
+
+    allocs = BenchAllocs();
+    start = BenchNowNs();
+    for (i = 0; i < BENCH_OPS; i++)
+    {
+        _ultostr(str, 0x54433050 + i);
+        sum += (UInt8)str[3];
+    }
+    BenchOp("_ultostr", start, BENCH_OPS, allocs);
+
+    g_benchSink += sum + (UInt32)fsum;
+}
+
+// Decoding and formatting a value as -l and -L do, printed to /dev/null
+static void BenchPrintVal(void)
+{
+    static const char *types[] = { DATATYPE_SP78, DATATYPE_FPE2, DATATYPE_UINT8, DATATYPE_UINT32,
+                                   DATATYPE_SI16, DATATYPE_PWM, "flag" };
+    SMCVal_t vals[sizeof(types) / sizeof(types[0])];
+    UInt32   n = sizeof(types) / sizeof(types[0]), i;
+    UInt64   start;
+    long long allocs;
+    int      out, null;
+
+    memset(vals, 0, sizeof(vals));
+    for (i = 0; i < n; i++)
+    {
+        snprintf(vals[i].key, sizeof(vals[i].key), "K%03u", i);
+        strncpy(vals[i].dataType, types[i], sizeof(vals[i].dataType));
+        vals[i].dataSize = strcmp(types[i], DATATYPE_UINT8) == 0 || strcmp(types[i], "flag") == 0 ? 1 :
+                           strcmp(types[i], DATATYPE_UINT32) == 0 ? 4 : 2;
+        vals[i].bytes[0] = 0x3a;
+        vals[i].bytes[1] = 0x80;
+    }
+
+    fflush(stdout);
+    out = dup(STDOUT_FILENO);
+    null = open("/dev/null", O_WRONLY);
+    if (out < 0 || null < 0)
+        return;
+    dup2(null, STDOUT_FILENO);
+    allocs = BenchAllocs();
+    start = BenchNowNs();
+    for (i = 0; i < BENCH_PRINT_OPS; i++)
+        printVal(vals[i % n]);
+    fflush(stdout);
+    dup2(out, STDOUT_FILENO);
+    close(out);
+    close(null);
+    BenchOp("printVal", start, BENCH_PRINT_OPS, allocs);
+}
+
+// An SMC that answers at once: what's left is keep-cool's own cost
+static kern_return_t BenchSMCOpen(io_connect_t *conn)
+{
+    *conn = 1;
+    return kIOReturnSuccess;
+}
+
+static kern_return_t BenchSMCCall(int index, SMCKeyData_t *inputStructure, SMCKeyData_t *outputStructure, io_connect_t conn)
+{
+    outputStructure->result = SMC_RESULT_SUCCESS;
+    switch (inputStructure->data8)
+    {
+        case SMC_CMD_READ_KEYINFO:
+            outputStructure->keyInfo.dataSize = 2;
+            outputStructure->keyInfo.dataType = _strtoul(DATATYPE_SP78, 4, 16);
+            outputStructure->keyInfo.dataAttributes = 0;
+            break;
+        case SMC_CMD_READ_BYTES:
+            outputStructure->bytes[0] = 0x3a;
+            outputStructure->bytes[1] = 0x80;
+            break;
+        case SMC_CMD_WRITE_BYTES:
+            break;
+        default:
+            return kIOReturnBadArgument;
+    }
+    return kIOReturnSuccess;
+}
+
+static kern_return_t BenchSMCClose(io_connect_t conn)
+{
+    return kIOReturnSuccess;
+}
+
+static SMCTransport_t g_benchSMC = { "bench", BenchSMCOpen, BenchSMCCall, BenchSMCClose };
+
+// The SMC access functions against the stub above, key infos cached
+static void BenchSMCAccess(void)
+{
+    SMCTransport_t       *saved = g_smcTransport;
+    SMCKeyData_keyInfo_t keyInfo;
+    UInt32Char_t         key = "TC0P", keys[BENCH_TICK_KEYS];
+    SMCKeyHandle_t       handle, handles[BENCH_TICK_KEYS];
+    SMCVal_t             val, vals[BENCH_TICK_KEYS];
+    io_connect_t         conn;
+    UInt32               sum = 0, packed = _strtoul(key, 4, 16), i;
+    UInt64               start;
+    long long            allocs;
+
+    g_smcTransport = &g_benchSMC;
+    SMCOpen(&conn);
+    SMCKeyInfoCacheReset();
+    SMCGetKeyInfo(packed, &keyInfo, conn);
+
+    allocs = BenchAllocs();
+    start = BenchNowNs();
+    for (i = 0; i < BENCH_OPS; i++)
+        sum += SMCGetKeyInfo(packed, &keyInfo, conn) + keyInfo.dataSize;
+    BenchOp("SMCGetKeyInfo cached", start, BENCH_OPS, allocs);
+
+    allocs = BenchAllocs();
+    start = BenchNowNs();
+    for (i = 0; i < BENCH_OPS; i++)
+        sum += SMCReadKey2(key, &val, conn) + val.bytes[0];
+    BenchOp("SMCReadKey2 stub SMC", start, BENCH_OPS, allocs);
+
+    memset(&val, 0, sizeof(val));
+    memcpy(val.key, key, sizeof(val.key));
+    val.dataSize = 2;
+    allocs = BenchAllocs();
+    start = BenchNowNs();
+    for (i = 0; i < BENCH_OPS; i++)
+    {
+        val.bytes[1] = (char)i;
+        sum += SMCWriteKey2(val, conn);
+    }
+    BenchOp("SMCWriteKey2 stub SMC", start, BENCH_OPS, allocs);
+
+    SMCResolveKey2(key, SMC_CMD_READ_BYTES, &handle, conn);
+    allocs = BenchAllocs();
+    start = BenchNowNs();
+    for (i = 0; i < BENCH_OPS; i++)
+        sum += SMCReadHandles2(&handle, 1, &val, conn) + val.bytes[0];
+    BenchOp("SMCReadHandles2 stub SMC", start, BENCH_OPS, allocs);
+
+    SMCResolveKey2(key, SMC_CMD_WRITE_BYTES, &handle, conn);
+    allocs = BenchAllocs();
+    start = BenchNowNs();
+    for (i = 0; i < BENCH_OPS; i++)
+    {
+        val.bytes[1] = (char)i;
+        sum += SMCWriteHandle2(&handle, val.bytes, 2, conn);
+    }
+    BenchOp("SMCWriteHandle2 stub SMC", start, BENCH_OPS, allocs);
+
+    // a tick of 8 sensors and 2 fans (min and actual speeds)
+    for (i = 0; i < BENCH_TICK_KEYS; i++)
+    {
+        snprintf(keys[i], sizeof(keys[i]), "T%03u", i);
+        SMCResolveKey2(keys[i], SMC_CMD_READ_BYTES, &handles[i], conn);
+    }
+    allocs = BenchAllocs();
+    start = BenchNowNs();
+    for (i = 0; i < BENCH_OPS / BENCH_TICK_KEYS; i++)
+        sum += SMCReadKeys2(keys, BENCH_TICK_KEYS, vals, conn) + vals[0].bytes[0];
+    BenchOp("SMCReadKeys2 tick stub SMC", start, BENCH_OPS / BENCH_TICK_KEYS, allocs);
+
+    allocs = BenchAllocs();
+    start = BenchNowNs();
+    for (i = 0; i < BENCH_OPS / BENCH_TICK_KEYS; i++)
+        sum += SMCReadHandles2(handles, BENCH_TICK_KEYS, vals, conn) + vals[0].bytes[0];
+    BenchOp("SMCReadHandles2 tick stub SMC", start, BENCH_OPS / BENCH_TICK_KEYS, allocs);
+
+    SMCClose(conn);
+    SMCKeyInfoCacheReset();
+    g_smcTransport = saved;
+    g_benchSink += sum;
+}
+
+// A cold -L against a slow simulated SMC, over a pool of conns connections
+static void BenchEnumeration(int conns)
+{
+    SMCTransport_t *saved = g_smcTransport;
+    char           spec[] = BENCH_ENUM_SMC, none[] = "";
+    char           bench[64];
+    UInt64         start;
+    long long      allocs;
+    int            out, null;
+
+    snprintf(bench, sizeof(bench), "SMCPrintAll %d conn%s", conns, conns > 1 ? "s" : "");
+    if (SMCSelectTransport(spec) != kIOReturnSuccess)
+        return;
+    SMCPoolSetSize(conns);
+    smc_init();
+    SMCKeyInfoCacheReset();
+
+    fflush(stdout);
+    out = dup(STDOUT_FILENO);
+    null = open("/dev/null", O_WRONLY);
+    if (out >= 0 && null >= 0)
+    {
+        dup2(null, STDOUT_FILENO);
+        allocs = BenchAllocs();
+        start = BenchNowNs();
+        SMCPrintAll();
+        fflush(stdout);
+        dup2(out, STDOUT_FILENO);
+        BenchOp(bench, start, 1, allocs);
+    }
+    if (out >= 0)
+        close(out);
+    if (null >= 0)
+        close(null);
+
+    smc_close();
+    SMCKeyInfoCacheReset();
+    SMCPoolSetSize(0);
+    SMCSimConfigure(none);
+    g_smcTransport = saved;
+}
+
+// Watch records of 8 keys formatted and written to /dev/null, buffered
+static void BenchWatch(int format)
+{
+    static const char *types[] = { DATATYPE_SP78, DATATYPE_FPE2 };
+    KC_Watch_t  watch;
+    KC_Writer_t *writer;
+    SMCVal_t    vals[8];
+    UInt64      start;
+    long long   allocs;
+    UInt32      i;
+    int         null;
+    char        bench[64];
+
+    writer = malloc(sizeof(KC_Writer_t));
+    null = open("/dev/null", O_WRONLY);
+    if (writer == NULL || null < 0)
+    {
+        free(writer);
+        return;
+    }
+    memset(&watch, 0, sizeof(watch));
+    memset(vals, 0, sizeof(vals));
+    for (i = 0; i < 8; i++)
+    {
+        snprintf(watch.keys[i], sizeof(watch.keys[i]), "K%03u", i);
+        memcpy(vals[i].key, watch.keys[i], sizeof(vals[i].key));
+        strncpy(vals[i].dataType, types[i % 2], sizeof(vals[i].dataType));
+        vals[i].dataSize = 2;
+        vals[i].decoder = SMCDecoderOf(_strtoul(vals[i].dataType, 4, 16), 2);
+        vals[i].bytes[0] = 0x3a;
+        vals[i].bytes[1] = 0x80 + i;
+    }
+    watch.count = 8;
+    watch.format = format;
+    KCWriterInit(writer, null, KC_WATCH_FLUSH_FULL);
+
+    snprintf(bench, sizeof(bench), "watch %s record", format == KC_WATCH_CSV ? "csv" : "json");
+    allocs = BenchAllocs();
+    start = BenchNowNs();
+    for (i = 0; i < BENCH_PRINT_OPS; i++)
+    {
+        KCWatchRecord(&watch, writer, 1700000000.0 + i / 1000.0, vals);
+        KCWriterEndRecord(writer);
+    }
+    KCWriterFlush(writer);
+    BenchOp(bench, start, BENCH_PRINT_OPS, allocs);
+    close(null);
+    free(writer);
+}
+
+// Both sides of the status segment seqlock, on a private copy of the segment
+// Cost of a log call on the control loop while the log thread runs: a
+// flapping sensor repeats itself, the rest is held by the rate limits
+static void BenchLog(void)
+{
+    char      msg[KC_LOG_BUFSIZE];
+    UInt64    start;
+    long long allocs;
+    UInt32    i;
+
+    if (KCLogStart() != kIOReturnSuccess)
+        return;
+    allocs = BenchAllocs();
+    start = BenchNowNs();
+    for (i = 0; i < BENCH_OPS; i++)
+        KCSysLogClass(KC_LOG_SENSOR, LOG_DEBUG, "kc-bench: repeated message");
+    BenchOp("log repeated message", start, BENCH_OPS, allocs);
+
+    allocs = BenchAllocs();
+    start = BenchNowNs();
+    for (i = 0; i < BENCH_PRINT_OPS; i++)
+    {
+        snprintf(msg, sizeof(msg), "kc-bench: message %u", i);
+        KCSysLogClass(KC_LOG_SMC, LOG_DEBUG, msg);
+    }
+    BenchOp("log rate limited message", start, BENCH_PRINT_OPS, allocs);
+    KCLogStop();
+}
+
+static void BenchStatusSegment(void)
+{
+    KC_Status_t     state;
+    KC_ShmSegment_t *shm;
+    KC_ShmStatus_t  status;
+    UInt64          start, sum = 0;
+    long long       allocs;
+    UInt32          i;
+
+    shm = calloc(1, sizeof(KC_ShmSegment_t));
+    if (shm == NULL)
+        return;
+    shm->magic = KC_SHM_MAGIC;
+    shm->version = KC_SHM_VERSION;
+    shm->size = sizeof(KC_ShmSegment_t);
+    memset(&state, 0, sizeof(state));
+    state.num_fans = 2;
+    state.num_sensors = 3;
+    state.compute_fan_speed = KCQuadraticSpeedAlghoritm;
+
+    allocs = BenchAllocs();
+    start = BenchNowNs();
+    for (i = 0; i < BENCH_PRINT_OPS; i++)
+    {
+        state.cur_temp = 50.0 + (i & 63) / (double)KC_TEMP_SCALE;
+        KCShmWrite(shm, &state);
+    }
+    BenchOp("status segment publish", start, BENCH_PRINT_OPS, allocs);
+
+    allocs = BenchAllocs();
+    start = BenchNowNs();
+    for (i = 0; i < BENCH_OPS; i++)
+    {
+        KCShmSnapshot(shm, &status);
+        sum += status.ticks;
+    }
+    BenchOp("status segment read", start, BENCH_OPS, allocs);
+
+    free(shm);
+    g_benchSink += sum;
+}
+
+// Every speed algorithm called directly, over a sweep from 30ºC to 100ºC
+static void BenchAlgorithm(const char *name, UInt16 (*algorithm)(void *))
+{
+    KC_Status_t state;
+    UInt32      sum = 0, i;
+    UInt64      start;
+    long long   allocs;
+    char        bench[64];
+
+    snprintf(bench, sizeof(bench), "algorithm %s", name);
+    memset(&state, 0, sizeof(state));
+    state.min_temp = KC_DEF_MIN_TEMP;
+    state.max_temp = KC_DEF_MAX_TEMP;
+    state.max_speed = 6200;
+    state.delta_v = (double)(state.max_speed - KC_FAN_MIN_SPEED);
+    state.compute_fan_speed = algorithm;
+    state.pid.target = KC_PID_TARGET;
+    state.pid.kp = KC_PID_KP;
+    state.pid.ki = KC_PID_KI;
+    state.pid.kd = KC_PID_KD;
+    state.pid.tau = KC_PID_TAU;
+
+    allocs = BenchAllocs();
+    start = BenchNowNs();
+    for (i = 0; i < BENCH_OPS; i++)
+    {
+        state.cur_temp = 30.0 + (i % 4480) / (double)KC_TEMP_SCALE;
+        state.sample_time = (UInt64)(i + 1) * 1000000;
+        sum += (*algorithm)((void *)&state);
+    }
+    BenchOp(bench, start, BENCH_OPS, allocs);
+    g_benchSink += sum;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "-j") == 0)
+        g_benchJSON = 1;
+    else if (argc > 1)
+    {
+        fprintf(stderr, "Usage: %s [-j]\n", argv[0]);
+        return 1;
+    }
+
+    BenchConversions();
+    BenchPrintVal();
+    BenchSMCAccess();
+    BenchStatusSegment();
+    BenchLog();
+    BenchWatch(KC_WATCH_JSON);
+    BenchWatch(KC_WATCH_CSV);
+    BenchEnumeration(1);
+    BenchEnumeration(SMC_POOL_DEF);
+    BenchEnumeration(SMC_POOL_MAX);
+    BenchKeyInfoCache(50);
+    BenchKeyInfoCache(500);
+    BenchKeyInfoCache(2000);
+    BenchSpeedCurve("linear", KCLinearSpeedAlghoritm, NULL);
+    BenchSpeedCurve("logarithmic", KCLogarithmicSpeedAlghoritm, NULL);
+    BenchSpeedCurve("quadratic", KCQuadraticSpeedAlghoritm, NULL);
+    BenchSpeedCurve("cubic", KCCubicSpeedAlghoritm, NULL);
+    BenchSpeedCurve("i-cubic", KCInverseCubicSpeedAlghoritm, NULL);
+    BenchSpeedCurve("wave", KCWaveSpeedAlghoritm, NULL);
+    BenchSpeedCurve("user 4 pts", KCCurveSpeedAlghoritm, "65:2000,70:2500,80:5000,85:6200");
+    BenchSpeedCurve("user 16 pts", KCCurveSpeedAlghoritm, "cubic,40:2000,43:2100,46:2200,49:2400,52:2600,55:2900,"
+                    "58:3200,61:3500,64:3900,67:4300,70:4700,73:5000,76:5400,79:5700,82:6000,85:6200");
+    BenchAlgorithm("linear", KCLinearSpeedAlghoritm);
+    BenchAlgorithm("logarithmic", KCLogarithmicSpeedAlghoritm);
+    BenchAlgorithm("quadratic", KCQuadraticSpeedAlghoritm);
+    BenchAlgorithm("cubic", KCCubicSpeedAlghoritm);
+    BenchAlgorithm("i-cubic", KCInverseCubicSpeedAlghoritm);
+    BenchAlgorithm("wave", KCWaveSpeedAlghoritm);
+    BenchAlgorithm("PID", KCPIDSpeedAlghoritm);
+    BenchAlgorithm("reset", KCResetSpeedAlghoritm);
+    BenchThermalLoad("quadratic", KCQuadraticSpeedAlghoritm, PlantLoad, 0.0, NULL);
+    BenchThermalLoad("PID", KCPIDSpeedAlghoritm, PlantLoad, 0.0, NULL);
+    BenchThermalLoad("bursts quad", KCQuadraticSpeedAlghoritm, PlantBursts, 0.0, NULL);
+    BenchThermalLoad("bursts quad+ff", KCQuadraticSpeedAlghoritm, PlantBursts, KC_LOAD_HINT_GAIN, NULL);
+    BenchThermalLoad("bursts PID", KCPIDSpeedAlghoritm, PlantBursts, 0.0, NULL);
+    BenchThermalLoad("bursts PID+ff", KCPIDSpeedAlghoritm, PlantBursts, KC_LOAD_HINT_GAIN, NULL);
+    BenchThermalLoad("noisy raw", KCQuadraticSpeedAlghoritm, PlantLoad, 0.0, "none");
+    BenchThermalLoad("noisy ema", KCQuadraticSpeedAlghoritm, PlantLoad, 0.0, "ema:0.3");
+    BenchThermalLoad("noisy median", KCQuadraticSpeedAlghoritm, PlantLoad, 0.0, "median:3");
+    BenchThermalLoad("noisy both", KCQuadraticSpeedAlghoritm, PlantLoad, 0.0, "both:3:0.5");
+    BenchTrace();
+    if (g_benchJSON)
+        printf("\n]\n");
+    return 0;
+}
@@ -26,22 +26,132 @@
 #include <signal.h>
 #include <syslog.h>
 #include <math.h>
-#include <IOKit/IOKitLib.h>
+#include <time.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
 #include "keep-cool.h"
-#include <libkern/OSAtomic.h>
+#include <pthread.h>
+#ifdef __APPLE__
+#include <mach/mach.h>
+#include <sys/event.h>
+#else
+#include <sys/inotify.h>
+#endif
+#include <stdatomic.h>
 
-// Cache the keyInfo to lower the energy impact of SMCReadKey() / SMCReadKey2()
-#define KEY_INFO_CACHE_SIZE 100
-struct {
-    UInt32 key;
+// Cache the keyInfo to lower the energy impact of SMCReadKey() / SMCReadKey2().
+// Open addressing hash table keyed on the packed key: readers never lock,
+// writers are serialized and publish each slot (and each grown table) with
+// a release store. Replaced tables are kept on a retired list until the
+// cache is reset, so a reader can never see freed memory.
+#define KEY_INFO_CACHE_MIN_SLOTS 128
+
+typedef struct {
+    _Atomic UInt32 key;
     SMCKeyData_keyInfo_t keyInfo;
-} g_keyInfoCache[KEY_INFO_CACHE_SIZE];
+    const SMCDecoder_t *decoder;
+} SMCKeyInfoSlot_t;
+
+typedef struct SMCKeyInfoTable {
+    UInt32 bits;
+    UInt32 count;
+    struct SMCKeyInfoTable *retired;
+    SMCKeyInfoSlot_t slot[];
+} SMCKeyInfoTable_t;
 
-int g_keyInfoCacheCount = 0;
-OSSpinLock g_keyInfoSpinLock = 0;
+_Atomic(SMCKeyInfoTable_t *) g_keyInfoCache = NULL;
+pthread_mutex_t g_keyInfoLock = PTHREAD_MUTEX_INITIALIZER;
 KC_Status_t *gbl_state = NULL;
 
-kern_return_t SMCCall2(int index, SMCKeyData_t *inputStructure, SMCKeyData_t *outputStructure, io_connect_t conn);
+// The SMC key index file, when loaded (see KCLoadKeyIndex())
+KC_KeyIndexHeader_t *g_keyIndex = NULL;
+size_t g_keyIndexSize = 0;
+
+// The status segment, mapped by the daemon only (see KCShmOpen())
+KC_ShmSegment_t *g_shm = NULL;
+
+// Number of SMC calls issued, per command, whatever the transport and thread
+_Atomic UInt32 g_smcCallStats[SMC_CMD_MAX];
+
+// Extra SMC connections used to enumerate the keys, g_conn being the first
+// one (see SMCScanKeys()). A size of 0 stands for SMC_POOL_DEF.
+typedef struct {
+    int                 size;
+    int                 open;
+    io_connect_t        conn[SMC_POOL_MAX];
+} SMCPool_t;
+
+SMCPool_t g_smcPool;
+
+// Tick records on their way to the trace file (see KCTraceOpen()). The
+// control loop is the only producer and the flush thread the only consumer:
+// each one owns its index and publishes it with a release store.
+typedef struct {
+    KC_TraceRecord_t    record[KC_TRACE_RING];
+    _Atomic UInt64      head;           /* next record to push */
+    _Atomic UInt64      tail;           /* next record to flush */
+    UInt64              dropped;        /* the ring was full */
+    _Atomic int         running;
+    pthread_t           thread;
+    pthread_mutex_t     lock;           /* only to wake up the flush thread */
+    pthread_cond_t      wakeup;
+    KC_TraceHeader_t    *map;
+    size_t              map_size;
+    int                 fd;
+} KC_Trace_t;
+
+KC_Trace_t g_trace = { .lock = PTHREAD_MUTEX_INITIALIZER, .wakeup = PTHREAD_COND_INITIALIZER, .fd = -1 };
+
+// Rate limit of a message class (see KCSysLogClass())
+typedef struct {
+    const char          *name;
+    UInt32              burst;          /* messages logged in a row */
+    UInt32              period;         /* s, to earn back a whole burst */
+} KC_LogClass_t;
+
+static const KC_LogClass_t g_kcLogClasses[KC_LOG_CLASSES] = {
+    { "general", 20, 60 },
+    { "sensor",   3, 60 },
+    { "smc",      3, 60 },
+};
+
+typedef struct {
+    int                 level;
+    char                msg[KC_LOG_BUFSIZE];
+} KC_LogEntry_t;
+
+// Messages on their way to syslog (see KCLogStart()). Everything is under
+// the lock, which the log thread never holds while it talks to syslog.
+typedef struct {
+    KC_LogEntry_t       entry[KC_LOG_QUEUE];
+    UInt64              head;           /* next message to push */
+    UInt64              tail;           /* next message to deliver */
+    UInt64              dropped;        /* the queue was full */
+    UInt64              dropped_logged;
+    int                 running;
+    int                 opened;         /* openlog() done */
+    pthread_t           thread;
+    pthread_mutex_t     lock;
+    pthread_cond_t      wakeup;
+    int                 last_level;     /* the last message queued, */
+    char                last[KC_LOG_BUFSIZE];
+    UInt32              repeats;        /* and how many times it came again */
+    UInt64              repeat_since;
+    double              tokens[KC_LOG_CLASSES];
+    UInt64              refilled[KC_LOG_CLASSES];
+    UInt32              suppressed[KC_LOG_CLASSES];
+    UInt32              suppressed_logged[KC_LOG_CLASSES];
+    UInt64              suppressed_total;
+} KC_Log_t;
+
+KC_Log_t g_log = { .lock = PTHREAD_MUTEX_INITIALIZER, .wakeup = PTHREAD_COND_INITIALIZER, .last_level = -1 };
 
 #pragma mark C Helpers
 
@@ -62,12 +172,11 @@ UInt32 _strtoul(char *str, int size, int base)
 
 void _ultostr(char *str, UInt32 val)
 {
-    str[0] = '\0';
-    sprintf(str, "%c%c%c%c", 
-            (unsigned int) val >> 24,
-            (unsigned int) val >> 16,
-            (unsigned int) val >> 8,
-            (unsigned int) val);
+    str[0] = (char)(val >> 24);
+    str[1] = (char)(val >> 16);
+    str[2] = (char)(val >> 8);
+    str[3] = (char)val;
+    str[4] = '\0';
 }
 
 float _strtof(unsigned char *str, int size, int e)
@@ -88,6 +197,15 @@ float _strtof(unsigned char *str, int size, int e)
     return total;
 }
 
+// Monotonic time in microseconds, used to measure SMC and tick latencies
+UInt64 _uptime_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (UInt64)ts.tv_sec * 1000000ULL + (UInt64)ts.tv_nsec / 1000ULL;
+}
+
 
 void printFP1F(SMCVal_t val)
 {
@@ -204,6 +322,11 @@ void printPWM(SMCVal_t val)
     printf("%.1f%% ", ntohs(*(UInt16*)val.bytes) * 100 / 65536.0);
 }
 
+void printFLT(SMCVal_t val)
+{
+    printf("%.3f ", SMCDecodeValue(&val));
+}
+
 void printBytesHex(SMCVal_t val)
 {
     int i;
@@ -214,59 +337,91 @@ void printBytesHex(SMCVal_t val)
     printf(")\n");
 }
 
+#pragma mark Data types
+
+static double SMCDecodeUnsigned(const SMCVal_t *val, double scale)
+{
+    return _strtoul((char *)val->bytes, val->dataSize, 10) / scale;
+}
+
+static double SMCDecodeSigned(const SMCVal_t *val, double scale)
+{
+    if (val->dataSize == 1)
+        return (SInt8)val->bytes[0] / scale;
+    return (SInt16)((val->bytes[0] << 8) | val->bytes[1]) / scale;
+}
+
+// IEEE 754 single, stored little endian by the SMC
+static double SMCDecodeFloat(const SMCVal_t *val, double scale)
+{
+    union { UInt32 u; float f; } v;
+
+    v.u = (UInt32)val->bytes[0] | ((UInt32)val->bytes[1] << 8) |
+          ((UInt32)val->bytes[2] << 16) | ((UInt32)val->bytes[3] << 24);
+    return v.f / scale;
+}
+
+// Every data type keep-cool understands, found by the packed type and size
+static const SMCDecoder_t g_smcDecoders[] = {
+    { SMC_TYPE('f','p','1','f'), 2, SMCDecodeUnsigned, 32768.0, printFP1F },
+    { SMC_TYPE('f','p','4','c'), 2, SMCDecodeUnsigned,  4096.0, printFP4C },
+    { SMC_TYPE('f','p','5','b'), 2, SMCDecodeUnsigned,  2048.0, printFP5B },
+    { SMC_TYPE('f','p','6','a'), 2, SMCDecodeUnsigned,  1024.0, printFP6A },
+    { SMC_TYPE('f','p','7','9'), 2, SMCDecodeUnsigned,   512.0, printFP79 },
+    { SMC_TYPE('f','p','8','8'), 2, SMCDecodeUnsigned,   256.0, printFP88 },
+    { SMC_TYPE('f','p','a','6'), 2, SMCDecodeUnsigned,    64.0, printFPA6 },
+    { SMC_TYPE('f','p','c','4'), 2, SMCDecodeUnsigned,    16.0, printFPC4 },
+    { SMC_TYPE('f','p','e','2'), 2, SMCDecodeUnsigned,     4.0, printFPE2 },
+    { SMC_TYPE('s','p','1','e'), 2, SMCDecodeSigned,   16384.0, printSP1E },
+    { SMC_TYPE('s','p','3','c'), 2, SMCDecodeSigned,    4096.0, printSP3C },
+    { SMC_TYPE('s','p','4','b'), 2, SMCDecodeSigned,    2048.0, printSP4B },
+    { SMC_TYPE('s','p','5','a'), 2, SMCDecodeSigned,    1024.0, printSP5A },
+    { SMC_TYPE('s','p','6','9'), 2, SMCDecodeSigned,     512.0, printSP69 },
+    { SMC_TYPE('s','p','7','8'), 2, SMCDecodeSigned,     256.0, printSP78 },
+    { SMC_TYPE('s','p','8','7'), 2, SMCDecodeSigned,     128.0, printSP87 },
+    { SMC_TYPE('s','p','9','6'), 2, SMCDecodeSigned,      64.0, printSP96 },
+    { SMC_TYPE('s','p','b','4'), 2, SMCDecodeSigned,      16.0, printSPB4 },
+    { SMC_TYPE('s','p','f','0'), 2, SMCDecodeSigned,       1.0, printSPF0 },
+    { SMC_TYPE('u','i','8',' '), 1, SMCDecodeUnsigned,     1.0, printUInt },
+    { SMC_TYPE('u','i','1','6'), 2, SMCDecodeUnsigned,     1.0, printUInt },
+    { SMC_TYPE('u','i','3','2'), 4, SMCDecodeUnsigned,     1.0, printUInt },
+    { SMC_TYPE('s','i','8',' '), 1, SMCDecodeSigned,       1.0, printSI8 },
+    { SMC_TYPE('s','i','1','6'), 2, SMCDecodeSigned,       1.0, printSI16 },
+    { SMC_TYPE('{','p','w','m'), 2, SMCDecodeUnsigned, 655.36,  printPWM },
+    { SMC_TYPE('f','l','t',' '), 4, SMCDecodeFloat,        1.0, printFLT },
+};
+
+// Resolved once per key, when its key info is cached: NULL for the types
+// keep-cool doesn't know, or a size that doesn't match the type
+const SMCDecoder_t *SMCDecoderOf(UInt32 dataType, UInt32 dataSize)
+{
+    int i;
+
+    for (i = 0; i < sizeof(g_smcDecoders) / sizeof(g_smcDecoders[0]); i++)
+    {
+        if (g_smcDecoders[i].dataType == dataType)
+            return g_smcDecoders[i].dataSize == dataSize ? &g_smcDecoders[i] : NULL;
+    }
+    return NULL;
+}
+
+// The value as a number, 0 when it has none
+double SMCDecodeValue(const SMCVal_t *val)
+{
+    if (val->decoder == NULL || val->dataSize == 0)
+        return 0.0;
+    return val->decoder->decode(val, val->decoder->scale);
+}
+
 void printVal(SMCVal_t val)
 {
     printf("  %-4s  [%-4s]  ", val.key, val.dataType);
     if (val.dataSize > 0)
     {
-        if ((strcmp(val.dataType, DATATYPE_UINT8) == 0) ||
-            (strcmp(val.dataType, DATATYPE_UINT16) == 0) ||
-            (strcmp(val.dataType, DATATYPE_UINT32) == 0))
-            printUInt(val);
-        else if (strcmp(val.dataType, DATATYPE_FP1F) == 0 && val.dataSize == 2)
-            printFP1F(val);
-        else if (strcmp(val.dataType, DATATYPE_FP4C) == 0 && val.dataSize == 2)
-            printFP4C(val);
-        else if (strcmp(val.dataType, DATATYPE_FP5B) == 0 && val.dataSize == 2)
-            printFP5B(val);
-        else if (strcmp(val.dataType, DATATYPE_FP6A) == 0 && val.dataSize == 2)
-            printFP6A(val);
-        else if (strcmp(val.dataType, DATATYPE_FP79) == 0 && val.dataSize == 2)
-            printFP79(val);
-        else if (strcmp(val.dataType, DATATYPE_FP88) == 0 && val.dataSize == 2)
-            printFP88(val);
-        else if (strcmp(val.dataType, DATATYPE_FPA6) == 0 && val.dataSize == 2)
-            printFPA6(val);
-        else if (strcmp(val.dataType, DATATYPE_FPC4) == 0 && val.dataSize == 2)
-            printFPC4(val);
-        else if (strcmp(val.dataType, DATATYPE_FPE2) == 0 && val.dataSize == 2)
-            printFPE2(val);
-		else if (strcmp(val.dataType, DATATYPE_SP1E) == 0 && val.dataSize == 2)
-			printSP1E(val);
-		else if (strcmp(val.dataType, DATATYPE_SP3C) == 0 && val.dataSize == 2)
-			printSP3C(val);
-		else if (strcmp(val.dataType, DATATYPE_SP4B) == 0 && val.dataSize == 2)
-			printSP4B(val);
-		else if (strcmp(val.dataType, DATATYPE_SP5A) == 0 && val.dataSize == 2)
-			printSP5A(val);
-		else if (strcmp(val.dataType, DATATYPE_SP69) == 0 && val.dataSize == 2)
-			printSP69(val);
-		else if (strcmp(val.dataType, DATATYPE_SP78) == 0 && val.dataSize == 2)
-			printSP78(val);
-		else if (strcmp(val.dataType, DATATYPE_SP87) == 0 && val.dataSize == 2)
-			printSP87(val);
-		else if (strcmp(val.dataType, DATATYPE_SP96) == 0 && val.dataSize == 2)
-			printSP96(val);
-		else if (strcmp(val.dataType, DATATYPE_SPB4) == 0 && val.dataSize == 2)
-			printSPB4(val);
-		else if (strcmp(val.dataType, DATATYPE_SPF0) == 0 && val.dataSize == 2)
-			printSPF0(val);
-		else if (strcmp(val.dataType, DATATYPE_SI8) == 0 && val.dataSize == 1)
-			printSI8(val);
-		else if (strcmp(val.dataType, DATATYPE_SI16) == 0 && val.dataSize == 2)
-			printSI16(val);
-		else if (strcmp(val.dataType, DATATYPE_PWM) == 0 && val.dataSize == 2)
-			printPWM(val);
+        if (val.decoder == NULL)
+            val.decoder = SMCDecoderOf(_strtoul(val.dataType, 4, 16), val.dataSize);
+        if (val.decoder != NULL)
+            val.decoder->print(val);
 
         printBytesHex(val);
     }
@@ -276,9 +431,10 @@ void printVal(SMCVal_t val)
     }
 }
 
-#pragma mark Shared SMC functions
+#pragma mark SMC transports
 
-kern_return_t SMCOpen(io_connect_t *conn)
+#ifdef __APPLE__
+kern_return_t SMCIOKitOpen(io_connect_t *conn)
 {
     kern_return_t result;
     mach_port_t   masterPort;
@@ -314,12 +470,12 @@ kern_return_t SMCOpen(io_connect_t *conn)
     return kIOReturnSuccess;
 }
 
-kern_return_t SMCClose(io_connect_t conn)
+kern_return_t SMCIOKitClose(io_connect_t conn)
 {
     return IOServiceClose(conn);
 }
 
-kern_return_t SMCCall2(int index, SMCKeyData_t *inputStructure, SMCKeyData_t *outputStructure,io_connect_t conn)
+kern_return_t SMCIOKitCall(int index, SMCKeyData_t *inputStructure, SMCKeyData_t *outputStructure,io_connect_t conn)
 {
     size_t   structureInputSize;
     size_t   structureOutputSize;
@@ -329,89 +485,387 @@ kern_return_t SMCCall2(int index, SMCKeyData_t *inputStructure, SMCKeyData_t *ou
     return IOConnectCallStructMethod(conn, index, inputStructure, structureInputSize, outputStructure, &structureOutputSize);
 }
 
-// Provides key info, using a cache to dramatically improve the energy impact of smcFanControl
-kern_return_t SMCGetKeyInfo(UInt32 key, SMCKeyData_keyInfo_t* keyInfo, io_connect_t conn)
+SMCTransport_t g_smcIOKitTransport = { "iokit", SMCIOKitOpen, SMCIOKitCall, SMCIOKitClose };
+SMCTransport_t *g_smcTransport = &g_smcIOKitTransport;
+#else
+SMCTransport_t *g_smcTransport = &g_smcSimTransport;
+#endif
+
+// Selects the SMC backend: "iokit" or "sim[:<latency_us>[:<extra_keys>]]"
+kern_return_t SMCSelectTransport(char *spec)
 {
-    SMCKeyData_t inputStructure;
-    SMCKeyData_t outputStructure;
-    kern_return_t result = kIOReturnSuccess;
-    int i = 0;
-    
-    OSSpinLockLock(&g_keyInfoSpinLock);
-    
-    for (; i < g_keyInfoCacheCount; ++i)
+#ifdef __APPLE__
+    if (strcmp(spec, g_smcIOKitTransport.name) == 0)
+    {
+        g_smcTransport = &g_smcIOKitTransport;
+        return kIOReturnSuccess;
+    }
+#endif
+    if (strncmp(spec, g_smcSimTransport.name, strlen(g_smcSimTransport.name)) == 0)
+    {
+        spec += strlen(g_smcSimTransport.name);
+        if (*spec != '\0' && *spec != ':')
+            return kIOReturnBadArgument;
+        if (SMCSimConfigure(*spec == ':' ? spec+1 : spec) != kIOReturnSuccess)
+            return kIOReturnBadArgument;
+        g_smcTransport = &g_smcSimTransport;
+        return kIOReturnSuccess;
+    }
+    return kIOReturnNotFound;
+}
+
+UInt32 SMCCallCount(void)
+{
+    UInt32 total = 0;
+    int    i;
+
+    for (i = 0; i < SMC_CMD_MAX; i++)
+        total += g_smcCallStats[i];
+    return total;
+}
+
+void SMCDumpCallStats(FILE *fp)
+{
+    fprintf(fp, "SMC calls (%s): %u total, %u read, %u write, %u keyinfo, %u index\n",
+            g_smcTransport->name, SMCCallCount(),
+            g_smcCallStats[SMC_CMD_READ_BYTES], g_smcCallStats[SMC_CMD_WRITE_BYTES],
+            g_smcCallStats[SMC_CMD_READ_KEYINFO], g_smcCallStats[SMC_CMD_READ_INDEX]);
+}
+
+#pragma mark Shared SMC functions
+
+kern_return_t SMCOpen(io_connect_t *conn)
+{
+    return g_smcTransport->open(conn);
+}
+
+kern_return_t SMCClose(io_connect_t conn)
+{
+    return g_smcTransport->close(conn);
+}
+
+kern_return_t SMCCall2(int index, SMCKeyData_t *inputStructure, SMCKeyData_t *outputStructure,io_connect_t conn)
+{
+    atomic_fetch_add_explicit(&g_smcCallStats[(UInt8)inputStructure->data8 % SMC_CMD_MAX], 1, memory_order_relaxed);
+    return g_smcTransport->call(index, inputStructure, outputStructure, conn);
+}
+
+#define SMCKeyInfoHash(key, bits) (((UInt32)(key) * 0x9E3779B1u) >> (32 - (bits)))
+
+static SMCKeyInfoTable_t *SMCKeyInfoTableAlloc(UInt32 bits)
+{
+    SMCKeyInfoTable_t *table;
+
+    table = calloc(1, sizeof(SMCKeyInfoTable_t) + (sizeof(SMCKeyInfoSlot_t) << bits));
+    if (table != NULL)
+        table->bits = bits;
+    return table;
+}
+
+// Stores an entry in a table the readers may already see: the key info is
+// written first and the slot becomes visible with the release of its key
+static void SMCKeyInfoTablePut(SMCKeyInfoTable_t *table, UInt32 key, SMCKeyData_keyInfo_t *keyInfo)
+{
+    UInt32 mask = (1u << table->bits) - 1;
+    UInt32 i = SMCKeyInfoHash(key, table->bits);
+    UInt32 k;
+
+    while ((k = atomic_load_explicit(&table->slot[i].key, memory_order_relaxed)) != 0)
     {
-        if (key == g_keyInfoCache[i].key)
+        if (k == key)
+            return;
+        i = (i + 1) & mask;
+    }
+    table->slot[i].keyInfo = *keyInfo;
+    table->slot[i].decoder = SMCDecoderOf(keyInfo->dataType, keyInfo->dataSize);
+    atomic_store_explicit(&table->slot[i].key, key, memory_order_release);
+    table->count++;
+}
+
+// Must be called with g_keyInfoLock held. Makes room for at least "keys"
+// entries, keeping the load factor under 1/2.
+static SMCKeyInfoTable_t *SMCKeyInfoCacheGrow(UInt32 keys)
+{
+    SMCKeyInfoTable_t *table = atomic_load_explicit(&g_keyInfoCache, memory_order_relaxed);
+    SMCKeyInfoTable_t *grown;
+    UInt32            bits = 7, i, k;
+
+    while ((1u << bits) < KEY_INFO_CACHE_MIN_SLOTS || (1u << bits) < keys * 2)
+        bits++;
+    if (table != NULL && table->bits >= bits)
+        return table;
+
+    grown = SMCKeyInfoTableAlloc(bits);
+    if (grown == NULL)
+        return table;
+    if (table != NULL)
+    {
+        for (i = 0; i < (1u << table->bits); i++)
         {
-            *keyInfo = g_keyInfoCache[i].keyInfo;
-            break;
+            k = atomic_load_explicit(&table->slot[i].key, memory_order_relaxed);
+            if (k != 0)
+                SMCKeyInfoTablePut(grown, k, &table->slot[i].keyInfo);
         }
+        grown->retired = table;
     }
+    atomic_store_explicit(&g_keyInfoCache, grown, memory_order_release);
+    return grown;
+}
+
+// Sizes the cache for the number of keys reported by the SMC (#KEY)
+void SMCKeyInfoCacheReserve(UInt32 keys)
+{
+    pthread_mutex_lock(&g_keyInfoLock);
+    SMCKeyInfoCacheGrow(keys);
+    pthread_mutex_unlock(&g_keyInfoLock);
+}
+
+static SMCKeyInfoSlot_t *SMCKeyInfoCacheFind(UInt32 key)
+{
+    SMCKeyInfoTable_t *table = atomic_load_explicit(&g_keyInfoCache, memory_order_acquire);
+    UInt32            mask, i, k;
+
+    if (table == NULL)
+        return NULL;
+
+    mask = (1u << table->bits) - 1;
+    i = SMCKeyInfoHash(key, table->bits);
+    while ((k = atomic_load_explicit(&table->slot[i].key, memory_order_acquire)) != 0)
+    {
+        if (k == key)
+            return &table->slot[i];
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+int SMCKeyInfoCacheLookup(UInt32 key, SMCKeyData_keyInfo_t *keyInfo)
+{
+    SMCKeyInfoSlot_t *slot = SMCKeyInfoCacheFind(key);
+
+    if (slot == NULL)
+        return 0;
+    *keyInfo = slot->keyInfo;
+    return 1;
+}
+
+void SMCKeyInfoCacheInsert(UInt32 key, SMCKeyData_keyInfo_t *keyInfo)
+{
+    SMCKeyInfoTable_t *table;
+
+    pthread_mutex_lock(&g_keyInfoLock);
+    table = atomic_load_explicit(&g_keyInfoCache, memory_order_relaxed);
+    if (table == NULL || (table->count + 1) * 2 > (1u << table->bits))
+        table = SMCKeyInfoCacheGrow(table == NULL ? 0 : table->count + 1);
+    if (table != NULL)
+        SMCKeyInfoTablePut(table, key, keyInfo);
+    pthread_mutex_unlock(&g_keyInfoLock);
+}
+
+// Drops every cached entry. No reader may be running.
+void SMCKeyInfoCacheReset(void)
+{
+    SMCKeyInfoTable_t *table, *retired;
+
+    pthread_mutex_lock(&g_keyInfoLock);
+    table = atomic_exchange(&g_keyInfoCache, NULL);
+    while (table != NULL)
+    {
+        retired = table->retired;
+        free(table);
+        table = retired;
+    }
+    pthread_mutex_unlock(&g_keyInfoLock);
+}
+
+// Provides key info, using a cache to dramatically improve the energy impact
+// of smcFanControl, and the decoder of the key type (when decoder isn't NULL)
+static kern_return_t SMCGetKeyInfoDecoder(UInt32 key, SMCKeyData_keyInfo_t* keyInfo, const SMCDecoder_t **decoder, io_connect_t conn)
+{
+    SMCKeyData_t inputStructure;
+    SMCKeyData_t outputStructure;
+    SMCKeyInfoSlot_t *slot;
+    kern_return_t result;
     
-    if (i == g_keyInfoCacheCount)
+    if ((slot = SMCKeyInfoCacheFind(key)) != NULL)
     {
-        // Not in cache, must look it up.
-        memset(&inputStructure, 0, sizeof(inputStructure));
-        memset(&outputStructure, 0, sizeof(outputStructure));
-        
-        inputStructure.key = key;
-        inputStructure.data8 = SMC_CMD_READ_KEYINFO;
-        
-        result = SMCCall2(KERNEL_INDEX_SMC, &inputStructure, &outputStructure, conn);
-        if (result == kIOReturnSuccess)
-        {
-            *keyInfo = outputStructure.keyInfo;
-            if (g_keyInfoCacheCount < KEY_INFO_CACHE_SIZE)
-            {
-                g_keyInfoCache[g_keyInfoCacheCount].key = key;
-                g_keyInfoCache[g_keyInfoCacheCount].keyInfo = outputStructure.keyInfo;
-                ++g_keyInfoCacheCount;
-            }
-        }
+        *keyInfo = slot->keyInfo;
+        if (decoder != NULL)
+            *decoder = slot->decoder;
+        return kIOReturnSuccess;
     }
     
-    OSSpinLockUnlock(&g_keyInfoSpinLock);
+    // Not in cache, must look it up.
+    memset(&inputStructure, 0, sizeof(inputStructure));
+    memset(&outputStructure, 0, sizeof(outputStructure));
+    
+    inputStructure.key = key;
+    inputStructure.data8 = SMC_CMD_READ_KEYINFO;
+    
+    result = SMCCall2(KERNEL_INDEX_SMC, &inputStructure, &outputStructure, conn);
+    if (result == kIOReturnSuccess)
+    {
+        *keyInfo = outputStructure.keyInfo;
+        SMCKeyInfoCacheInsert(key, keyInfo);
+        if (decoder != NULL)
+            *decoder = SMCDecoderOf(keyInfo->dataType, keyInfo->dataSize);
+    }
     
     return result;
 }
 
-kern_return_t SMCReadKey2(UInt32Char_t key, SMCVal_t *val,io_connect_t conn)
+kern_return_t SMCGetKeyInfo(UInt32 key, SMCKeyData_keyInfo_t* keyInfo, io_connect_t conn)
 {
-    kern_return_t result;
+    return SMCGetKeyInfoDecoder(key, keyInfo, NULL, conn);
+}
+
+// Reads several keys in one pass: key infos come from the cache, the input
+// structure is prepared once and only the key and size change between reads
+kern_return_t SMCReadKeys2(UInt32Char_t *keys, int count, SMCVal_t *vals, io_connect_t conn)
+{
+    kern_return_t result, retVal = kIOReturnSuccess;
     SMCKeyData_t  inputStructure;
     SMCKeyData_t  outputStructure;
+    SMCVal_t      *val;
+    int           i;
     
     memset(&inputStructure, 0, sizeof(SMCKeyData_t));
-    memset(&outputStructure, 0, sizeof(SMCKeyData_t));
-    memset(val, 0, sizeof(SMCVal_t));
-    
-    inputStructure.key = _strtoul(key, 4, 16);
-    /*sprintf(val->key, key);*/
-    strncpy(val->key, key, sizeof(UInt32Char_t));
-    val->key[sizeof(UInt32Char_t)-1] = '\0';
+    inputStructure.data8 = SMC_CMD_READ_BYTES;
     
-    result = SMCGetKeyInfo(inputStructure.key, &outputStructure.keyInfo, conn);
-    if (result != kIOReturnSuccess)
+    for (i = 0; i < count; i++)
     {
-        return result;
+        val = &vals[i];
+        memcpy(val->key, keys[i], sizeof(UInt32Char_t));
+        val->key[sizeof(UInt32Char_t)-1] = '\0';
+        val->dataSize = 0;
+        val->dataType[0] = '\0';
+        val->decoder = NULL;
+        
+        inputStructure.key = _strtoul(val->key, 4, 16);
+        result = SMCGetKeyInfoDecoder(inputStructure.key, &outputStructure.keyInfo, &val->decoder, conn);
+        if (result != kIOReturnSuccess)
+        {
+            retVal = result;
+            continue;
+        }
+        
+        _ultostr(val->dataType, outputStructure.keyInfo.dataType);
+        if (outputStructure.keyInfo.dataSize == 0)
+        {
+            // unknown key: nothing to read
+            memset(val->bytes, 0, sizeof(val->bytes));
+            continue;
+        }
+        inputStructure.keyInfo.dataSize = outputStructure.keyInfo.dataSize;
+        
+        result = SMCCall2(KERNEL_INDEX_SMC, &inputStructure, &outputStructure, conn);
+        if (result != kIOReturnSuccess)
+        {
+            retVal = result;
+            continue;
+        }
+        
+        val->dataSize = inputStructure.keyInfo.dataSize;
+        memcpy(val->bytes, outputStructure.bytes, sizeof(outputStructure.bytes));
     }
     
-    val->dataSize = outputStructure.keyInfo.dataSize;
-    _ultostr(val->dataType, outputStructure.keyInfo.dataType);
-    inputStructure.keyInfo.dataSize = val->dataSize;
-    inputStructure.data8 = SMC_CMD_READ_BYTES;
-    
-    result = SMCCall2(KERNEL_INDEX_SMC, &inputStructure, &outputStructure,conn);
+    return retVal;
+}
+
+kern_return_t SMCReadKey2(UInt32Char_t key, SMCVal_t *val,io_connect_t conn)
+{
+    return SMCReadKeys2((UInt32Char_t *)key, 1, val, conn);
+}
+
+// Converts the key and looks its info up once, for the keys accessed at
+// every tick. cmd is SMC_CMD_READ_BYTES or SMC_CMD_WRITE_BYTES. A key that
+// can't be resolved is retried by the next access to the handle.
+kern_return_t SMCResolveKey2(UInt32Char_t key, UInt8 cmd, SMCKeyHandle_t *handle, io_connect_t conn)
+{
+    SMCKeyData_keyInfo_t keyInfo;
+    UInt32Char_t         name;
+    kern_return_t        result;
+
+    memcpy(name, key, sizeof(UInt32Char_t));
+    name[sizeof(UInt32Char_t)-1] = '\0';
+    memset(handle, 0, sizeof(SMCKeyHandle_t));
+    memcpy(handle->key, name, sizeof(UInt32Char_t));
+    handle->request.key = _strtoul(handle->key, 4, 16);
+    handle->request.data8 = cmd;
+
+    result = SMCGetKeyInfoDecoder(handle->request.key, &keyInfo, &handle->decoder, conn);
     if (result != kIOReturnSuccess)
-    {
         return result;
-    }
-    
-    memcpy(val->bytes, outputStructure.bytes, sizeof(outputStructure.bytes));
-    
+    _ultostr(handle->dataType, keyInfo.dataType);
+    handle->request.keyInfo.dataSize = keyInfo.dataSize;
+    handle->resolved = 1;
     return kIOReturnSuccess;
 }
 
+// Same as SMCReadKeys2() on resolved keys, without any conversion or lookup:
+// only the size, decoder and bytes of the values are set, the key and its
+// type stay in the handle
+kern_return_t SMCReadHandles2(SMCKeyHandle_t *handles, int count, SMCVal_t *vals, io_connect_t conn)
+{
+    kern_return_t  result, retVal = kIOReturnSuccess;
+    SMCKeyData_t   outputStructure;
+    SMCKeyHandle_t *handle;
+    SMCVal_t       *val;
+    int            i;
+
+    for (i = 0; i < count; i++)
+    {
+        handle = &handles[i];
+        val = &vals[i];
+        val->dataSize = 0;
+        val->decoder = handle->decoder;
+
+        if (!handle->resolved)
+        {
+            result = SMCResolveKey2(handle->key, SMC_CMD_READ_BYTES, handle, conn);
+            if (result != kIOReturnSuccess)
+            {
+                retVal = result;
+                continue;
+            }
+            val->decoder = handle->decoder;
+        }
+        if (handle->request.keyInfo.dataSize == 0)
+            continue;
+
+        result = SMCCall2(KERNEL_INDEX_SMC, &handle->request, &outputStructure, conn);
+        if (result != kIOReturnSuccess)
+        {
+            retVal = result;
+            continue;
+        }
+        val->dataSize = handle->request.keyInfo.dataSize;
+        memcpy(val->bytes, outputStructure.bytes, sizeof(outputStructure.bytes));
+    }
+
+    return retVal;
+}
+
+// Same as SMCWriteKey2() on a key resolved for writes: only the bytes of
+// the prepared input structure change
+kern_return_t SMCWriteHandle2(SMCKeyHandle_t *handle, const SMCBytes_t bytes, UInt32 size, io_connect_t conn)
+{
+    SMCKeyData_t  outputStructure;
+    kern_return_t result;
+
+    if (!handle->resolved)
+    {
+        result = SMCResolveKey2(handle->key, SMC_CMD_WRITE_BYTES, handle, conn);
+        if (result != kIOReturnSuccess)
+            return result;
+    }
+    if (handle->request.keyInfo.dataSize != size)
+        return kIOReturnError;
+
+    memcpy(handle->request.bytes, bytes, size);
+    return SMCCall2(KERNEL_INDEX_SMC, &handle->request, &outputStructure, conn);
+}
+
 #pragma mark Command line only
 
 io_connect_t g_conn = 0;
@@ -421,6 +875,9 @@ void smc_init(){
 }
 
 void smc_close(){
+	while (g_smcPool.open > 1)
+		SMCClose(g_smcPool.conn[--g_smcPool.open]);
+	g_smcPool.open = 0;
 	SMCClose(g_conn);
 }
 
@@ -434,25 +891,45 @@ kern_return_t SMCReadKey(UInt32Char_t key, SMCVal_t *val)
     return SMCReadKey2(key, val, g_conn);
 }
 
+kern_return_t SMCReadKeys(UInt32Char_t *keys, int count, SMCVal_t *vals)
+{
+    return SMCReadKeys2(keys, count, vals, g_conn);
+}
+
+kern_return_t SMCResolveKey(UInt32Char_t key, UInt8 cmd, SMCKeyHandle_t *handle)
+{
+    return SMCResolveKey2(key, cmd, handle, g_conn);
+}
+
+kern_return_t SMCReadHandles(SMCKeyHandle_t *handles, int count, SMCVal_t *vals)
+{
+    return SMCReadHandles2(handles, count, vals, g_conn);
+}
+
+kern_return_t SMCWriteHandle(SMCKeyHandle_t *handle, const SMCBytes_t bytes, UInt32 size)
+{
+    return SMCWriteHandle2(handle, bytes, size, g_conn);
+}
+
 kern_return_t SMCWriteKey2(SMCVal_t writeVal, io_connect_t conn)
 {
     kern_return_t result;
     SMCKeyData_t  inputStructure;
     SMCKeyData_t  outputStructure;
     
-    SMCVal_t      readVal;
+    memset(&inputStructure, 0, sizeof(SMCKeyData_t));
+    memset(&outputStructure, 0, sizeof(SMCKeyData_t));
+    
+    inputStructure.key = _strtoul(writeVal.key, 4, 16);
     
-    result = SMCReadKey2(writeVal.key, &readVal,conn);
+    // the size is checked against the (cached) key info, no need to read the key back
+    result = SMCGetKeyInfo(inputStructure.key, &outputStructure.keyInfo, conn);
     if (result != kIOReturnSuccess)
         return result;
     
-    if (readVal.dataSize != writeVal.dataSize)
+    if (outputStructure.keyInfo.dataSize != writeVal.dataSize)
         return kIOReturnError;
     
-    memset(&inputStructure, 0, sizeof(SMCKeyData_t));
-    memset(&outputStructure, 0, sizeof(SMCKeyData_t));
-    
-    inputStructure.key = _strtoul(writeVal.key, 4, 16);
     inputStructure.data8 = SMC_CMD_WRITE_BYTES;
     inputStructure.keyInfo.dataSize = writeVal.dataSize;
     memcpy(inputStructure.bytes, writeVal.bytes, sizeof(writeVal.bytes));
@@ -471,51 +948,215 @@ kern_return_t SMCWriteKey(SMCVal_t writeVal)
 UInt32 SMCReadIndexCount(void)
 {
     SMCVal_t val;
+    UInt32   count;
+    
+    if (g_keyIndex != NULL)
+        return g_keyIndex->key_count;
     
     SMCReadKey("#KEY", &val);
-    return _strtoul((char *)val.bytes, val.dataSize, 10);
+    count = _strtoul((char *)val.bytes, val.dataSize, 10);
+    SMCKeyInfoCacheReserve(count);
+    return count;
 }
 
-kern_return_t SMCPrintAll(void)
+// Provides the key at a given SMC index, from the key index file if loaded
+kern_return_t SMCReadKeyAtIndex(UInt32 index, UInt32 *key)
+{
+    return SMCReadKeyAtIndex2(index, key, g_conn);
+}
+
+kern_return_t SMCReadKeyAtIndex2(UInt32 index, UInt32 *key, io_connect_t conn)
 {
     kern_return_t result;
     SMCKeyData_t  inputStructure;
     SMCKeyData_t  outputStructure;
     
-    int           totalKeys, i;
-    UInt32Char_t  key;
-    SMCVal_t      val;
-    
-    totalKeys = SMCReadIndexCount();
-    for (i = 0; i < totalKeys; i++)
+    if (g_keyIndex != NULL && index < g_keyIndex->key_count)
     {
-        memset(&inputStructure, 0, sizeof(SMCKeyData_t));
-        memset(&outputStructure, 0, sizeof(SMCKeyData_t));
-        memset(&val, 0, sizeof(SMCVal_t));
-        
-        inputStructure.data8 = SMC_CMD_READ_INDEX;
-        inputStructure.data32 = i;
-        
-        result = SMCCall(KERNEL_INDEX_SMC, &inputStructure, &outputStructure);
-        if (result != kIOReturnSuccess)
-            continue;
-        
-        _ultostr(key, outputStructure.key);
-        
-	if (key[0] == 'T') {
-		SMCReadKey(key, &val);
-		printVal(val);
-	}
+        *key = g_keyIndex->entry[index].key;
+        return kIOReturnSuccess;
     }
     
-    return kIOReturnSuccess;
-}
-
+    memset(&inputStructure, 0, sizeof(SMCKeyData_t));
+    memset(&outputStructure, 0, sizeof(SMCKeyData_t));
+    
+    inputStructure.data8 = SMC_CMD_READ_INDEX;
+    inputStructure.data32 = index;
+    
+    result = SMCCall2(KERNEL_INDEX_SMC, &inputStructure, &outputStructure, conn);
+    if (result == kIOReturnSuccess)
+        *key = outputStructure.key;
+    return result;
+}
+
+kern_return_t SMCReadVersion(SMCKeyData_vers_t *vers)
+{
+    kern_return_t result;
+    SMCKeyData_t  inputStructure;
+    SMCKeyData_t  outputStructure;
+    
+    memset(&inputStructure, 0, sizeof(SMCKeyData_t));
+    memset(&outputStructure, 0, sizeof(SMCKeyData_t));
+    memset(vers, 0, sizeof(SMCKeyData_vers_t));
+    
+    inputStructure.data8 = SMC_CMD_READ_VERS;
+    
+    result = SMCCall(KERNEL_INDEX_SMC, &inputStructure, &outputStructure);
+    if (result == kIOReturnSuccess && outputStructure.result == SMC_RESULT_SUCCESS)
+        *vers = outputStructure.vers;
+    return result;
+}
+
+#pragma mark Key enumeration
+
+// 1 enumerates on g_conn alone. The workers mostly wait for the SMC, so
+// the default doesn't depend on the number of CPUs.
+void SMCPoolSetSize(int size)
+{
+    g_smcPool.size = size > SMC_POOL_MAX ? SMC_POOL_MAX : size;
+}
+
+int SMCPoolSize(void)
+{
+    return g_smcPool.size > 0 ? g_smcPool.size : SMC_POOL_DEF;
+}
+
+// Opens the extra connections the first time they are needed, they stay
+// open until smc_close(). Returns how many connections are usable.
+static int SMCPoolOpen(int size)
+{
+    if (g_smcPool.open == 0)
+    {
+        g_smcPool.conn[0] = g_conn;
+        g_smcPool.open = 1;
+    }
+    while (g_smcPool.open < size)
+    {
+        if (SMCOpen(&g_smcPool.conn[g_smcPool.open]) != kIOReturnSuccess)
+            break;
+        g_smcPool.open++;
+    }
+    return g_smcPool.open < size ? g_smcPool.open : size;
+}
+
+typedef struct {
+    UInt32              prefix;
+    UInt32              mask;
+    UInt32              *keys;
+    SMCVal_t            *vals;
+    UInt32              count;
+    _Atomic UInt32      next;
+} SMCScan_t;
+
+typedef struct {
+    SMCScan_t           *scan;
+    io_connect_t        conn;
+    pthread_t           thread;
+} SMCScanWorker_t;
+
+// Takes chunks of indexes until none is left: every slot is written by the
+// worker owning its index only, so the results keep the SMC order
+static void *SMCScanThread(void *arg)
+{
+    SMCScanWorker_t *worker = arg;
+    SMCScan_t       *scan = worker->scan;
+    UInt32Char_t    key;
+    UInt32          first, last, i;
+
+    while ((first = atomic_fetch_add_explicit(&scan->next, SMC_POOL_CHUNK, memory_order_relaxed)) < scan->count)
+    {
+        last = first + SMC_POOL_CHUNK < scan->count ? first + SMC_POOL_CHUNK : scan->count;
+        for (i = first; i < last; i++)
+        {
+            if (SMCReadKeyAtIndex2(i, &scan->keys[i], worker->conn) != kIOReturnSuccess)
+                continue;
+            if ((scan->keys[i] & scan->mask) != scan->prefix)
+                continue;
+            _ultostr(key, scan->keys[i]);
+            SMCReadKey2(key, &scan->vals[i], worker->conn);
+        }
+    }
+    return NULL;
+}
+
+// Reads every key index and, for the keys matching the prefix, their value.
+// keys[i] is 0 when index i can't be read, vals[i].dataSize 0 when its key
+// doesn't match or can't be read. The indexes are spread over the pool,
+// each worker with its own connection; the key info cache is shared.
+kern_return_t SMCScanKeys(UInt32 prefix, UInt32 mask, UInt32 *keys, SMCVal_t *vals, UInt32 count)
+{
+    SMCScan_t       scan;
+    SMCScanWorker_t workers[SMC_POOL_MAX];
+    int             size, started, i;
+
+    memset(keys, 0, count * sizeof(UInt32));
+    memset(vals, 0, count * sizeof(SMCVal_t));
+    scan.prefix = prefix;
+    scan.mask = mask;
+    scan.keys = keys;
+    scan.vals = vals;
+    scan.count = count;
+    atomic_init(&scan.next, 0);
+
+    // not worth a thread when a worker would get less than a couple of chunks
+    size = SMCPoolSize();
+    if (size > (int)(count / (2 * SMC_POOL_CHUNK)))
+        size = count / (2 * SMC_POOL_CHUNK);
+    size = size > 1 ? SMCPoolOpen(size) : 1;
+
+    for (i = 0; i < size; i++)
+    {
+        workers[i].scan = &scan;
+        workers[i].conn = size > 1 ? g_smcPool.conn[i] : g_conn;
+    }
+    // the calling thread is the first worker
+    for (started = 1; started < size; started++)
+    {
+        if (pthread_create(&workers[started].thread, NULL, SMCScanThread, &workers[started]) != 0)
+            break;
+    }
+    SMCScanThread(&workers[0]);
+    for (i = 1; i < started; i++)
+        pthread_join(workers[i].thread, NULL);
+    
+    return kIOReturnSuccess;
+}
+
+kern_return_t SMCPrintAll(void)
+{
+    UInt32        *keys;
+    SMCVal_t      *vals;
+    int           totalKeys, i;
+    
+    totalKeys = SMCReadIndexCount();
+    keys = calloc(totalKeys > 0 ? totalKeys : 1, sizeof(UInt32));
+    vals = calloc(totalKeys > 0 ? totalKeys : 1, sizeof(SMCVal_t));
+    if (keys == NULL || vals == NULL)
+    {
+        free(keys);
+        free(vals);
+        return kIOReturnError;
+    }
+    
+    SMCScanKeys(SMC_TYPE('T',0,0,0), 0xff000000, keys, vals, totalKeys);
+    for (i = 0; i < totalKeys; i++)
+    {
+	if (vals[i].key[0] == 'T')
+		printVal(vals[i]);
+    }
+    
+    free(keys);
+    free(vals);
+    return kIOReturnSuccess;
+}
+
 kern_return_t SMCPrintFans(void)
 {
     kern_return_t result;
     SMCVal_t      val;
-    UInt32Char_t  key;
+    UInt32Char_t  keys[KC_MAX_FANS * 6 + 1];
+    SMCVal_t      vals[KC_MAX_FANS * 6 + 1];
+    SMCVal_t      *fan;
     int           totalFans, i;
     
     result = SMCReadKey("FNum", &val);
@@ -524,30 +1165,33 @@ kern_return_t SMCPrintFans(void)
     
     totalFans = _strtoul((char *)val.bytes, val.dataSize, 10);
     printf("Total fans in system: %d\n", totalFans);
+    if (totalFans > KC_MAX_FANS)
+        totalFans = KC_MAX_FANS;
+    
+    // fetch every fan key, plus the forced mode bitmask, in a single pass
+    for (i = 0; i < totalFans; i++)
+    {
+        SMCFanKey(keys[i*6], i, "ID");
+        SMCFanKey(keys[i*6+1], i, "Ac");
+        SMCFanKey(keys[i*6+2], i, "Mn");
+        SMCFanKey(keys[i*6+3], i, "Mx");
+        SMCFanKey(keys[i*6+4], i, "Sf");
+        SMCFanKey(keys[i*6+5], i, "Tg");
+    }
+    strcpy(keys[totalFans*6], "FS! ");
+    SMCReadKeys(keys, totalFans*6 + 1, vals);
     
     for (i = 0; i < totalFans; i++)
     {
+        fan = &vals[i*6];
         printf("\nFan #%d:\n", i);
-        sprintf(key, "F%dID", i);
-        SMCReadKey(key, &val);
-        printf("    Fan ID       : %s\n", val.bytes+4);
-        sprintf(key, "F%dAc", i); 
-        SMCReadKey(key, &val); 
-        printf("    Actual speed : %.0f\n", _strtof(val.bytes, val.dataSize, 2));
-        sprintf(key, "F%dMn", i);
-        SMCReadKey(key, &val);
-        printf("    Minimum speed: %.0f\n", _strtof(val.bytes, val.dataSize, 2));
-        sprintf(key, "F%dMx", i);
-        SMCReadKey(key, &val);
-        printf("    Maximum speed: %.0f\n", _strtof(val.bytes, val.dataSize, 2));
-        sprintf(key, "F%dSf", i);
-        SMCReadKey(key, &val);
-        printf("    Safe speed   : %.0f\n", _strtof(val.bytes, val.dataSize, 2));
-        sprintf(key, "F%dTg", i);
-        SMCReadKey(key, &val);
-        printf("    Target speed : %.0f\n", _strtof(val.bytes, val.dataSize, 2));
-        SMCReadKey("FS! ", &val);
-        if ((_strtoul((char *)val.bytes, 2, 16) & (1 << i)) == 0)
+        printf("    Fan ID       : %s\n", fan[0].bytes+4);
+        printf("    Actual speed : %.0f\n", _strtof(fan[1].bytes, fan[1].dataSize, 2));
+        printf("    Minimum speed: %.0f\n", _strtof(fan[2].bytes, fan[2].dataSize, 2));
+        printf("    Maximum speed: %.0f\n", _strtof(fan[3].bytes, fan[3].dataSize, 2));
+        printf("    Safe speed   : %.0f\n", _strtof(fan[4].bytes, fan[4].dataSize, 2));
+        printf("    Target speed : %.0f\n", _strtof(fan[5].bytes, fan[5].dataSize, 2));
+        if ((_strtoul((char *)vals[totalFans*6].bytes, 2, 16) & (1 << i)) == 0)
             printf("    Mode         : auto\n");
         else
             printf("    Mode         : forced\n");
@@ -563,6 +1207,8 @@ void usage(char* prog)
     printf("NOTE: it won't harm your MAC cause it only modifies the Minimum Fan Speed.\n");
     printf("\nUsage:\n");
     printf("%s [options]\n", prog);
+    printf("  -A <policy>: how the temperature of several sensors is combined: max (default)\n");
+    printf("               or mean, the mean weighted by the sensors weights\n");
     printf("  -a <alg>   : selects fan speed computing alghoritm: (default is quadratic)\n");
     printf("      s    -> linear: speed increments constantly between t-min and t-max,\n");
     printf("                      this is the _Simple approach\n");
@@ -588,189 +1234,3474 @@ void usage(char* prog)
     printf("                      This is a mathematical experiment that seems to have\n");
     printf("                      a nice behavior. It's a \"smooth 3-steps\" approach with\n");
     printf("                      quiet and conservative properties.\n");
+    printf("      p    -> PID: closed loop controller holding the temperature at the\n");
+    printf("                      target set with -P, instead of following a curve.\n");
+    printf("      u    -> User curve: the one given with -u.\n");
+    printf("  -B <smc>   : selects the SMC backend: iokit (default on OSX) or\n");
+    printf("               sim[:<latency_us>[:<extra_keys>]], an in-memory simulated SMC\n");
+    printf("  -c <cmd>   : sends a command to the running daemon and prints its reply:\n");
+    printf("               get-status, set-algorithm <alg>, set-min <ºC>, set-max <ºC>,\n");
+    printf("               force-speed <fan>|all <rpm>|auto\n");
+    printf("  -C <path>  : control socket of the daemon, or none (default %s)\n", KC_CONTROL_SOCKET);
     printf("  -d         : enable debug mode, dump internal state and values\n");
     printf("  -f         : run forever (runs as daemon)\n");
+    printf("  -F <fan>:[<alg>][:[<min>][:[<max>][:<key>[+<key>...]]]] : gives a fan its own\n");
+    printf("               algorithm, temperature range and sensors (among the -T ones),\n");
+    printf("               empty fields keep the global settings (e.g. -F 1:c::85:TG0P)\n");
     printf("  -g         : generates in the current directory the plist file required to\n");
     printf("               run as service using the same arguments passed from command line\n");
     printf("  -h         : prints this help\n");
+    printf("  -D <rpm>[:<rpm>] : speed changes smaller than this deadband are not written to\n");
+    printf("               the SMC, reversing direction also needs the hysteresis (default %d:%d)\n", KC_FAN_DEADBAND, KC_FAN_HYSTERESIS);
+    printf("  -k <file>  : configuration file, applied over the options and reloaded when\n");
+    printf("               it changes (with -f)\n");
+    printf("  -I <file>  : SMC key index file, which spares the key enumeration at startup\n");
+    printf("               (default %s), \"none\" disables it\n", KC_KEY_INDEX_FILE);
+    printf("  -j <conns> : SMC connections enumerating the keys for -L and the CPU sensor\n");
+    printf("               guess, each in its own thread (default %d, up to %d)\n", SMC_POOL_DEF, SMC_POOL_MAX);
     printf("  -l         : dump fan info decoded\n");
     printf("  -L         : list all SMC temperature sensors keys and values\n");
     printf("  -m <value> : set minimum temperature to start fan throttling (default %dºC)\n", KC_DEF_MIN_TEMP);
     printf("  -M <value> : set maximum temperature to set fan max speed (default %dºC)\n", KC_DEF_MAX_TEMP);
     printf("  -n         : dry run, do not actually modify fan speed\n");
+    printf("  -o <file>[:<KiB>] : records every poll of the daemon in a binary trace file\n");
+    printf("               of bounded size, the oldest records are overwritten (default %d KiB)\n", KC_TRACE_DEF_SIZE);
+    printf("  -p <min>[:<max>] : bounds of the polling interval in ms (default %d:%d), the\n", KC_POLL_MIN_INTERVAL, KC_POLL_MAX_INTERVAL);
+    printf("               interval adapts to how fast the temperature changes\n");
+    printf("  -P <target>[:<kp>[:<ki>[:<kd>[:<tau>]]]] : target temperature and gains of the\n");
+    printf("               PID algorithm (default %g:%g:%g:%g:%g)\n", KC_PID_TARGET, KC_PID_KP, KC_PID_KI, KC_PID_KD, KC_PID_TAU);
     printf("  -r         : run once and exits\n");
+    printf("  -R <file>  : replays a trace (see -o), or a CSV of \"<seconds>,<ºC>[,<ºC>...]\" lines,\n");
+    printf("               through every algorithm (and -u curve) and prints the writes and speeds\n");
+    printf("               of each\n");
     printf("  -s <value> : simulates temperature read as value (for testing purposes)\n");
+    printf("  -S <filter>: smooths the sensors readings: none, ema[:<alpha>], median[:<window>]\n");
+    printf("               or both[:<window>[:<alpha>]] (default none, median window %d)\n", KC_FILTER_DEF_WINDOW);
     printf("  -t         : print current temperature\n");
     printf("  -T <key>   : uses the provided key as temperature sensor. If you specify '?',\n");
     printf("             : then keep-cool will try to guess which is the CPU sensor\n");
+    printf("               Up to %d sensors can be given as <key>[:<weight>[:<offset>]],...\n", KC_MAX_SENSORS);
+    printf("               (e.g. \"?,TG0P:0.5,Th0H:1:5\"), the offset is added to the reading\n");
+    printf("  -u [<fan>=][linear,|cubic,]<ºC>:<rpm>,<ºC>:<rpm>... : a fan curve through the\n");
+    printf("               given points (up to %d), interpolated linearly or with a monotone\n", KC_CURVE_MAX_POINTS);
+    printf("               cubic, for all the fans or only one (e.g. -u 65:2000,75:3000,85:6200)\n");
+    printf("  -U <gain>[:<src>] : ºC added to the temperature when the CPU load jumps from\n");
+    printf("               idle to full, so that fans ramp before the temperature rises\n");
+    printf("               (default %g: off, %g is a good start), read from host (OSX) or proc\n", KC_LOAD_GAIN, KC_LOAD_HINT_GAIN);
+    printf("               (Linux)\n");
     printf("  -v         : print version\n");
+    printf("  -w <key>[,<key>...][:<ms>[:<format>[:<flush>]]] : samples the keys every <ms>\n");
+    printf("               (default %d) until interrupted, streamed as json (NDJSON, default)\n", KC_WATCH_DEF_INTERVAL);
+    printf("               or csv records; the output is flushed after every record (line),\n");
+    printf("               when the buffer is full (full) or every <flush> ms (default %d)\n", KC_WATCH_DEF_FLUSH);
     printf("\n");
 }
 
-kern_return_t SMCWriteSimple(UInt32Char_t key, char *wvalue, io_connect_t conn)
-{
-    kern_return_t result;
-    SMCVal_t   val;
-    int i;
-    char c[3];
-    for (i = 0; i < strlen(wvalue); i++)
-    {
-        sprintf(c, "%c%c", wvalue[i * 2], wvalue[(i * 2) + 1]);
-        val.bytes[i] = (int) strtol(c, NULL, 16);
+kern_return_t SMCWriteSimple(UInt32Char_t key, char *wvalue, io_connect_t conn)
+{
+    kern_return_t result;
+    SMCVal_t   val;
+    int i;
+    char c[3];
+    for (i = 0; i < strlen(wvalue); i++)
+    {
+        sprintf(c, "%c%c", wvalue[i * 2], wvalue[(i * 2) + 1]);
+        val.bytes[i] = (int) strtol(c, NULL, 16);
+    }
+    val.dataSize = i / 2;
+    /*sprintf(val.key, key);*/
+    strncpy(val.key, key, sizeof(UInt32Char_t));
+    val.key[sizeof(UInt32Char_t)-1] = '\0';
+    result = SMCWriteKey2(val, conn);
+    if (result != kIOReturnSuccess)
+        printf("Error: SMCWriteKey() = %08x\n", result);
+	
+    
+    return result;
+}
+
+// Converts a temperature reading, KC_ERROR_READING_TEMP if it can't be decoded
+// Any numeric type will do (sp78 on Intel Macs, flt on Apple Silicon),
+// the decoder comes with the value
+double SMCDecodeTemperature(SMCVal_t *val)
+{
+    if (val->dataSize > 0 && val->decoder != NULL)
+        return val->decoder->decode(val, val->decoder->scale);
+    return KC_ERROR_READING_TEMP;
+}
+
+double SMCGetTemperature(char *key)
+{
+    SMCVal_t val;
+    kern_return_t result;
+
+    result = SMCReadKey(key, &val);
+    if (result == kIOReturnSuccess)
+        return SMCDecodeTemperature(&val);
+    // read failed
+    return KC_ERROR_READING_TEMP;
+}
+
+// Reads several temperature sensors in a single pass, KC_ERROR_READING_TEMP
+// for each sensor that can't be read
+kern_return_t SMCGetTemperatures(UInt32Char_t *keys, int count, double *temps)
+{
+    SMCVal_t      vals[KC_MAX_SENSORS];
+    kern_return_t result;
+    int           i;
+
+    if (count > KC_MAX_SENSORS)
+        return kIOReturnBadArgument;
+
+    result = SMCReadKeys(keys, count, vals);
+    for (i = 0; i < count; i++)
+        temps[i] = SMCDecodeTemperature(&vals[i]);
+    return result;
+}
+
+kern_return_t SMCCountFans(KC_Status_t *state) {
+    kern_return_t result;
+    SMCVal_t      val, vals[KC_MAX_FANS];
+    UInt32Char_t  keys[KC_MAX_FANS];
+    int           i;
+    
+    result = SMCReadKey("FNum", &val);
+    if (result != kIOReturnSuccess)
+        return kIOReturnError;
+    state->num_fans = _strtoul((char *)val.bytes, val.dataSize, 10);
+    if (state->num_fans > KC_MAX_FANS)
+        state->num_fans = KC_MAX_FANS;
+
+    if (state->num_fans > 0) {
+        // every fan has its own max speed, the global curve uses the highest
+        for (i = 0; i < state->num_fans; i++)
+            SMCFanKey(keys[i], i, "Mx");
+        result = SMCReadKeys(keys, state->num_fans, vals);
+        if (vals[0].dataSize == 0)
+            return kIOReturnError;
+        state->max_speed = 0;
+        for (i = 0; i < state->num_fans; i++) {
+            if (vals[i].dataSize == 0)
+                vals[i] = vals[0];
+            state->fan[i].max_speed = _strtoul((char *)vals[i].bytes, vals[i].dataSize, 10) >> 2;
+            if (state->fan[i].max_speed > state->max_speed)
+                state->max_speed = state->fan[i].max_speed;
+        }
+	state->delta_v = (double)(state->max_speed-KC_FAN_MIN_SPEED);
+	KCInvalidateSpeedTable(state);
+    }
+
+    if (state->debug) {
+	printf("Number of Fans: %d (max speed %d rpm)\n", state->num_fans, state->max_speed);
+        for (i = 0; i < state->num_fans; i++)
+            printf("Fan [%d]: Max Speed = %d\n", i, state->fan[i].max_speed);
+    }
+
+    SMCPrepareTickKeys(state);
+    
+    return kIOReturnSuccess;
+}
+
+// Builds the "F<n><suffix>" key of a fan without going through sprintf
+void SMCFanKey(UInt32Char_t key, int fan, const char *suffix) {
+    key[0] = 'F';
+    key[1] = '0' + fan;
+    key[2] = suffix[0];
+    key[3] = suffix[1];
+    key[4] = '\0';
+}
+
+// The actual speed is never used to compute the new speed: it's read only
+// to be shown, in debug mode or in the status segment, or to be traced
+static int SMCReadsActualSpeed(KC_Status_t *state) {
+    return state->debug || g_shm != NULL || state->trace_file != NULL;
+}
+
+// Resolves, once, the keys refreshed at every tick: the temperature
+// sensors, the min speed of every fan and, when shown, the actual speed of
+// every fan. The min speed of every fan is also resolved for writes.
+void SMCPrepareTickKeys(KC_Status_t *state) {
+    UInt32Char_t key;
+    int          i, n = 0;
+
+    for (i = 0; i < state->num_sensors; i++)
+        SMCResolveKey(state->sensors[i].key, SMC_CMD_READ_BYTES, &state->tick_keys[n++]);
+    for (i = 0; i < state->num_fans; i++) {
+        SMCFanKey(key, i, "Mn");
+        SMCResolveKey(key, SMC_CMD_READ_BYTES, &state->tick_keys[n++]);
+        SMCResolveKey(key, SMC_CMD_WRITE_BYTES, &state->fan[i].min_key);
+    }
+    if (SMCReadsActualSpeed(state)) {
+        for (i = 0; i < state->num_fans; i++) {
+            SMCFanKey(key, i, "Ac");
+            SMCResolveKey(key, SMC_CMD_READ_BYTES, &state->tick_keys[n++]);
+        }
+    }
+    state->tick_key_count = n;
+}
+
+static void SMCDecodeFans(KC_Status_t *state, SMCVal_t *vals) {
+    int i;
+
+    for (i = 0; i < state->num_fans; i++)
+    {
+        state->fan[i].min_speed=(UInt32)_strtof(vals[i].bytes, vals[i].dataSize, 2);
+        // the tick keys may predate the status segment
+        if (state->tick_key_count == state->num_sensors + 2 * state->num_fans) {
+            SMCVal_t *val = &vals[state->num_fans + i];
+            state->fan[i].current_speed=(UInt32)_strtof(val->bytes, val->dataSize, 2);
+        }
+        if (state->debug) {
+	    printf("Fan [%d]: Min Speed = %d Current Speed = %d\n", i, state->fan[i].min_speed, state->fan[i].current_speed);
+        }
+    }
+}
+
+kern_return_t SMCUpdateFans(KC_Status_t *state) {
+    kern_return_t result;
+    SMCVal_t      vals[KC_TICK_KEYS];
+    
+    if (state->tick_key_count == 0)
+        SMCPrepareTickKeys(state);
+
+    result = SMCReadHandles(&state->tick_keys[state->num_sensors], state->tick_key_count-state->num_sensors, vals);
+    SMCDecodeFans(state, vals);
+    
+    return result;
+}
+
+// Refreshes temperature sensors and fans state with a single batched read
+kern_return_t SMCRefreshState(KC_Status_t *state) {
+    kern_return_t result;
+    SMCVal_t      vals[KC_TICK_KEYS];
+    int           i;
+
+    if (state->tick_key_count == 0)
+        SMCPrepareTickKeys(state);
+
+    result = SMCReadHandles(state->tick_keys, state->tick_key_count, vals);
+    state->sample_time = _uptime_us();
+    for (i = 0; i < state->num_sensors; i++) {
+        state->sensors[i].raw = SMCDecodeTemperature(&vals[i]);
+        state->sensors[i].temp = KCFilterSample(&state->filter, i, state->sensors[i].raw);
+    }
+    state->cur_temp = KCAggregateTemperature(state);
+    KCUpdateFanTemperatures(state);
+    SMCDecodeFans(state, &vals[state->num_sensors]);
+
+    return result;
+}
+
+// Tells whether a fan has to be written: changes smaller than the deadband
+// are elided, and a change reversing the direction of the previous one must
+// also exceed the hysteresis, so that a temperature hovering around a value
+// doesn't make the speed bounce up and down. Going back to the SMC default,
+// leaving it, or reaching the max speed is always written.
+int KCFanNeedsWrite(KC_Status_t *state, KC_FanState_t *fan, UInt16 newSpeed) {
+    UInt32 threshold = state->deadband;
+    int    direction;
+
+    if (newSpeed == fan->min_speed)
+        return 0;
+    if (newSpeed == KC_SMC_DEF_SPEED || fan->min_speed == KC_SMC_DEF_SPEED || newSpeed >= fan->max_speed)
+        return 1;
+
+    direction = newSpeed > fan->min_speed ? 1 : -1;
+    if (fan->last_direction != 0 && direction != fan->last_direction)
+        threshold += state->hysteresis;
+    return abs((int)newSpeed - (int)fan->min_speed) >= threshold;
+}
+
+// Computes the new speed of a fan (every fan follows its own curve) and
+// returns 1 when it has to be written to the SMC, with the fan state
+// already updated. Shared by SMCSetFanSpeed() and the replay.
+int KCStepFanSpeed(KC_Status_t *state, int i, UInt16 *newSpeed) {
+    KC_FanState_t *fan = &state->fan[i];
+
+    // a forced speed is written as is, the deadband doesn't apply
+    if (fan->forced_speed != 0) {
+        *newSpeed = (UInt16)fan->forced_speed;
+    } else {
+        *newSpeed = KCComputeFanSpeedOf(state, i);
+        KCFilterAccount(state, i, *newSpeed);
+    }
+    if (fan->forced_speed != 0 ? fan->min_speed != *newSpeed : KCFanNeedsWrite(state, fan, *newSpeed)) {
+	if (state->debug)
+	    printf("Changing speed of Fan[%d] from %d to %d (HexValue = %x)\n",i,fan->min_speed,*newSpeed,*newSpeed << 2);
+	fan->last_direction = *newSpeed > fan->min_speed ? 1 : -1;
+	fan->min_speed = *newSpeed;
+	state->writes++;
+	return 1;
+    }
+    if (fan->min_speed != *newSpeed) {
+	state->writes_elided++;
+	if (state->debug)
+	    printf("Speed change of Fan[%d] from %d to %d within the deadband\n",i,fan->min_speed,*newSpeed);
+    } else {
+	if (state->debug)
+	    printf("No need to change min speed of Fan[%d]\n",i);
+    }
+    return 0;
+}
+
+kern_return_t SMCSetFanSpeed(KC_Status_t *state) {
+    kern_return_t result = kIOReturnSuccess, retVal = kIOReturnSuccess;
+    SMCBytes_t    bytes;
+    int           i;
+    UInt16        newSpeed, byteVal;
+    char	  *value = (char *)&byteVal;
+
+    if (state->tick_key_count == 0)
+        SMCPrepareTickKeys(state);
+
+    for (i = 0; i < state->num_fans; i++)
+    {
+    	if (KCStepFanSpeed(state, i, &newSpeed)) {
+	    byteVal = newSpeed << 2;
+	    bytes[0] = (int)value[1];
+	    bytes[1] = (int)value[0];
+	    result = SMCWriteHandle(&state->fan[i].min_key, bytes, sizeof(byteVal));
+	    if (result != kIOReturnSuccess)
+	        retVal = result;
+	}
+    }
+
+    if (state->debug)
+        printf("SMC writes: %llu done, %llu elided\n", (unsigned long long)state->writes, (unsigned long long)state->writes_elided);
+    return retVal;
+}
+
+kern_return_t KCFindCPUSensor(KC_Status_t *state) {
+    double        cur_temp, max_temp = 0.0;
+    
+    int           totalKeys, i;
+    UInt32        *keys;
+    SMCVal_t      *vals;
+    char          *key;
+    UInt64        start = _uptime_us();
+    
+    totalKeys = SMCReadIndexCount();
+    keys = calloc(totalKeys > 0 ? totalKeys : 1, sizeof(UInt32));
+    vals = calloc(totalKeys > 0 ? totalKeys : 1, sizeof(SMCVal_t));
+    if (keys == NULL || vals == NULL) {
+        free(keys);
+        free(vals);
+        return kIOReturnError;
+    }
+    
+    SMCScanKeys(SMC_TYPE('T','C',0,0), 0xffff0000, keys, vals, totalKeys);
+    if (state->debug)
+        printf("Enumerated %d keys over %d SMC connections in %llu us\n", totalKeys,
+               g_smcPool.open > 1 ? g_smcPool.open : 1, (unsigned long long)(_uptime_us() - start));
+    
+    for (i = 0; i < totalKeys; i++)
+    {
+        key = vals[i].key;
+        
+	if (key[0] == 'T' && key[1] == 'C') {
+	    cur_temp = vals[i].dataSize > 0 ? SMCDecodeTemperature(&vals[i]) : KC_ERROR_READING_TEMP;
+            if (state->debug)
+                printf("Sensor \"%s\", Temperature %.2f°C\n",key,cur_temp);
+	   
+	    if (cur_temp >= max_temp && cur_temp < KC_WAKEUP_IGNORE_TEMP) {
+	        max_temp = cur_temp;
+                snprintf(state->temp_key, sizeof(state->temp_key), "%s", key);  
+	    }
+	}
+    }
+
+    if (state->debug)
+        printf("Using \"%s\" as CPU Temperature Sensor\n",state->temp_key);
+
+    // save the enumeration, so that the next start doesn't have to repeat it
+    if (g_keyIndex == NULL && state->temp_key[0] != '?' &&
+        KCWriteKeyIndex(state, keys, totalKeys) == kIOReturnSuccess && state->debug)
+        printf("Key index saved to %s\n", state->key_index_file);
+    free(keys);
+    free(vals);
+    
+    return kIOReturnSuccess;
+}
+
+#pragma mark Temperature sensors
+
+// Parses "<key>[:<weight>[:<offset>]],..." where a '?' key stands for the
+// guessed CPU sensor
+kern_return_t KCParseSensors(char *arg, KC_Status_t *state) {
+    KC_Sensor_t sensors[KC_MAX_SENSORS];
+    char        *item = arg, *end;
+    int         count = 0, len, guess = 0;
+
+    while (*item != '\0') {
+        KC_Sensor_t *sensor = &sensors[count];
+
+        if (count == KC_MAX_SENSORS)
+            return kIOReturnBadArgument;
+        len = strcspn(item, ":,");
+        if (len == 0 || len > 4 || (item[0] == '?' && len != 1))
+            return kIOReturnBadArgument;
+        memset(sensor, 0, sizeof(KC_Sensor_t));
+        memcpy(sensor->key, item, len);
+        sensor->weight = 1.0;
+        guess |= (item[0] == '?');
+        end = item + len;
+        if (*end == ':') {
+            sensor->weight = strtod(end + 1, &end);
+            if (sensor->weight <= 0.0)
+                return kIOReturnBadArgument;
+            if (*end == ':')
+                sensor->offset = strtod(end + 1, &end);
+        }
+        if (*end == ',')
+            end++;
+        else if (*end != '\0')
+            return kIOReturnBadArgument;
+        item = end;
+        count++;
+    }
+    if (count == 0)
+        return kIOReturnBadArgument;
+
+    memcpy(state->sensors, sensors, count * sizeof(KC_Sensor_t));
+    state->num_sensors = count;
+    // the CPU sensor is guessed when any sensor asks for it
+    strncpy(state->temp_key, guess ? "?" : sensors[0].key, sizeof(state->temp_key));
+    return kIOReturnSuccess;
+}
+
+// Without -T the sensor is the one of temp_key (the guessed CPU sensor)
+void KCDefaultSensors(KC_Status_t *state) {
+    if (state->num_sensors == 0) {
+        memset(&state->sensors[0], 0, sizeof(KC_Sensor_t));
+        state->sensors[0].weight = 1.0;
+        state->num_sensors = 1;
+        strncpy(state->sensors[0].key, state->temp_key, sizeof(UInt32Char_t));
+    }
+}
+
+// Replaces the '?' sensors with the guessed CPU sensor
+void KCResolveSensors(KC_Status_t *state) {
+    int i;
+
+    KCDefaultSensors(state);
+    for (i = 0; i < state->num_sensors; i++) {
+        if (state->sensors[i].key[0] == '?')
+            strncpy(state->sensors[i].key, state->temp_key, sizeof(UInt32Char_t));
+    }
+}
+
+// Formats the sensors the way -T takes them
+void KCFormatSensors(char *buf, size_t size, KC_Status_t *state) {
+    size_t len = 0;
+    int    i;
+
+    buf[0] = '\0';
+    for (i = 0; i < state->num_sensors && len < size; i++) {
+        KC_Sensor_t *sensor = &state->sensors[i];
+
+        len += snprintf(buf + len, size - len, "%s%s", i > 0 ? "," : "", sensor->key);
+        if (len < size && (sensor->weight != 1.0 || sensor->offset != 0.0))
+            len += snprintf(buf + len, size - len, ":%g", sensor->weight);
+        if (len < size && sensor->offset != 0.0)
+            len += snprintf(buf + len, size - len, ":%g", sensor->offset);
+    }
+}
+
+// Combines the last readings of the sensors in mask, each one with its offset
+// added: the hottest of them, or their weighted mean. Sensors that can't be
+// read are left out, KC_ERROR_READING_TEMP if none can.
+static double KCAggregate(KC_Status_t *state, UInt32 mask, int raw) {
+    double temp, result = KC_ERROR_READING_TEMP, weights = 0.0;
+    int    i;
+
+    for (i = 0; i < state->num_sensors; i++) {
+        KC_Sensor_t *sensor = &state->sensors[i];
+
+        temp = raw ? sensor->raw : sensor->temp;
+        if (!(mask & (1 << i)) || temp == KC_ERROR_READING_TEMP)
+            continue;
+        temp += sensor->offset;
+        if (state->sensor_policy == KC_SENSOR_MEAN) {
+            result += sensor->weight * temp;
+            weights += sensor->weight;
+        } else if (weights == 0.0 || temp > result) {
+            result = temp;
+            weights = 1.0;
+        }
+    }
+    if (weights == 0.0)
+        return KC_ERROR_READING_TEMP;
+    return state->sensor_policy == KC_SENSOR_MEAN ? result / weights : result;
+}
+
+double KCAggregateSensors(KC_Status_t *state, UInt32 mask) {
+    return KCAggregate(state, mask, 0);
+}
+
+// The temperature a fan would follow without the filter
+static double KCRawFanTemperature(KC_Status_t *state, int i) {
+    double temp = KCAggregate(state, state->fan[i].sensor_mask ? state->fan[i].sensor_mask : ~0U, 1);
+
+    if (temp == KC_ERROR_READING_TEMP)
+        temp = KCAggregate(state, ~0U, 1);
+    return temp == KC_ERROR_READING_TEMP ? temp : temp + state->load.lead;
+}
+
+double KCAggregateTemperature(KC_Status_t *state) {
+    return KCAggregateSensors(state, ~0U);
+}
+
+// The temperature each fan follows: the one of its own sensors, or the
+// global one when it has none or none of them can be read
+void KCUpdateFanTemperatures(KC_Status_t *state) {
+    int i;
+
+    for (i = 0; i < KC_MAX_FANS; i++) {
+        KC_FanState_t *fan = &state->fan[i];
+
+        fan->cur_temp = state->cur_temp;
+        if (fan->sensor_mask != 0) {
+            double temp = KCAggregateSensors(state, fan->sensor_mask);
+            if (temp != KC_ERROR_READING_TEMP)
+                fan->cur_temp = temp;
+        }
+    }
+}
+
+// Reads all the sensors in one pass and aggregates them
+kern_return_t KCReadTemperature(KC_Status_t *state) {
+    UInt32Char_t  keys[KC_MAX_SENSORS];
+    double        temps[KC_MAX_SENSORS];
+    kern_return_t result;
+    int           i;
+
+    for (i = 0; i < state->num_sensors; i++)
+        strncpy(keys[i], state->sensors[i].key, sizeof(UInt32Char_t));
+    result = SMCGetTemperatures(keys, state->num_sensors, temps);
+    state->sample_time = _uptime_us();
+    for (i = 0; i < state->num_sensors; i++) {
+        state->sensors[i].raw = temps[i];
+        state->sensors[i].temp = KCFilterSample(&state->filter, i, temps[i]);
+    }
+    state->cur_temp = KCAggregateTemperature(state);
+    KCUpdateFanTemperatures(state);
+    return result;
+}
+
+void KCPrintSensors(KC_Status_t *state) {
+    int i;
+
+    if (state->num_sensors == 1) {
+        printf("Sensor %s, current temperature: %.2fºC (read %.2fºC)\n",state->temp_key, state->cur_temp,
+               state->sensors[0].raw);
+        return;
+    }
+    for (i = 0; i < state->num_sensors; i++)
+        printf("Sensor %s, temperature: %.2fºC (read %.2fºC, weight %g, offset %+g)\n", state->sensors[i].key,
+               state->sensors[i].temp, state->sensors[i].raw, state->sensors[i].weight, state->sensors[i].offset);
+    printf("Sensors %s of %d sensors: %.2fºC\n", state->sensor_policy == KC_SENSOR_MEAN ? "weighted mean" : "max",
+           state->num_sensors, state->cur_temp);
+}
+
+#pragma mark Key index file
+
+// The key index is a snapshot of the SMC key enumeration and of the key info
+// cache, mapped in memory at startup. It's trusted only while the SMC reports
+// the same version and the same number of keys it was written with.
+static kern_return_t KCKeyIndexSignature(KC_KeyIndexHeader_t *header) {
+    SMCVal_t val;
+    kern_return_t result;
+
+    memset(header, 0, sizeof(KC_KeyIndexHeader_t));
+    header->magic = KC_KEY_INDEX_MAGIC;
+    header->version = KC_KEY_INDEX_VERSION;
+    result = SMCReadVersion(&header->smc_vers);
+    if (result != kIOReturnSuccess)
+        return result;
+    result = SMCReadKey("#KEY", &val);
+    if (result != kIOReturnSuccess)
+        return result;
+    header->key_count = _strtoul((char *)val.bytes, val.dataSize, 10);
+    return kIOReturnSuccess;
+}
+
+kern_return_t KCLoadKeyIndex(KC_Status_t *state) {
+    KC_KeyIndexHeader_t current, *header;
+    struct stat         st;
+    UInt32              i;
+    int                 fd;
+
+    if (state->key_index_file == NULL)
+        return kIOReturnNotFound;
+
+    fd = open(state->key_index_file, O_RDONLY);
+    if (fd < 0)
+        return kIOReturnNotFound;
+    if (fstat(fd, &st) != 0 || st.st_size < sizeof(KC_KeyIndexHeader_t)) {
+        close(fd);
+        return kIOReturnNotFound;
+    }
+    header = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED)
+        return kIOReturnNotFound;
+
+    if (header->magic != KC_KEY_INDEX_MAGIC || header->version != KC_KEY_INDEX_VERSION ||
+        st.st_size != sizeof(KC_KeyIndexHeader_t) + header->key_count * sizeof(KC_KeyIndexEntry_t) ||
+        KCKeyIndexSignature(&current) != kIOReturnSuccess ||
+        memcmp(&current.smc_vers, &header->smc_vers, sizeof(SMCKeyData_vers_t)) != 0 ||
+        current.key_count != header->key_count) {
+        if (state->debug)
+            printf("Key index %s is stale, ignoring it\n", state->key_index_file);
+        munmap(header, st.st_size);
+        return kIOReturnNotFound;
+    }
+
+    // seed the key info cache with every key whose info was known
+    SMCKeyInfoCacheReserve(header->key_count);
+    for (i = 0; i < header->key_count; i++) {
+        KC_KeyIndexEntry_t   *entry = &header->entry[i];
+        SMCKeyData_keyInfo_t keyInfo;
+
+        if (entry->dataType == 0)
+            continue;
+        keyInfo.dataSize = entry->dataSize;
+        keyInfo.dataType = entry->dataType;
+        keyInfo.dataAttributes = entry->dataAttributes;
+        SMCKeyInfoCacheInsert(entry->key, &keyInfo);
+    }
+
+    if (state->temp_key[0] == '?' && header->sensor[0] != '\0')
+        strncpy(state->temp_key, header->sensor, sizeof(state->temp_key));
+
+    g_keyIndex = header;
+    g_keyIndexSize = st.st_size;
+    if (state->debug)
+        printf("Loaded key index %s (%u keys, sensor \"%s\")\n", state->key_index_file, header->key_count, header->sensor);
+    return kIOReturnSuccess;
+}
+
+kern_return_t KCWriteKeyIndex(KC_Status_t *state, UInt32 *keys, UInt32 count) {
+    KC_KeyIndexHeader_t  header;
+    KC_KeyIndexEntry_t   entry;
+    SMCKeyData_keyInfo_t keyInfo;
+    char                 tmpFile[PATH_MAX];
+    FILE                 *fp;
+    UInt32               i;
+    int                  fd;
+
+    if (state->key_index_file == NULL)
+        return kIOReturnNotFound;
+    if (KCKeyIndexSignature(&header) != kIOReturnSuccess || header.key_count != count)
+        return kIOReturnError;
+    strncpy(header.sensor, state->temp_key, sizeof(header.sensor));
+
+    // write a new file and rename it over the old one: a reader never sees a partial index
+    snprintf(tmpFile, sizeof(tmpFile), "%s.tmp", state->key_index_file);
+    unlink(tmpFile);
+    fd = open(tmpFile, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+        return kIOReturnError;
+    fp = fdopen(fd, "w");
+    if (fp == NULL) {
+        close(fd);
+        unlink(tmpFile);
+        return kIOReturnError;
+    }
+
+    fwrite(&header, sizeof(header), 1, fp);
+    for (i = 0; i < count; i++) {
+        memset(&entry, 0, sizeof(entry));
+        entry.key = keys[i];
+        if (SMCKeyInfoCacheLookup(keys[i], &keyInfo)) {
+            entry.dataType = keyInfo.dataType;
+            entry.dataSize = keyInfo.dataSize;
+            entry.dataAttributes = keyInfo.dataAttributes;
+        }
+        fwrite(&entry, sizeof(entry), 1, fp);
+    }
+
+    if (fclose(fp) != 0 || rename(tmpFile, state->key_index_file) != 0) {
+        unlink(tmpFile);
+        return kIOReturnError;
+    }
+    return kIOReturnSuccess;
+}
+
+#pragma mark Tick engine
+
+// Ticks are scheduled on absolute monotonic deadlines, each one computed
+// from the previous deadline and not from the time the previous tick
+// ended, so the SMC latency never accumulates into the period.
+void KCTickEngineInit(KC_TickEngine_t *tick) {
+    memset(tick, 0, sizeof(KC_TickEngine_t));
+    tick->deadline = _uptime_us();
+}
+
+static void KCSleepUntil(UInt64 deadline) {
+    struct timespec ts;
+#ifdef __APPLE__
+    UInt64          now;
+
+    // no clock_nanosleep() on OSX: sleep the remaining time, again if interrupted
+    while ((now = _uptime_us()) < deadline) {
+        ts.tv_sec = (deadline - now) / 1000000;
+        ts.tv_nsec = ((deadline - now) % 1000000) * 1000;
+        nanosleep(&ts, NULL);
+    }
+#else
+    ts.tv_sec = deadline / 1000000;
+    ts.tv_nsec = (deadline % 1000000) * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+#endif
+}
+
+// Sleeps until the deadline of the next tick and accounts the wakeup jitter
+void KCTickEngineWait(KC_TickEngine_t *tick, char debug) {
+    KCSleepUntil(tick->deadline);
+    KCTickEngineStart(tick, debug);
+}
+
+// Starts a tick once its deadline passed, however the caller waited for it
+void KCTickEngineStart(KC_TickEngine_t *tick, char debug) {
+    UInt64 jitter;
+
+    tick->started = _uptime_us();
+    jitter = tick->started > tick->deadline ? tick->started - tick->deadline : 0;
+    tick->jitter_sum += jitter;
+    if (jitter > tick->jitter_max)
+        tick->jitter_max = jitter;
+    tick->ticks++;
+    if (debug)
+        printf("\nTick %llu: woke up %llu us after its deadline\n", (unsigned long long)tick->ticks, (unsigned long long)jitter);
+}
+
+// Sets the deadline of the next tick, "period" us after the current one.
+// A tick whose work ends past the next deadline is an overrun: the next tick
+// starts right away if it's late by less than a period, otherwise the missed
+// ticks are skipped (never run in a burst) and the schedule keeps its phase.
+void KCTickEngineAdvance(KC_TickEngine_t *tick, UInt64 period) {
+    UInt64 now = _uptime_us();
+    UInt64 work = now - tick->started;
+    UInt64 missed;
+
+    if (work > tick->work_max)
+        tick->work_max = work;
+    tick->deadline += period;
+    if (now > tick->deadline) {
+        tick->overruns++;
+        missed = (now - tick->deadline) / period;
+        tick->skipped += missed;
+        tick->deadline += missed * period;
+    }
+}
+
+void KCReportWrites(KC_Status_t *state) {
+    char msg[KC_LOG_BUFSIZE];
+
+    snprintf(msg, sizeof(msg), "SMC writes: %llu done, %llu elided by the %u rpm deadband",
+             (unsigned long long)state->writes, (unsigned long long)state->writes_elided, state->deadband);
+    if (state->debug)
+        printf("%s\n", msg);
+    else
+        KCSysLog(LOG_NOTICE, msg);
+}
+
+void KCReportTicks(KC_Status_t *state) {
+    KC_TickEngine_t *tick = &state->tick;
+    char            msg[KC_LOG_BUFSIZE];
+
+    if (tick->ticks == 0)
+        return;
+    snprintf(msg, sizeof(msg), "Ticks: %llu, jitter avg %llu us max %llu us, work max %llu us, %llu overruns, %llu skipped",
+             (unsigned long long)tick->ticks, (unsigned long long)(tick->jitter_sum / tick->ticks),
+             (unsigned long long)tick->jitter_max, (unsigned long long)tick->work_max,
+             (unsigned long long)tick->overruns, (unsigned long long)tick->skipped);
+    if (state->debug)
+        printf("%s\n", msg);
+    else
+        KCSysLog(LOG_NOTICE, msg);
+}
+
+#pragma mark Logging
+
+// Delivers a message on the one syslog connection of the process
+static void KCLogWrite(int level, char *msg) {
+    if (!g_log.opened) {
+        setlogmask(LOG_UPTO(LOG_NOTICE));
+        openlog("keep-cool", LOG_CONS | LOG_PID | LOG_NDELAY, LOG_DAEMON);
+        g_log.opened = 1;
+    }
+    syslog(level, "%s", msg);
+}
+
+// Queues a message for the log thread, the lock held. Never blocks: when
+// the queue is full the message is dropped and counted.
+static void KCLogPush(KC_Log_t *log, int level, char *msg) {
+    KC_LogEntry_t *entry;
+
+    if (log->head - log->tail >= KC_LOG_QUEUE) {
+        log->dropped++;
+        return;
+    }
+    entry = &log->entry[log->head++ % KC_LOG_QUEUE];
+    entry->level = level;
+    snprintf(entry->msg, sizeof(entry->msg), "%s", msg);
+    pthread_cond_signal(&log->wakeup);
+}
+
+// Logs how many times the last message came again since it was logged
+static void KCLogFlushRepeats(KC_Log_t *log) {
+    char msg[KC_LOG_BUFSIZE];
+
+    if (log->repeats == 0)
+        return;
+    snprintf(msg, sizeof(msg), "last message repeated %u times", log->repeats);
+    KCLogPush(log, log->last_level, msg);
+    log->repeats = 0;
+}
+
+// Token bucket of a message class: a burst, then one message every
+// period/burst s. Critical messages always get through.
+static int KCLogAdmit(KC_Log_t *log, int cls, int level, UInt64 now) {
+    const KC_LogClass_t *limit = &g_kcLogClasses[cls];
+    double              tokens;
+
+    tokens = log->tokens[cls] + (double)(now - log->refilled[cls]) * limit->burst / (limit->period * 1000000.0);
+    log->tokens[cls] = tokens > limit->burst ? limit->burst : tokens;
+    log->refilled[cls] = now;
+    if (level <= LOG_CRIT || log->tokens[cls] >= 1.0) {
+        if (log->tokens[cls] >= 1.0)
+            log->tokens[cls] -= 1.0;
+        return 1;
+    }
+    log->suppressed[cls]++;
+    log->suppressed_total++;
+    return 0;
+}
+
+static void *KCLogThread(void *arg) {
+    KC_Log_t        *log = arg;
+    KC_LogEntry_t   entry;
+    struct timespec ts;
+    UInt64          dropped;
+
+    pthread_mutex_lock(&log->lock);
+    while (log->running || log->tail != log->head) {
+        if (log->tail == log->head) {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += KC_LOG_REPEAT_FLUSH;
+            pthread_cond_timedwait(&log->wakeup, &log->lock, &ts);
+            if (log->repeats != 0 && _uptime_us() - log->repeat_since >= KC_LOG_REPEAT_FLUSH * 1000000ULL)
+                KCLogFlushRepeats(log);
+            continue;
+        }
+        // syslog() may block, never with the lock held
+        entry = log->entry[log->tail++ % KC_LOG_QUEUE];
+        dropped = log->dropped - log->dropped_logged;
+        log->dropped_logged = log->dropped;
+        pthread_mutex_unlock(&log->lock);
+
+        KCLogWrite(entry.level, entry.msg);
+        if (dropped != 0) {
+            snprintf(entry.msg, sizeof(entry.msg), "%llu log messages dropped, the queue was full", (unsigned long long)dropped);
+            KCLogWrite(LOG_WARNING, entry.msg);
+        }
+        pthread_mutex_lock(&log->lock);
+    }
+    pthread_mutex_unlock(&log->lock);
+    return NULL;
+}
+
+// From now on the messages are delivered by the log thread
+kern_return_t KCLogStart(void) {
+    KC_Log_t *log = &g_log;
+    UInt64   now = _uptime_us();
+    int      i;
+
+    for (i = 0; i < KC_LOG_CLASSES; i++) {
+        log->tokens[i] = g_kcLogClasses[i].burst;
+        log->refilled[i] = now;
+    }
+    log->running = 1;
+    if (pthread_create(&log->thread, NULL, KCLogThread, log) != 0) {
+        log->running = 0;
+        return kIOReturnError;
+    }
+    return kIOReturnSuccess;
+}
+
+// Delivers the queued messages and stops the log thread
+void KCLogStop(void) {
+    KC_Log_t *log = &g_log;
+    char     msg[KC_LOG_BUFSIZE];
+
+    pthread_mutex_lock(&log->lock);
+    if (!log->running) {
+        pthread_mutex_unlock(&log->lock);
+        return;
+    }
+    KCLogFlushRepeats(log);
+    log->running = 0;
+    pthread_cond_signal(&log->wakeup);
+    pthread_mutex_unlock(&log->lock);
+    pthread_join(log->thread, NULL);
+
+    if (log->suppressed_total != 0) {
+        snprintf(msg, sizeof(msg), "Log: %llu messages suppressed by the rate limits (%s %u, %s %u, %s %u)",
+                 (unsigned long long)log->suppressed_total,
+                 g_kcLogClasses[KC_LOG_GENERAL].name, log->suppressed[KC_LOG_GENERAL],
+                 g_kcLogClasses[KC_LOG_SENSOR].name, log->suppressed[KC_LOG_SENSOR],
+                 g_kcLogClasses[KC_LOG_SMC].name, log->suppressed[KC_LOG_SMC]);
+        KCLogWrite(LOG_NOTICE, msg);
+    }
+}
+
+// Logs a message of a class. While the log thread runs this only queues it:
+// a message equal to the previous one is counted instead ("last message
+// repeated N times"), and each class is rate limited, so that a flapping
+// sensor neither floods syslog nor stalls the control loop.
+void KCSysLogClass(int cls, int level, char *msg) {
+    KC_Log_t *log = &g_log;
+    char     note[KC_LOG_BUFSIZE];
+
+    pthread_mutex_lock(&log->lock);
+    if (!log->running) {
+        KCLogWrite(level, msg);
+        pthread_mutex_unlock(&log->lock);
+        return;
+    }
+    if (level == log->last_level && strcmp(msg, log->last) == 0) {
+        if (log->repeats++ == 0)
+            log->repeat_since = _uptime_us();
+        pthread_mutex_unlock(&log->lock);
+        return;
+    }
+    KCLogFlushRepeats(log);
+    if (!KCLogAdmit(log, cls, level, _uptime_us())) {
+        pthread_mutex_unlock(&log->lock);
+        return;
+    }
+    if (log->suppressed[cls] != log->suppressed_logged[cls]) {
+        snprintf(note, sizeof(note), "%u %s messages suppressed by the rate limit",
+                 log->suppressed[cls] - log->suppressed_logged[cls], g_kcLogClasses[cls].name);
+        log->suppressed_logged[cls] = log->suppressed[cls];
+        KCLogPush(log, LOG_NOTICE, note);
+    }
+    KCLogPush(log, level, msg);
+    log->last_level = level;
+    snprintf(log->last, sizeof(log->last), "%s", msg);
+    pthread_mutex_unlock(&log->lock);
+}
+
+void KCSysLog(int level, char *msg) {
+    KCSysLogClass(KC_LOG_GENERAL, level, msg);
+}
+
+#pragma mark Trace
+
+// Parses "<file>[:<KiB>]"
+kern_return_t KCParseTrace(char *arg, KC_Status_t *state) {
+    char          *sep = strrchr(arg, ':');
+    unsigned long size = KC_TRACE_DEF_SIZE;
+    char          *end;
+
+    if (sep != NULL) {
+        size = strtoul(sep + 1, &end, 10);
+        if (end == sep + 1 || *end != '\0' || size < KC_TRACE_MIN_SIZE || size > 1024 * 1024)
+            return kIOReturnBadArgument;
+        *sep = '\0';
+    }
+    if (*arg == '\0')
+        return kIOReturnBadArgument;
+    state->trace_file = arg;
+    state->trace_size = (UInt32)size;
+    return kIOReturnSuccess;
+}
+
+// Moves the pending records from the ring to the file
+static void KCTraceFlush(KC_Trace_t *trace) {
+    KC_TraceHeader_t *header = trace->map;
+    KC_TraceRecord_t *slots = (KC_TraceRecord_t *)(header + 1);
+    UInt64           tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+    UInt64           head = atomic_load_explicit(&trace->head, memory_order_acquire);
+
+    if (tail == head)
+        return;
+    for (; tail != head; tail++)
+        slots[header->next++ % header->capacity] = trace->record[tail % KC_TRACE_RING];
+    atomic_store_explicit(&trace->tail, tail, memory_order_release);
+    msync(header, trace->map_size, MS_ASYNC);
+}
+
+static void *KCTraceThread(void *arg) {
+    KC_Trace_t      *trace = arg;
+    struct timespec ts;
+
+    pthread_mutex_lock(&trace->lock);
+    while (atomic_load(&trace->running)) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += KC_TRACE_FLUSH;
+        pthread_cond_timedwait(&trace->wakeup, &trace->lock, &ts);
+        KCTraceFlush(trace);
+    }
+    pthread_mutex_unlock(&trace->lock);
+    return NULL;
+}
+
+// Maps the trace file, sized once and for all, and starts the flush thread.
+// A file left by a previous run with the same layout is appended to.
+kern_return_t KCTraceOpen(KC_Status_t *state) {
+    KC_Trace_t       *trace = &g_trace;
+    KC_TraceHeader_t *header;
+    UInt32           capacity;
+    struct stat      st;
+    int              i;
+
+    if (state->trace_file == NULL)
+        return kIOReturnSuccess;
+
+    capacity = (UInt32)(((size_t)state->trace_size * 1024 - sizeof(KC_TraceHeader_t)) / sizeof(KC_TraceRecord_t));
+    trace->map_size = sizeof(KC_TraceHeader_t) + (size_t)capacity * sizeof(KC_TraceRecord_t);
+    trace->fd = open(state->trace_file, O_RDWR | O_CREAT, 0644);
+    if (trace->fd < 0)
+        return kIOReturnError;
+    if (fstat(trace->fd, &st) != 0 || (st.st_size != trace->map_size && ftruncate(trace->fd, 0) != 0) ||
+        ftruncate(trace->fd, trace->map_size) != 0) {
+        close(trace->fd);
+        trace->fd = -1;
+        return kIOReturnError;
+    }
+    header = mmap(NULL, trace->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, trace->fd, 0);
+    if (header == MAP_FAILED) {
+        close(trace->fd);
+        trace->fd = -1;
+        return kIOReturnError;
+    }
+    if (header->magic != KC_TRACE_MAGIC || header->version != KC_TRACE_VERSION ||
+        header->record_size != sizeof(KC_TraceRecord_t) || header->capacity != capacity) {
+        memset(header, 0, sizeof(KC_TraceHeader_t));
+        header->magic = KC_TRACE_MAGIC;
+        header->version = KC_TRACE_VERSION;
+        header->record_size = sizeof(KC_TraceRecord_t);
+        header->capacity = capacity;
+    }
+    for (i = 0; i < KC_MAX_FANS; i++)
+        header->max_speed[i] = i < state->num_fans ? (UInt16)state->fan[i].max_speed : 0;
+    trace->map = header;
+
+    atomic_store(&trace->running, 1);
+    if (pthread_create(&trace->thread, NULL, KCTraceThread, trace) != 0) {
+        atomic_store(&trace->running, 0);
+        munmap(header, trace->map_size);
+        close(trace->fd);
+        trace->map = NULL;
+        trace->fd = -1;
+        return kIOReturnError;
+    }
+    if (state->debug)
+        printf("Tracing to %s (%u records, %llu already there)\n", state->trace_file, capacity,
+               (unsigned long long)header->next);
+    return kIOReturnSuccess;
+}
+
+// Queues a record for the flush thread. Never blocks: when the ring is full
+// the record is dropped and counted. Returns 0 when dropped.
+int KCTracePush(const KC_TraceRecord_t *record) {
+    KC_Trace_t *trace = &g_trace;
+    UInt64     head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+
+    if (head - atomic_load_explicit(&trace->tail, memory_order_acquire) >= KC_TRACE_RING) {
+        trace->dropped++;
+        return 0;
+    }
+    trace->record[head % KC_TRACE_RING] = *record;
+    atomic_store_explicit(&trace->head, head + 1, memory_order_release);
+    return 1;
+}
+
+// Records a control tick that started at tick_start and spent smc_us reading
+// the SMC, failed or not: flags tells what went wrong
+void KCTraceTick(KC_Status_t *state, UInt64 tick_start, UInt64 smc_us, UInt32 smc_calls, UInt16 flags) {
+    KC_TraceRecord_t record;
+    int              i;
+
+    if (g_trace.map == NULL)
+        return;
+    memset(&record, 0, sizeof(record));
+    record.time = state->sample_time;
+    record.tick_us = (UInt32)(_uptime_us() - tick_start);
+    record.smc_us = (UInt32)smc_us;
+    record.smc_calls = (UInt16)smc_calls;
+    record.num_sensors = (UInt8)state->num_sensors;
+    record.num_fans = (UInt8)state->num_fans;
+    record.temp = (SInt16)KCTemperatureCode(state->cur_temp);
+    record.lead = (SInt16)KCTemperatureCode(state->load.lead);
+    for (i = 0; i < state->num_sensors; i++)
+        record.raw[i] = (SInt16)KCTemperatureCode(state->sensors[i].raw);
+    for (i = 0; i < state->num_fans && i < KC_MAX_FANS; i++) {
+        record.speed[i] = state->fan[i].speed;
+        record.actual[i] = (UInt16)state->fan[i].current_speed;
+    }
+    record.errors = (UInt16)state->errors_count;
+    record.flags = flags;
+    KCTracePush(&record);
+}
+
+// Stops the flush thread once the ring is drained
+void KCTraceClose(KC_Status_t *state) {
+    KC_Trace_t *trace = &g_trace;
+    char       msg[KC_LOG_BUFSIZE];
+
+    if (trace->map == NULL)
+        return;
+    pthread_mutex_lock(&trace->lock);
+    atomic_store(&trace->running, 0);
+    pthread_cond_signal(&trace->wakeup);
+    pthread_mutex_unlock(&trace->lock);
+    pthread_join(trace->thread, NULL);
+    KCTraceFlush(trace);
+
+    snprintf(msg, sizeof(msg), "Trace: %llu records in %s, %llu dropped",
+             (unsigned long long)trace->map->next, state->trace_file, (unsigned long long)trace->dropped);
+    if (state->debug)
+        printf("%s\n", msg);
+    else
+        KCSysLog(LOG_NOTICE, msg);
+    msync(trace->map, trace->map_size, MS_SYNC);
+    munmap(trace->map, trace->map_size);
+    close(trace->fd);
+    trace->map = NULL;
+    trace->fd = -1;
+}
+
+#pragma mark Status segment
+
+static const struct {
+    char                letter;
+    KC_SpeedAlgorithm_t algorithm;
+    const char          *name;
+} g_kcAlgorithms[] = {
+    { 's', KCLinearSpeedAlghoritm,       "linear (Simple)" },
+    { 'c', KCLogarithmicSpeedAlghoritm,  "logarithmic (Conservative)" },
+    { 'q', KCQuadraticSpeedAlghoritm,    "quadratic (Quiet)" },
+    { 'b', KCCubicSpeedAlghoritm,        "cubic (Balanced)" },
+    { 'i', KCInverseCubicSpeedAlghoritm, "i-cubic (I-Balanced)" },
+    { 'w', KCWaveSpeedAlghoritm,         "3-Steps (Wave)" },
+    { 'p', KCPIDSpeedAlghoritm,          "PID" },
+    { 'u', KCCurveSpeedAlghoritm,        "user curve" },
+    { 'r', KCResetSpeedAlghoritm,        "SMC default" },
+};
+
+static char KCAlgorithmLetter(KC_SpeedAlgorithm_t algorithm) {
+    int i;
+
+    for (i = 0; i < sizeof(g_kcAlgorithms) / sizeof(g_kcAlgorithms[0]); i++) {
+        if (g_kcAlgorithms[i].algorithm == algorithm)
+            return g_kcAlgorithms[i].letter;
+    }
+    return '?';
+}
+
+static const char *KCAlgorithmName(char letter) {
+    int i;
+
+    for (i = 0; i < sizeof(g_kcAlgorithms) / sizeof(g_kcAlgorithms[0]); i++) {
+        if (g_kcAlgorithms[i].letter == letter)
+            return g_kcAlgorithms[i].name;
+    }
+    return "unknown";
+}
+
+// Creates the segment afresh, a leftover of a previous daemon is unlinked:
+// its readers keep their mapping, new ones get this one
+kern_return_t KCShmOpen(KC_Status_t *state) {
+    KC_ShmSegment_t *shm;
+    int             fd;
+
+    shm_unlink(KC_SHM_NAME);
+    fd = shm_open(KC_SHM_NAME, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+        return kIOReturnError;
+    if (ftruncate(fd, sizeof(KC_ShmSegment_t)) != 0) {
+        close(fd);
+        shm_unlink(KC_SHM_NAME);
+        return kIOReturnError;
+    }
+    shm = mmap(NULL, sizeof(KC_ShmSegment_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        shm_unlink(KC_SHM_NAME);
+        return kIOReturnError;
+    }
+    memset(shm, 0, sizeof(KC_ShmSegment_t));
+    shm->version = KC_SHM_VERSION;
+    shm->size = sizeof(KC_ShmSegment_t);
+    shm->pid = (UInt32)getpid();
+    // readers check the magic last
+    atomic_thread_fence(memory_order_release);
+    shm->magic = KC_SHM_MAGIC;
+    g_shm = shm;
+    return kIOReturnSuccess;
+}
+
+// Writer side of the seqlock: the status is built on the stack and copied
+// in while seq is odd, so that readers retry as seldom as possible
+void KCShmWrite(KC_ShmSegment_t *shm, KC_Status_t *state) {
+    _Atomic UInt32  *seq = (_Atomic UInt32 *)&shm->seq;
+    KC_ShmStatus_t  status;
+    struct timespec now;
+    UInt32          s;
+    int             i;
+
+    memset(&status, 0, sizeof(status));
+    clock_gettime(CLOCK_REALTIME, &now);
+    // sample_time is monotonic, the status tells the wall clock time
+    status.time = (UInt64)now.tv_sec * 1000000 + now.tv_nsec / 1000 - (_uptime_us() - state->sample_time);
+    status.ticks = shm->status.ticks + 1;
+    status.temp = state->cur_temp;
+    status.lead = state->load.lead;
+    status.min_temp = state->min_temp;
+    status.max_temp = state->max_temp;
+    status.errors = (UInt32)state->errors_count;
+    status.algorithm = KCAlgorithmLetter(state->compute_fan_speed);
+    status.dry_run = state->dry_run;
+    status.num_fans = (UInt8)state->num_fans;
+    status.num_sensors = (UInt8)state->num_sensors;
+    for (i = 0; i < state->num_fans && i < KC_MAX_FANS; i++) {
+        status.fan[i].min_speed = state->fan[i].min_speed;
+        status.fan[i].current_speed = state->fan[i].current_speed;
+        status.fan[i].max_speed = state->fan[i].max_speed;
+        status.fan[i].speed = state->fan[i].speed;
+        status.fan[i].temp = state->fan[i].cur_temp;
+    }
+    for (i = 0; i < state->num_sensors && i < KC_MAX_SENSORS; i++) {
+        memcpy(status.sensor_key[i], state->sensors[i].key, sizeof(UInt32Char_t));
+        status.sensor_temp[i] = state->sensors[i].temp;
+    }
+
+    s = atomic_load_explicit(seq, memory_order_relaxed);
+    atomic_store_explicit(seq, s + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(&shm->status, &status, sizeof(status));
+    atomic_store_explicit(seq, s + 2, memory_order_release);
+}
+
+void KCShmPublish(KC_Status_t *state) {
+    if (g_shm != NULL)
+        KCShmWrite(g_shm, state);
+}
+
+void KCShmClose(KC_Status_t *state) {
+    if (g_shm == NULL)
+        return;
+    shm_unlink(KC_SHM_NAME);
+    munmap(g_shm, sizeof(KC_ShmSegment_t));
+    g_shm = NULL;
+}
+
+// Reader side of the seqlock, kIOReturnNotFound until the first publish
+kern_return_t KCShmSnapshot(KC_ShmSegment_t *shm, KC_ShmStatus_t *status) {
+    _Atomic UInt32 *seq = (_Atomic UInt32 *)&shm->seq;
+    UInt32         before, after;
+    int            i;
+
+    if (shm->magic != KC_SHM_MAGIC || shm->version != KC_SHM_VERSION || shm->size != sizeof(KC_ShmSegment_t))
+        return kIOReturnNotFound;
+    for (i = 0; i < KC_SHM_RETRIES; i++) {
+        before = atomic_load_explicit(seq, memory_order_acquire);
+        if (before & 1)
+            continue;
+        memcpy(status, &shm->status, sizeof(KC_ShmStatus_t));
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(seq, memory_order_relaxed);
+        if (before == after)
+            return before == 0 ? kIOReturnNotFound : kIOReturnSuccess;
+    }
+    return kIOReturnError;
+}
+
+// The status of the running daemon: kIOReturnNotFound when there is none
+kern_return_t KCShmRead(KC_ShmStatus_t *status) {
+    KC_ShmSegment_t *shm;
+    kern_return_t   result;
+    int             fd;
+
+    fd = shm_open(KC_SHM_NAME, O_RDONLY, 0);
+    if (fd < 0)
+        return kIOReturnNotFound;
+    shm = mmap(NULL, sizeof(KC_ShmSegment_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED)
+        return kIOReturnNotFound;
+    result = KCShmSnapshot(shm, status);
+    // a daemon killed with SIGKILL leaves its segment behind
+    if (result == kIOReturnSuccess && kill((pid_t)shm->pid, 0) != 0 && errno == ESRCH)
+        result = kIOReturnNotFound;
+    munmap(shm, sizeof(KC_ShmSegment_t));
+    return result;
+}
+
+// -t and -l, answered by the daemon status
+void KCShmPrintTemperature(KC_ShmStatus_t *status) {
+    int i;
+
+    if (status->num_sensors == 1) {
+        printf("SMC Sensor %s: Temperature = %.2fºC\n", status->sensor_key[0], status->temp);
+        return;
+    }
+    for (i = 0; i < status->num_sensors; i++)
+        printf("Sensor %s, temperature: %.2fºC\n", status->sensor_key[i], status->sensor_temp[i]);
+    printf("Sensors temperature: %.2fºC\n", status->temp);
+}
+
+void KCShmPrintFans(KC_ShmStatus_t *status) {
+    struct timespec now;
+    double          age;
+    int             i;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    age = now.tv_sec + now.tv_nsec / 1e9 - status->time / 1e6;
+    printf("Total fans in system: %d\n", status->num_fans);
+    for (i = 0; i < status->num_fans; i++) {
+        printf("\nFan #%d:\n", i);
+        printf("    Actual speed : %u\n", status->fan[i].current_speed);
+        printf("    Minimum speed: %u\n", status->fan[i].min_speed);
+        printf("    Maximum speed: %u\n", status->fan[i].max_speed);
+        printf("    Temperature  : %.2fºC\n", status->fan[i].temp);
+    }
+    printf("\nkeep-cool: %s%s, %.2fºC, %u errors, updated %.1f s ago\n", KCAlgorithmName(status->algorithm),
+           status->dry_run ? " (dry run)" : "", status->temp, status->errors, age);
+}
+
+#pragma mark Replay
+
+// Streams the records of a trace file (mapped, oldest first) or of a CSV
+// file ("<seconds>,<ºC>[,<ºC>...]" lines, one column per sensor), without
+// ever loading the whole file.
+typedef struct {
+    FILE             *fp;
+    KC_TraceHeader_t *map;
+    size_t           size;
+    UInt64           first;
+    UInt64           index;
+    UInt64           count;
+} KC_ReplayReader_t;
+
+static kern_return_t KCReplayOpen(char *file, KC_ReplayReader_t *reader) {
+    KC_TraceHeader_t *header;
+    struct stat      st;
+    int              fd;
+
+    memset(reader, 0, sizeof(KC_ReplayReader_t));
+    fd = open(file, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0)
+            close(fd);
+        return kIOReturnNotFound;
+    }
+    if (st.st_size >= sizeof(KC_TraceHeader_t)) {
+        header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (header != MAP_FAILED && header->magic == KC_TRACE_MAGIC && header->version == KC_TRACE_VERSION &&
+            header->record_size == sizeof(KC_TraceRecord_t) &&
+            st.st_size == sizeof(KC_TraceHeader_t) + (size_t)header->capacity * sizeof(KC_TraceRecord_t)) {
+            madvise(header, st.st_size, MADV_SEQUENTIAL);
+            close(fd);
+            reader->map = header;
+            reader->size = st.st_size;
+            reader->count = header->next < header->capacity ? header->next : header->capacity;
+            reader->first = header->next - reader->count;
+            return kIOReturnSuccess;
+        }
+        if (header != MAP_FAILED)
+            munmap(header, st.st_size);
+    }
+    reader->fp = fdopen(fd, "r");
+    if (reader->fp == NULL) {
+        close(fd);
+        return kIOReturnError;
+    }
+    return kIOReturnSuccess;
+}
+
+static void KCReplayRewind(KC_ReplayReader_t *reader) {
+    reader->index = 0;
+    if (reader->fp != NULL)
+        rewind(reader->fp);
+}
+
+static int KCReplayNext(KC_ReplayReader_t *reader, KC_TraceRecord_t *record) {
+    char   line[512], *p, *end;
+    double value;
+
+    if (reader->map != NULL) {
+        if (reader->index >= reader->count)
+            return 0;
+        *record = ((KC_TraceRecord_t *)(reader->map + 1))[(reader->first + reader->index++) % reader->map->capacity];
+        return 1;
+    }
+
+    while (fgets(line, sizeof(line), reader->fp) != NULL) {
+        // a header, a comment or a blank line
+        value = strtod(line, &end);
+        if (end == line)
+            continue;
+        memset(record, 0, sizeof(KC_TraceRecord_t));
+        record->time = (UInt64)(value * 1000000.0);
+        for (p = end; record->num_sensors < KC_MAX_SENSORS; p = end) {
+            while (*p == ',' || *p == ' ' || *p == '\t')
+                p++;
+            value = strtod(p, &end);
+            if (end == p)
+                break;
+            record->raw[record->num_sensors++] = (SInt16)KCTemperatureCode(value);
+        }
+        if (record->num_sensors > 0)
+            return 1;
+    }
+    return 0;
+}
+
+static void KCReplayClose(KC_ReplayReader_t *reader) {
+    if (reader->map != NULL)
+        munmap(reader->map, reader->size);
+    if (reader->fp != NULL)
+        fclose(reader->fp);
+}
+
+// Runs the whole trace through an algorithm, the way the daemon would have
+// (filter, speed tables, deadband), and prints what the fans would have done
+static void KCReplayAlgorithm(KC_Status_t *state, KC_ReplayReader_t *reader, char alg) {
+    KC_TraceRecord_t record;
+    UInt64           start, last_time = 0, ticks = 0, skipped = 0;
+    double           dt, elapsed = 0.0, set = 0.0, rpm = 0.0, histogram[KC_REPLAY_BUCKETS];
+    char             line[KC_LOG_BUFSIZE], debug = state->debug;
+    UInt16           newSpeed;
+    int              i, len, bucket;
+
+    // start from the state the daemon has when it starts
+    state->compute_fan_speed = KCAlgorithmOf(alg);
+    for (i = 0; i < KC_MAX_FANS; i++) {
+        KC_FanState_t *fan = &state->fan[i];
+
+        fan->min_speed = KC_SMC_DEF_SPEED;
+        fan->last_direction = 0;
+        fan->speed = fan->raw_speed = fan->raw_written = 0;
+        fan->raw_direction = 0;
+        memset(&fan->pid, 0, sizeof(KC_PIDState_t));
+    }
+    memset(state->filter.ring, 0, sizeof(state->filter.ring));
+    memset(state->filter.head, 0, sizeof(state->filter.head));
+    memset(state->filter.count, 0, sizeof(state->filter.count));
+    memset(state->filter.ema, 0, sizeof(state->filter.ema));
+    memset(state->filter.ema_count, 0, sizeof(state->filter.ema_count));
+    state->filter.changes = state->filter.raw_changes = state->filter.raw_writes = 0;
+    state->writes = state->writes_elided = 0;
+    KCInvalidateSpeedTable(state);
+    memset(histogram, 0, sizeof(histogram));
+
+    KCReplayRewind(reader);
+    state->debug = 0;   // not a line per record
+    start = _uptime_us();
+    while (KCReplayNext(reader, &record)) {
+        // the speeds in effect since the previous record, over the time they lasted
+        if (ticks > 0 && record.time > last_time) {
+            dt = (double)(record.time - last_time) / 1000000.0;
+            if (dt > KC_REPLAY_MAX_GAP)
+                dt = KC_REPLAY_MAX_GAP;
+            elapsed += dt;
+            for (i = 0; i < state->num_fans; i++) {
+                // the first bar is the time left to the SMC default
+                bucket = 0;
+                if (state->fan[i].min_speed != KC_SMC_DEF_SPEED) {
+                    rpm += dt * state->fan[i].min_speed;
+                    set += dt;
+                    bucket = state->fan[i].min_speed / KC_REPLAY_BUCKET;
+                    bucket = bucket < 1 ? 1 : bucket < KC_REPLAY_BUCKETS ? bucket : KC_REPLAY_BUCKETS - 1;
+                }
+                histogram[bucket] += dt;
+            }
+        }
+        last_time = record.time;
+        ticks++;
+
+        state->sample_time = record.time;
+        state->num_sensors = record.num_sensors <= KC_MAX_SENSORS ? record.num_sensors : KC_MAX_SENSORS;
+        for (i = 0; i < state->num_sensors; i++) {
+            state->sensors[i].raw = (double)record.raw[i] / KC_TEMP_SCALE;
+            state->sensors[i].temp = KCFilterSample(&state->filter, i, state->sensors[i].raw);
+        }
+        state->cur_temp = KCAggregateTemperature(state);
+        if (state->cur_temp == KC_ERROR_READING_TEMP || state->cur_temp > KC_WAKEUP_IGNORE_TEMP) {
+            skipped++;
+            continue;
+        }
+        state->load.lead = (double)record.lead / KC_TEMP_SCALE;
+        KCUpdateFanTemperatures(state);
+        for (i = 0; i < state->num_fans; i++)
+            KCStepFanSpeed(state, i, &newSpeed);
+    }
+    start = _uptime_us() - start;
+    state->debug = debug;
+
+    len = snprintf(line, sizeof(line), "%c: %6llu writes %6llu elided, avg %4.0f rpm when set | default %4.1f%%", alg,
+                   (unsigned long long)state->writes, (unsigned long long)state->writes_elided,
+                   set > 0.0 ? rpm / set : 0.0, elapsed > 0.0 ? 100.0 * histogram[0] / elapsed / state->num_fans : 0.0);
+    for (i = 1; i < KC_REPLAY_BUCKETS && len < sizeof(line); i++)
+        len += snprintf(line + len, sizeof(line) - len, " %s%dk %4.1f%%", i == KC_REPLAY_BUCKETS - 1 ? ">" : "<",
+                        i == KC_REPLAY_BUCKETS - 1 ? i : i + 1,
+                        elapsed > 0.0 ? 100.0 * histogram[i] / elapsed / state->num_fans : 0.0);
+    printf("%s\n", line);
+    if (state->debug)
+        printf("   %llu records (%llu skipped) in %.1f ms, %.1f M records/s\n", (unsigned long long)ticks,
+               (unsigned long long)skipped, start / 1000.0, start > 0 ? (double)ticks / start : 0.0);
+}
+
+// Replays a trace (see KCTraceOpen()) or a CSV series through every speed
+// algorithm, and the user curve when one is given, without touching the SMC
+kern_return_t KCReplay(KC_Status_t *state, char *file) {
+    static const char algorithms[] = "scqbiwpu";
+    KC_ReplayReader_t reader;
+    int               i;
+
+    if (KCReplayOpen(file, &reader) != kIOReturnSuccess) {
+        printf("Error: can't read %s\n", file);
+        return kIOReturnNotFound;
+    }
+
+    // the fans the trace was recorded with, or a single one
+    state->num_fans = 0;
+    state->max_speed = 0;
+    for (i = 0; reader.map != NULL && i < KC_MAX_FANS && reader.map->max_speed[i] != 0; i++)
+        state->fan[state->num_fans++].max_speed = reader.map->max_speed[i];
+    if (state->num_fans == 0)
+        state->fan[state->num_fans++].max_speed = KC_REPLAY_MAX_SPEED;
+    for (i = 0; i < state->num_fans; i++) {
+        if (state->fan[i].max_speed > state->max_speed)
+            state->max_speed = state->fan[i].max_speed;
+    }
+    state->delta_v = (double)(state->max_speed-KC_FAN_MIN_SPEED);
+
+    // weights and offsets given with -T apply, the other sensors count as they read
+    for (i = state->num_sensors; i < KC_MAX_SENSORS; i++) {
+        state->sensors[i].weight = 1.0;
+        state->sensors[i].offset = 0.0;
+    }
+
+    if (reader.map != NULL)
+        printf("Replaying %llu records of %s, %u fans\n", (unsigned long long)reader.count, file, state->num_fans);
+    else
+        printf("Replaying %s, %u fan\n", file, state->num_fans);
+    for (i = 0; algorithms[i] != '\0'; i++) {
+        if (algorithms[i] != 'u' || state->curve.count != 0)
+            KCReplayAlgorithm(state, &reader, algorithms[i]);
+    }
+
+    KCFreeSpeedTable(state);
+    KCReplayClose(&reader);
+    return kIOReturnSuccess;
+}
+
+#pragma mark Watch
+
+// Output of the watch mode: records pile up in the buffer and go out in
+// a single write(), when the buffer is full or the flush policy says so
+void KCWriterInit(KC_Writer_t *writer, int fd, int flush) {
+    writer->fd = fd;
+    writer->flush = flush;
+    writer->last_flush = _uptime_us();
+    writer->bytes = 0;
+    writer->flushes = 0;
+    writer->error = 0;
+    writer->len = 0;
+}
+
+// Returns 0, or the errno of the failed write: the buffer is dropped then
+int KCWriterFlush(KC_Writer_t *writer) {
+    size_t  done = 0;
+    ssize_t n;
+
+    while (done < writer->len && writer->error == 0) {
+        n = write(writer->fd, writer->buf + done, writer->len - done);
+        if (n > 0)
+            done += n;
+        else if (n == 0)
+            writer->error = EIO;    // nothing written, retrying would spin
+        else if (errno != EINTR)
+            writer->error = errno;
+    }
+    writer->bytes += done;
+    writer->flushes++;
+    writer->len = 0;
+    writer->last_flush = _uptime_us();
+    return writer->error;
+}
+
+void KCWriterPrintf(KC_Writer_t *writer, const char *fmt, ...) {
+    va_list ap;
+    int     n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(writer->buf + writer->len, KC_WATCH_BUFSIZE - writer->len, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+    if ((size_t)n >= KC_WATCH_BUFSIZE - writer->len) {
+        // doesn't fit: send what's buffered and format it again
+        KCWriterFlush(writer);
+        va_start(ap, fmt);
+        n = vsnprintf(writer->buf, KC_WATCH_BUFSIZE, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return;
+        if (n >= KC_WATCH_BUFSIZE)
+            n = KC_WATCH_BUFSIZE - 1;
+    }
+    writer->len += n;
+}
+
+// Applies the flush policy once a whole record is in the buffer
+void KCWriterEndRecord(KC_Writer_t *writer) {
+    if (writer->flush == KC_WATCH_FLUSH_FULL)
+        return;
+    if (writer->flush == KC_WATCH_FLUSH_LINE ||
+        _uptime_us() - writer->last_flush >= (UInt64)writer->flush * 1000)
+        KCWriterFlush(writer);
+}
+
+// Parses "<key>[,<key>...][:<ms>[:<format>[:<flush>]]]" where the format
+// is json or csv and the flush policy line, full or a delay in ms
+kern_return_t KCParseWatch(char *arg, KC_Watch_t *watch) {
+    char          *item = arg, *end;
+    unsigned long value;
+    int           len, i;
+
+    memset(watch, 0, sizeof(KC_Watch_t));
+    watch->interval = KC_WATCH_DEF_INTERVAL;
+    watch->format = KC_WATCH_JSON;
+    watch->flush = KC_WATCH_DEF_FLUSH;
+
+    while (*item != '\0' && *item != ':') {
+        len = strcspn(item, ":,");
+        if (len != 4 || watch->count == KC_WATCH_MAX_KEYS)
+            return kIOReturnBadArgument;
+        // the keys go as is in the records: nothing JSON would need escaped
+        for (i = 0; i < len; i++) {
+            if (item[i] < ' ' || item[i] > '~' || item[i] == '"' || item[i] == '\\')
+                return kIOReturnBadArgument;
+        }
+        memcpy(watch->keys[watch->count++], item, len);
+        item += len;
+        if (*item == ',')
+            item++;
+    }
+    if (watch->count == 0)
+        return kIOReturnBadArgument;
+    if (*item == '\0')
+        return kIOReturnSuccess;
+
+    value = strtoul(item + 1, &end, 10);
+    if (end == item + 1 || value < 1 || value > 3600 * 1000 || (*end != '\0' && *end != ':'))
+        return kIOReturnBadArgument;
+    watch->interval = (UInt32)value;
+    if (*end == '\0')
+        return kIOReturnSuccess;
+
+    item = end + 1;
+    len = strcspn(item, ":");
+    if (len == 4 && strncmp(item, "json", 4) == 0)
+        watch->format = KC_WATCH_JSON;
+    else if (len == 3 && strncmp(item, "csv", 3) == 0)
+        watch->format = KC_WATCH_CSV;
+    else
+        return kIOReturnBadArgument;
+    if (item[len] == '\0')
+        return kIOReturnSuccess;
+
+    item += len + 1;
+    if (strcmp(item, "line") == 0)
+        watch->flush = KC_WATCH_FLUSH_LINE;
+    else if (strcmp(item, "full") == 0)
+        watch->flush = KC_WATCH_FLUSH_FULL;
+    else {
+        value = strtoul(item, &end, 10);
+        if (end == item || *end != '\0' || value > 3600 * 1000)
+            return kIOReturnBadArgument;
+        watch->flush = (int)value;
+    }
+    return kIOReturnSuccess;
+}
+
+void KCWatchHeader(KC_Watch_t *watch, KC_Writer_t *writer) {
+    int i;
+
+    if (watch->format != KC_WATCH_CSV)
+        return;
+    KCWriterPrintf(writer, "time");
+    for (i = 0; i < watch->count; i++)
+        KCWriterPrintf(writer, ",%s", watch->keys[i]);
+    KCWriterPrintf(writer, "\n");
+    KCWriterEndRecord(writer);
+}
+
+// One sample: the decoded values, null (json) or empty (csv) for the keys
+// that can't be read or decoded
+void KCWatchRecord(KC_Watch_t *watch, KC_Writer_t *writer, double time, SMCVal_t *vals) {
+    double value;
+    int    i, known;
+
+    if (watch->format == KC_WATCH_CSV)
+        KCWriterPrintf(writer, "%.3f", time);
+    else
+        KCWriterPrintf(writer, "{\"time\":%.3f", time);
+    for (i = 0; i < watch->count; i++) {
+        value = SMCDecodeValue(&vals[i]);
+        known = vals[i].dataSize > 0 && vals[i].decoder != NULL && isfinite(value);
+        if (watch->format == KC_WATCH_CSV)
+            KCWriterPrintf(writer, known ? ",%g" : ",", value);
+        else if (known)
+            KCWriterPrintf(writer, ",\"%s\":%g", watch->keys[i], value);
+        else
+            KCWriterPrintf(writer, ",\"%s\":null", watch->keys[i]);
+    }
+    KCWriterPrintf(writer, watch->format == KC_WATCH_CSV ? "\n" : "}\n");
+}
+
+static volatile sig_atomic_t g_watchStop = 0;
+
+static void KCWatchSigHandler(int sigNum) {
+    g_watchStop = 1;
+}
+
+// Samples the keys until interrupted, on the connection opened at startup.
+// A late sample is taken at once, the ones it overlapped are skipped.
+kern_return_t KCWatch(KC_Status_t *state, KC_Watch_t *watch) {
+    KC_Writer_t     *writer;
+    SMCVal_t        vals[KC_WATCH_MAX_KEYS];
+    struct timespec ts;
+    UInt64          next, now, records = 0, late = 0;
+    int             error;
+
+    writer = malloc(sizeof(KC_Writer_t));
+    if (writer == NULL)
+        return kIOReturnError;
+    KCWriterInit(writer, STDOUT_FILENO, watch->flush);
+    // anything printf() left in the stdio buffer goes before the records
+    fflush(stdout);
+    signal(SIGINT, KCWatchSigHandler);
+    signal(SIGTERM, KCWatchSigHandler);
+    signal(SIGHUP, KCWatchSigHandler);
+    // a consumer going away shows up as EPIPE
+    signal(SIGPIPE, SIG_IGN);
+
+    KCWatchHeader(watch, writer);
+    next = _uptime_us();
+    while (!g_watchStop && writer->error == 0) {
+        SMCReadKeys(watch->keys, watch->count, vals);
+        clock_gettime(CLOCK_REALTIME, &ts);
+        KCWatchRecord(watch, writer, ts.tv_sec + ts.tv_nsec / 1e9, vals);
+        KCWriterEndRecord(writer);
+        records++;
+
+        next += (UInt64)watch->interval * 1000;
+        now = _uptime_us();
+        if (next <= now) {
+            late++;
+            next = now;
+            continue;
+        }
+        ts.tv_sec = (next - now) / 1000000;
+        ts.tv_nsec = ((next - now) % 1000000) * 1000;
+        nanosleep(&ts, NULL);
+    }
+    error = writer->error == 0 ? KCWriterFlush(writer) : writer->error;
+
+    if (state->debug)
+        fprintf(stderr, "Watch: %llu records, %llu late, %llu bytes in %llu writes\n",
+                (unsigned long long)records, (unsigned long long)late,
+                (unsigned long long)writer->bytes, (unsigned long long)writer->flushes);
+    free(writer);
+    if (error != 0 && error != EPIPE) {
+        fprintf(stderr, "Error: can't write the watch records: %s\n", strerror(error));
+        return kIOReturnError;
+    }
+    return kIOReturnSuccess;
+}
+
+#pragma mark Control loop
+
+// Aborts the daemon once the SMC failed too many times in a row
+static void KCCheckErrors(KC_Status_t *state) {
+    char msg[KC_LOG_BUFSIZE];
+
+    if (state->errors_count >= KC_ABORT_TRESHOLD) {
+        sprintf(msg, "Too many SMC I/O errors (%d).. aborting.", state->errors_count);
+        KCSysLog(LOG_CRIT, msg);
+        KCHandleSignal(SIGABRT);
+    }
+}
+
+// Reads the sensors and the fans and, when the temperature can be trusted,
+// computes and applies the new speeds. Returns the period (us) before the
+// next step; smc_us and flags (KC_TRACE_*) describe the tick.
+static UInt64 KCControlStep(KC_Status_t *state, UInt64 tick_start, UInt64 *smc_us, UInt16 *flags) {
+    kern_return_t result;
+    char          msg[KC_LOG_BUFSIZE];
+
+    result = SMCRefreshState(state);
+    *smc_us = _uptime_us() - tick_start;
+    if (state->cur_temp == KC_ERROR_READING_TEMP) {
+        sprintf(msg,"Error: SMCGetTemperature() can't read value");
+        KCSysLogClass(KC_LOG_SENSOR, LOG_WARNING, msg);
+        state->errors_count++;
+        *flags |= KC_TRACE_NO_TEMP;
+        return KC_UPDATE_DELAY*4;
+    } else if (state->cur_temp > KC_WAKEUP_IGNORE_TEMP) {
+        if (state->debug)
+            printf("Ignoring Temperature reading from sensor %s (too high)\n..just awaken from stand-by?.\n",state->temp_key);
+        state->errors_count++;
+        *flags |= KC_TRACE_IGNORED;
+        return KC_UPDATE_DELAY*2;
+    }
+
+    if (state->debug)
+        KCPrintSensors(state);
+    KCSampleLoad(state, state->sample_time);
+
+    if (result != kIOReturnSuccess) {
+        state->errors_count++;
+        *flags |= KC_TRACE_SMC_ERROR;
+        sprintf(msg, "Error: SMCRefreshState() = %08x\n", result);
+        KCSysLogClass(KC_LOG_SMC, LOG_WARNING, msg);
+    }
+
+    if (state->debug)
+        KCPrintFanSpeeds(state);
+
+    if (!(state->dry_run)) {
+        result = SMCSetFanSpeed(state);
+        if (result != kIOReturnSuccess) {
+            sprintf(msg, "Error: SMCSetFanSpeed() = %08x\n", result);
+            KCSysLogClass(KC_LOG_SMC, LOG_WARNING, msg);
+            state->errors_count++;
+            *flags |= KC_TRACE_SMC_ERROR;
+        } else {
+            state->errors_count = 0;
+        }
+    }
+
+    return (UInt64)KCScheduleNextPoll(state) * 1000;
+}
+
+// One step of the control loop, see KCControlStep(). Every tick is traced
+// and published, the failed ones too. Returns the period (us) before the next step.
+UInt64 KCControlTick(KC_Status_t *state) {
+    UInt64        tick_start = _uptime_us();
+    UInt32        tick_calls = SMCCallCount();
+    UInt64        smc_us = 0, next;
+    UInt16        flags = 0;
+
+    next = KCControlStep(state, tick_start, &smc_us, &flags);
+
+    if (state->debug)
+        printf("Tick: %u SMC calls in %llu us\n", SMCCallCount()-tick_calls,
+               (unsigned long long)(_uptime_us()-tick_start));
+    KCTraceTick(state, tick_start, smc_us, SMCCallCount()-tick_calls, flags);
+    // a failed tick is published too: readers see the errors, not a stale
+    // healthy status
+    KCShmPublish(state);
+    KCCheckErrors(state);
+
+    return next;
+}
+
+#pragma mark Configuration file
+
+// The watch on the configuration file, served by the event loop. The
+// directory is watched as well, editors replace the file instead of
+// writing it.
+typedef struct {
+    int                 fd;             /* inotify or kqueue, -1 if none */
+#ifdef __APPLE__
+    int                 dir_fd;
+    int                 file_fd;        /* -1 once the file was replaced */
+#endif
+    const char          *name;          /* of the file, in its directory */
+    UInt64              reload_at;      /* us, 0: no change pending */
+    UInt64              generation;
+    KC_Config_t         *base;          /* the command line */
+} KC_ConfigWatch_t;
+
+#ifdef __APPLE__
+KC_ConfigWatch_t g_config = { -1, -1, -1 };
+#else
+KC_ConfigWatch_t g_config = { -1 };
+#endif
+
+static void KCConfigLog(KC_Status_t *state, int level, char *msg) {
+    if (state->debug)
+        printf("%s\n", msg);
+    else
+        KCSysLog(level, msg);
+}
+
+static kern_return_t KCConfigAggregate(char *arg, KC_Status_t *state) {
+    if (strcmp(arg, "max") == 0)
+        state->sensor_policy = KC_SENSOR_MAX;
+    else if (strcmp(arg, "mean") == 0)
+        state->sensor_policy = KC_SENSOR_MEAN;
+    else
+        return kIOReturnBadArgument;
+    return kIOReturnSuccess;
+}
+
+static kern_return_t KCConfigAlgorithm(char *arg, KC_Status_t *state) {
+    if (strlen(arg) != 1 || KCAlgorithmOf(arg[0]) == NULL)
+        return kIOReturnBadArgument;
+    state->compute_fan_speed = KCAlgorithmOf(arg[0]);
+    return kIOReturnSuccess;
+}
+
+// The range is checked against the other bound once the whole file is read
+static kern_return_t KCConfigTemp(char *arg, UInt32 *temp) {
+    char *end;
+    long value = strtol(arg, &end, 10);
+
+    if (end == arg || *end != '\0' || value < KC_ABS_MIN_TEMP || value >= KC_ABS_MAX_TEMP)
+        return kIOReturnBadArgument;
+    *temp = (UInt32)value;
+    return kIOReturnSuccess;
+}
+
+static kern_return_t KCConfigMinTemp(char *arg, KC_Status_t *state) {
+    return KCConfigTemp(arg, &state->min_temp);
+}
+
+static kern_return_t KCConfigMaxTemp(char *arg, KC_Status_t *state) {
+    return KCConfigTemp(arg, &state->max_temp);
+}
+
+// A fan named in the file starts from the global settings, as with -F
+static kern_return_t KCConfigFan(char *arg, KC_Status_t *state) {
+    char *end;
+    long i = strtol(arg, &end, 10);
+
+    if (end == arg || i < 0 || i >= KC_MAX_FANS)
+        return kIOReturnBadArgument;
+    state->fan[i].compute_fan_speed = NULL;
+    state->fan[i].min_temp = 0;
+    state->fan[i].max_temp = 0;
+    state->fan[i].sensor_spec = NULL;
+    return KCParseFanCurve(arg, state);
+}
+
+static kern_return_t KCConfigLoadGain(char *arg, KC_Status_t *state) {
+    KC_LoadSource_t *source = state->load.source;
+    kern_return_t   result = KCParseLoad(arg, state);
+
+    // the source is opened once, at startup
+    state->load.source = source;
+    return result;
+}
+
+// The settings of a configuration file, and the option taking the same value
+static const struct {
+    const char          *name;
+    kern_return_t       (*parse)(char *, KC_Status_t *);
+} g_kcConfigKeys[] = {
+    { "sensors",   KCParseSensors },        /* -T */
+    { "aggregate", KCConfigAggregate },     /* -A */
+    { "fan",       KCConfigFan },           /* -F, once per fan */
+    { "curve",     KCParseUserCurve },      /* -u, once per curve */
+    { "algorithm", KCConfigAlgorithm },     /* -a */
+    { "min-temp",  KCConfigMinTemp },       /* -m */
+    { "max-temp",  KCConfigMaxTemp },       /* -M */
+    { "poll",      KCParsePollBounds },     /* -p */
+    { "filter",    KCParseFilter },         /* -S */
+    { "deadband",  KCParseDeadband },       /* -D */
+    { "pid",       KCParsePID },            /* -P */
+    { "load-gain", KCConfigLoadGain },      /* -U, the gain only */
+};
+
+static char *KCConfigTrim(char *str) {
+    char *end;
+
+    while (*str == ' ' || *str == '\t')
+        str++;
+    end = str + strlen(str);
+    while (end > str && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+        *(--end) = '\0';
+    return str;
+}
+
+void KCConfigCapture(KC_Status_t *state, KC_Config_t *config) {
+    int i;
+
+    memcpy(config->sensors, state->sensors, sizeof(config->sensors));
+    config->num_sensors = state->num_sensors;
+    config->sensor_policy = state->sensor_policy;
+    config->min_temp = state->min_temp;
+    config->max_temp = state->max_temp;
+    config->compute_fan_speed = state->compute_fan_speed;
+    for (i = 0; i < KC_MAX_FANS; i++) {
+        config->fan[i].compute_fan_speed = state->fan[i].compute_fan_speed;
+        config->fan[i].min_temp = state->fan[i].min_temp;
+        config->fan[i].max_temp = state->fan[i].max_temp;
+        config->fan[i].sensor_spec = state->fan[i].sensor_spec;
+        config->fan[i].sensor_mask = state->fan[i].sensor_mask;
+        config->fan[i].curve_spec = state->fan[i].curve_spec;
+        config->fan[i].curve = state->fan[i].curve;
+    }
+    config->min_interval = state->sched.min_interval;
+    config->max_interval = state->sched.max_interval;
+    config->filter_mode = state->filter.mode;
+    config->filter_window = state->filter.window;
+    config->filter_alpha = state->filter.alpha;
+    config->deadband = state->deadband;
+    config->hysteresis = state->hysteresis;
+    config->pid = state->pid;
+    config->load_gain = state->load.gain;
+    config->curve = state->curve;
+}
+
+static void KCConfigSet(const KC_Config_t *config, KC_Status_t *state) {
+    int i;
+
+    memcpy(state->sensors, config->sensors, sizeof(state->sensors));
+    state->num_sensors = config->num_sensors;
+    state->sensor_policy = config->sensor_policy;
+    state->min_temp = config->min_temp;
+    state->max_temp = config->max_temp;
+    state->compute_fan_speed = config->compute_fan_speed;
+    for (i = 0; i < KC_MAX_FANS; i++) {
+        state->fan[i].compute_fan_speed = config->fan[i].compute_fan_speed;
+        state->fan[i].min_temp = config->fan[i].min_temp;
+        state->fan[i].max_temp = config->fan[i].max_temp;
+        state->fan[i].sensor_spec = config->fan[i].sensor_spec;
+        state->fan[i].sensor_mask = config->fan[i].sensor_mask;
+        state->fan[i].curve_spec = config->fan[i].curve_spec;
+        state->fan[i].curve = config->fan[i].curve;
+    }
+    state->sched.min_interval = config->min_interval;
+    state->sched.max_interval = config->max_interval;
+    state->filter.mode = config->filter_mode;
+    state->filter.window = config->filter_window;
+    state->filter.alpha = config->filter_alpha;
+    state->deadband = config->deadband;
+    state->hysteresis = config->hysteresis;
+    state->pid = config->pid;
+    state->load.gain = config->load_gain;
+    state->curve = config->curve;
+}
+
+// Switches the control loop to a configuration, all at once: the state
+// derived from the settings (speed tables, tick keys, filter history) is
+// rebuilt before the next tick
+void KCConfigApply(const KC_Config_t *config, KC_Status_t *state) {
+    KC_SpeedAlgorithm_t algorithm = state->compute_fan_speed;
+    int                 sensors_changed, filter_changed, i;
+
+    sensors_changed = config->num_sensors != state->num_sensors;
+    for (i = 0; i < config->num_sensors && !sensors_changed; i++) {
+        sensors_changed = strcmp(config->sensors[i].key, state->sensors[i].key) != 0 ||
+                          config->sensors[i].weight != state->sensors[i].weight ||
+                          config->sensors[i].offset != state->sensors[i].offset;
+    }
+    filter_changed = sensors_changed || config->filter_mode != state->filter.mode ||
+                     config->filter_window != state->filter.window ||
+                     config->filter_alpha != state->filter.alpha;
+
+    KCConfigSet(config, state);
+    if (config->compute_fan_speed != algorithm) {
+        state->compute_fan_speed = algorithm;
+        KCSelectAlgothitm(KCAlgorithmLetter(config->compute_fan_speed), state);
+    }
+    if (sensors_changed)
+        SMCPrepareTickKeys(state);
+    if (filter_changed) {
+        memset(state->filter.head, 0, sizeof(state->filter.head));
+        memset(state->filter.count, 0, sizeof(state->filter.count));
+        memset(state->filter.ema, 0, sizeof(state->filter.ema));
+        memset(state->filter.ema_count, 0, sizeof(state->filter.ema_count));
+    }
+    if (state->sched.interval < state->sched.min_interval)
+        state->sched.interval = state->sched.min_interval;
+    if (state->sched.interval > state->sched.max_interval)
+        state->sched.interval = state->sched.max_interval;
+    KCInvalidateSpeedTable(state);
+    state->config = config;
+}
+
+// Parses a configuration file: "<name> = <value>" lines, '#' starts a
+// comment. The values are the ones of the matching options (see
+// g_kcConfigKeys), the settings the file doesn't name keep the value given
+// on the command line. Nothing is changed in the state: the new
+// configuration is returned, to be applied by KCConfigApply().
+kern_return_t KCConfigParse(char *path, KC_Status_t *state, KC_Config_t **config) {
+    KC_Config_t    *cfg;
+    KC_Status_t    *scratch;
+    SMCKeyHandle_t handle;
+    kern_return_t  result = kIOReturnSuccess;
+    char           msg[KC_LOG_BUFSIZE], reason[128], *line, *next, *name, *value, *p;
+    struct stat    st;
+    ssize_t        n;
+    int            fd, lineno = 0, i;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size > KC_CONFIG_MAX_SIZE) {
+        snprintf(msg, sizeof(msg), "Error: can't read the configuration file %s", path);
+        KCConfigLog(state, LOG_ERR, msg);
+        if (fd >= 0)
+            close(fd);
+        return kIOReturnError;
+    }
+    cfg = calloc(1, sizeof(KC_Config_t) + st.st_size + 1);
+    scratch = malloc(sizeof(KC_Status_t));
+    if (cfg == NULL || scratch == NULL) {
+        free(cfg);
+        free(scratch);
+        close(fd);
+        return kIOReturnError;
+    }
+    n = read(fd, cfg->text, st.st_size);
+    close(fd);
+    cfg->text[n > 0 ? n : 0] = '\0';
+
+    // the file applies over the command line
+    *scratch = *state;
+    if (g_config.base != NULL)
+        KCConfigSet(g_config.base, scratch);
+
+    for (line = cfg->text; line != NULL && result == kIOReturnSuccess; line = next) {
+        lineno++;
+        if ((next = strchr(line, '\n')) != NULL)
+            *next++ = '\0';
+        if ((p = strchr(line, '#')) != NULL)
+            *p = '\0';
+        name = KCConfigTrim(line);
+        if (*name == '\0')
+            continue;
+        if ((p = strchr(name, '=')) == NULL) {
+            snprintf(msg, sizeof(msg), "Error: %s:%d: \"<name> = <value>\" expected", path, lineno);
+            result = kIOReturnBadArgument;
+            break;
+        }
+        *p = '\0';
+        name = KCConfigTrim(name);
+        value = KCConfigTrim(p + 1);
+        for (i = 0; i < sizeof(g_kcConfigKeys) / sizeof(g_kcConfigKeys[0]); i++) {
+            if (strcmp(name, g_kcConfigKeys[i].name) == 0)
+                break;
+        }
+        if (i == sizeof(g_kcConfigKeys) / sizeof(g_kcConfigKeys[0])) {
+            snprintf(msg, sizeof(msg), "Error: %s:%d: unknown setting \"%s\"", path, lineno, name);
+            result = kIOReturnBadArgument;
+        } else if (g_kcConfigKeys[i].parse(value, scratch) != kIOReturnSuccess) {
+            snprintf(msg, sizeof(msg), "Error: %s:%d: inconsistent value for %s", path, lineno, name);
+            result = kIOReturnBadArgument;
+        }
+    }
+    if (result == kIOReturnSuccess && scratch->min_temp >= scratch->max_temp) {
+        snprintf(msg, sizeof(msg), "Error: %s: inconsistent temperature range", path);
+        result = kIOReturnBadArgument;
+    }
+    if (result == kIOReturnSuccess) {
+        // '?' stands for the sensor found at startup
+        strncpy(scratch->temp_key, state->temp_key, sizeof(scratch->temp_key));
+        if (KCResolveFanCurves(scratch, reason, sizeof(reason)) != kIOReturnSuccess) {
+            snprintf(msg, sizeof(msg), "Error: %s: %s", path, reason);
+            result = kIOReturnBadArgument;
+        }
+        KCResolveSensors(scratch);
+    }
+    // a sensor the SMC doesn't know would read as a failed sensor forever
+    for (i = 0; result == kIOReturnSuccess && i < scratch->num_sensors; i++) {
+        if (SMCResolveKey(scratch->sensors[i].key, SMC_CMD_READ_BYTES, &handle) != kIOReturnSuccess ||
+            handle.request.keyInfo.dataSize == 0 || handle.decoder == NULL) {
+            snprintf(msg, sizeof(msg), "Error: %s: unknown sensor %s", path, scratch->sensors[i].key);
+            result = kIOReturnNotFound;
+        }
+    }
+    if (result != kIOReturnSuccess)
+        KCConfigLog(state, LOG_ERR, msg);
+
+    if (result == kIOReturnSuccess) {
+        KCConfigCapture(scratch, cfg);
+        *config = cfg;
+    } else {
+        free(cfg);
+    }
+    free(scratch);
+    return result;
+}
+
+#ifdef __APPLE__
+static kern_return_t KCConfigWatchFile(KC_Status_t *state) {
+    struct kevent ev;
+
+    g_config.file_fd = open(state->config_file, O_EVTONLY | O_CLOEXEC);
+    if (g_config.file_fd < 0)
+        return kIOReturnError;
+    EV_SET(&ev, g_config.file_fd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+           NOTE_WRITE | NOTE_EXTEND | NOTE_DELETE | NOTE_RENAME, 0, NULL);
+    if (kevent(g_config.fd, &ev, 1, NULL, 0, NULL) != 0) {
+        close(g_config.file_fd);
+        g_config.file_fd = -1;
+        return kIOReturnError;
+    }
+    return kIOReturnSuccess;
+}
+#endif
+
+// Watches the file, with kqueue on OSX and inotify on Linux
+static kern_return_t KCConfigWatch(KC_Status_t *state) {
+    char *slash, dir[PATH_MAX];
+
+    if (strlen(state->config_file) >= sizeof(dir))
+        return kIOReturnBadArgument;
+    strcpy(dir, state->config_file);
+    slash = strrchr(dir, '/');
+    if (slash == NULL) {
+        strcpy(dir, ".");
+        g_config.name = state->config_file;
+    } else {
+        g_config.name = state->config_file + (slash - dir) + 1;
+        slash[slash == dir ? 1 : 0] = '\0';
+    }
+#ifdef __APPLE__
+    struct kevent ev;
+
+    g_config.fd = kqueue();
+    if (g_config.fd < 0)
+        return kIOReturnError;
+    fcntl(g_config.fd, F_SETFD, FD_CLOEXEC);
+    g_config.dir_fd = open(dir, O_EVTONLY | O_CLOEXEC);
+    if (g_config.dir_fd >= 0) {
+        EV_SET(&ev, g_config.dir_fd, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_WRITE, 0, NULL);
+        kevent(g_config.fd, &ev, 1, NULL, 0, NULL);
+    }
+    if (KCConfigWatchFile(state) != kIOReturnSuccess && g_config.dir_fd < 0) {
+        close(g_config.fd);
+        g_config.fd = -1;
+        return kIOReturnError;
+    }
+#else
+    g_config.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (g_config.fd < 0)
+        return kIOReturnError;
+    if (inotify_add_watch(g_config.fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        close(g_config.fd);
+        g_config.fd = -1;
+        return kIOReturnError;
+    }
+#endif
+    return kIOReturnSuccess;
+}
+
+// Reads the pending events of the watch, returns 1 when the file changed
+static int KCConfigDrain(KC_Status_t *state) {
+    int changed = 0;
+#ifdef __APPLE__
+    struct kevent   ev[8];
+    struct timespec ts = { 0, 0 };
+    int             n, i;
+
+    while ((n = kevent(g_config.fd, NULL, 0, ev, 8, &ts)) > 0) {
+        for (i = 0; i < n; i++) {
+            if ((int)ev[i].ident != g_config.file_fd)
+                continue;
+            changed = 1;
+            if (ev[i].fflags & (NOTE_DELETE | NOTE_RENAME)) {
+                close(g_config.file_fd);
+                g_config.file_fd = -1;
+            }
+        }
+    }
+    // replaced: the new file shows up in the directory
+    if (g_config.file_fd < 0 && KCConfigWatchFile(state) == kIOReturnSuccess)
+        changed = 1;
+#else
+    char                 buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    ssize_t              n;
+    char                 *p;
+
+    while ((n = read(g_config.fd, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len) {
+            ev = (struct inotify_event *)p;
+            if (ev->len != 0 && strcmp(ev->name, g_config.name) == 0)
+                changed = 1;
+        }
+    }
+#endif
+    return changed;
+}
+
+// Builds the configuration from the file and switches to it. A file that
+// doesn't parse leaves the running configuration as it is.
+kern_return_t KCConfigReload(KC_Status_t *state) {
+    KC_Config_t   *config;
+    const KC_Config_t *old = state->config;
+    char          msg[KC_LOG_BUFSIZE];
+
+    if (KCConfigParse(state->config_file, state, &config) != kIOReturnSuccess) {
+        if (old != NULL)
+            KCConfigLog(state, LOG_WARNING, "Keeping the previous configuration");
+        return kIOReturnBadArgument;
+    }
+    config->generation = ++g_config.generation;
+    KCConfigApply(config, state);
+    free((void *)old);
+    snprintf(msg, sizeof(msg), "Loaded the configuration file %s (generation %llu)", state->config_file,
+             (unsigned long long)config->generation);
+    KCConfigLog(state, LOG_NOTICE, msg);
+    return kIOReturnSuccess;
+}
+
+// Loads the configuration file, -k, and watches it: a change is applied a
+// little later, once the editor is done (KC_CONFIG_SETTLE).
+kern_return_t KCConfigOpen(KC_Status_t *state) {
+    char msg[KC_LOG_BUFSIZE];
+
+    if (state->config_file == NULL)
+        return kIOReturnSuccess;
+    g_config.base = malloc(sizeof(KC_Config_t));
+    if (g_config.base == NULL)
+        return kIOReturnError;
+    KCConfigCapture(state, g_config.base);
+    if (KCConfigWatch(state) != kIOReturnSuccess) {
+        snprintf(msg, sizeof(msg), "Can't watch %s, its changes need a restart", state->config_file);
+        KCConfigLog(state, LOG_WARNING, msg);
+    }
+    return KCConfigReload(state);
+}
+
+#pragma mark Event loop
+
+// The signal handler only writes the signal number here, the event loop
+// reads it and does the work (see KCHandleSignal())
+int g_kcSignalPipe[2] = { -1, -1 };
+
+// Connected clients of the control socket, served by the event loop
+typedef struct {
+    int                 fd;
+    size_t              len;
+    char                line[KC_CONTROL_LINE];
+} KC_ControlClient_t;
+
+typedef struct {
+    int                 fd;             /* listening socket, -1 if none */
+    KC_ControlClient_t  client[KC_CONTROL_MAX_CLIENTS];
+} KC_Control_t;
+
+KC_Control_t g_control = { -1 };
+
+// Async-signal-safe: a full pipe already holds a wakeup for the loop
+void KCSigHandler(int sigNum) {
+    int           saved = errno;
+    unsigned char sig = (unsigned char)sigNum;
+
+    if (write(g_kcSignalPipe[1], &sig, 1) < 0)
+        ;
+    errno = saved;
+}
+
+kern_return_t KCSignalPipeOpen(void) {
+    int i;
+
+    if (pipe(g_kcSignalPipe) != 0)
+        return kIOReturnError;
+    for (i = 0; i < 2; i++) {
+        fcntl(g_kcSignalPipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(g_kcSignalPipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    return kIOReturnSuccess;
+}
+
+static void KCDrainSignals(void) {
+    unsigned char sigs[16];
+    ssize_t       n, i;
+
+    while ((n = read(g_kcSignalPipe[0], sigs, sizeof(sigs))) > 0) {
+        for (i = 0; i < n; i++)
+            KCHandleSignal(sigs[i]);
+    }
+}
+
+static void KCControlDrop(KC_ControlClient_t *client) {
+    close(client->fd);
+    client->fd = -1;
+    client->len = 0;
+}
+
+static void KCControlAccept(void) {
+    int fd, i;
+
+    fd = accept(g_control.fd, NULL, NULL);
+    if (fd < 0)
+        return;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    for (i = 0; i < KC_CONTROL_MAX_CLIENTS; i++) {
+        if (g_control.client[i].fd < 0) {
+            g_control.client[i].fd = fd;
+            g_control.client[i].len = 0;
+            return;
+        }
+    }
+    if (write(fd, "error too many clients\n", 23) < 0)
+        ;
+    close(fd);
+}
+
+// Runs every complete line the client sent, the client is dropped when it
+// closes its side or sends a line longer than KC_CONTROL_LINE
+static void KCControlRead(KC_Status_t *state, KC_ControlClient_t *client) {
+    char    reply[KC_LOG_BUFSIZE];
+    char    *line, *eol;
+    ssize_t n;
+
+    n = read(client->fd, client->line + client->len, sizeof(client->line) - 1 - client->len);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n <= 0) {
+        KCControlDrop(client);
+        return;
+    }
+    client->len += n;
+    client->line[client->len] = '\0';
+
+    line = client->line;
+    while ((eol = strchr(line, '\n')) != NULL) {
+        *eol = '\0';
+        KCControlCommand(state, line, reply, sizeof(reply));
+        if (write(client->fd, reply, strlen(reply)) < 0) {
+            KCControlDrop(client);
+            return;
+        }
+        line = eol + 1;
+    }
+    client->len -= line - client->line;
+    memmove(client->line, line, client->len);
+    if (client->len == sizeof(client->line) - 1) {
+        if (write(client->fd, "error line too long\n", 20) < 0)
+            ;
+        KCControlDrop(client);
+    }
+}
+
+// The daemon main loop: waits for the signals, the control socket and its
+// clients and the changes of the configuration file until the deadline of
+// the next tick, then runs the tick. A new configuration is applied here,
+// between two ticks. It never returns, the daemon exits from KCHandleSignal().
+void KCEventLoop(KC_Status_t *state) {
+    struct pollfd fds[3 + KC_CONTROL_MAX_CLIENTS];
+    UInt64        now, wakeup;
+    int           timeout, i;
+
+    for (;;) {
+        now = _uptime_us();
+        if (g_config.reload_at != 0 && now >= g_config.reload_at) {
+            g_config.reload_at = 0;
+            KCConfigReload(state);
+            continue;
+        }
+        if (now >= state->tick.deadline) {
+            KCTickEngineStart(&state->tick, state->debug);
+            KCTickEngineAdvance(&state->tick, KCControlTick(state));
+            continue;
+        }
+
+        fds[0].fd = g_kcSignalPipe[0];
+        fds[1].fd = g_control.fd;
+        fds[2].fd = g_config.fd;
+        for (i = 0; i < KC_CONTROL_MAX_CLIENTS; i++)
+            fds[3 + i].fd = g_control.client[i].fd;
+        for (i = 0; i < 3 + KC_CONTROL_MAX_CLIENTS; i++) {
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        wakeup = state->tick.deadline;
+        if (g_config.reload_at != 0 && g_config.reload_at < wakeup)
+            wakeup = g_config.reload_at;
+        // poll() counts in ms: rounded up, so that it never wakes up early
+        timeout = (int)((wakeup - now + 999) / 1000);
+        if (poll(fds, 3 + KC_CONTROL_MAX_CLIENTS, timeout) <= 0)
+            continue;
+
+        if (fds[0].revents & POLLIN)
+            KCDrainSignals();
+        if (fds[1].revents & POLLIN)
+            KCControlAccept();
+        if ((fds[2].revents & POLLIN) && KCConfigDrain(state))
+            g_config.reload_at = _uptime_us() + KC_CONFIG_SETTLE * 1000;
+        for (i = 0; i < KC_CONTROL_MAX_CLIENTS; i++) {
+            if (fds[3 + i].revents & (POLLIN | POLLHUP | POLLERR))
+                KCControlRead(state, &g_control.client[i]);
+        }
+    }
+}
+
+#pragma mark Control socket
+
+// Listens on the control socket. A socket left by a previous daemon is
+// replaced, one another daemon still answers on is left alone.
+kern_return_t KCControlOpen(KC_Status_t *state) {
+    struct sockaddr_un addr;
+    int                fd, i;
+
+    for (i = 0; i < KC_CONTROL_MAX_CLIENTS; i++)
+        g_control.client[i].fd = -1;
+    if (state->control_socket == NULL)
+        return kIOReturnSuccess;
+    if (strlen(state->control_socket) >= sizeof(addr.sun_path))
+        return kIOReturnBadArgument;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, state->control_socket);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return kIOReturnError;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        close(fd);
+        return kIOReturnError;
+    }
+    close(fd);
+    unlink(state->control_socket);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return kIOReturnError;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        chmod(state->control_socket, 0600) != 0 ||
+        listen(fd, KC_CONTROL_MAX_CLIENTS) != 0) {
+        close(fd);
+        unlink(state->control_socket);
+        return kIOReturnError;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    g_control.fd = fd;
+    return kIOReturnSuccess;
+}
+
+void KCControlClose(KC_Status_t *state) {
+    int i;
+
+    if (g_control.fd < 0)
+        return;
+    for (i = 0; i < KC_CONTROL_MAX_CLIENTS; i++) {
+        if (g_control.client[i].fd >= 0)
+            KCControlDrop(&g_control.client[i]);
+    }
+    close(g_control.fd);
+    g_control.fd = -1;
+    unlink(state->control_socket);
+}
+
+static void KCControlLog(KC_Status_t *state, char *msg) {
+    if (state->debug)
+        printf("Control: %s\n", msg);
+    else
+        KCSysLog(LOG_NOTICE, msg);
+}
+
+static int KCControlStatus(KC_Status_t *state, char *reply, size_t size) {
+    int len, i;
+
+    len = snprintf(reply, size, "ok algorithm=%c temp=%.2f lead=%.2f min=%u max=%u errors=%d ticks=%llu",
+                   KCAlgorithmLetter(state->compute_fan_speed), state->cur_temp, state->load.lead,
+                   state->min_temp, state->max_temp, state->errors_count,
+                   (unsigned long long)state->tick.ticks);
+    for (i = 0; i < state->num_fans && len < size; i++)
+        len += snprintf(reply + len, size - len, " fan%d=%u:%u:%u%s", i, state->fan[i].min_speed,
+                        state->fan[i].current_speed, state->fan[i].max_speed,
+                        state->fan[i].forced_speed ? ":forced" : "");
+    if (len < size)
+        len += snprintf(reply + len, size - len, "\n");
+    return len;
+}
+
+// Runs one command of the control protocol, one line each:
+//   get-status
+//   set-algorithm <alg>          as given to -a
+//   set-min <ºC> / set-max <ºC>  the temperature range of the curves
+//   force-speed <fan>|all <rpm>|auto
+// The reply is a single line, "ok ..." or "error ...". Changes apply at once:
+// the next tick is brought forward.
+void KCControlCommand(KC_Status_t *state, char *line, char *reply, size_t size) {
+    char          cmd[32] = "", arg[32] = "", arg2[32] = "", msg[KC_LOG_BUFSIZE];
+    char          *end;
+    unsigned long value;
+    int           fan, isMin, i;
+
+    sscanf(line, "%31s %31s %31s", cmd, arg, arg2);
+    if (strcmp(cmd, "get-status") == 0) {
+        KCControlStatus(state, reply, size);
+        return;
+    }
+    if (strcmp(cmd, "set-algorithm") == 0) {
+        if (strlen(arg) != 1 || strcmp(KCAlgorithmName(arg[0]), "unknown") == 0 ||
+            (arg[0] == 'u' && state->curve.count == 0)) {
+            snprintf(reply, size, "error unknown algorithm \"%s\"\n", arg);
+            return;
+        }
+        KCSelectAlgothitm(arg[0], state);
+        snprintf(reply, size, "ok algorithm=%c\n", arg[0]);
+    } else if (strcmp(cmd, "set-min") == 0 || strcmp(cmd, "set-max") == 0) {
+        isMin = strcmp(cmd, "set-min") == 0;
+        value = strtoul(arg, &end, 10);
+        if (end == arg || *end != '\0' ||
+            (isMin && (value < KC_ABS_MIN_TEMP || value >= state->max_temp)) ||
+            (!isMin && (value >= KC_ABS_MAX_TEMP || value <= state->min_temp))) {
+            snprintf(reply, size, "error inconsistent temperature \"%s\"\n", arg);
+            return;
+        }
+        if (isMin)
+            state->min_temp = (UInt32)value;
+        else
+            state->max_temp = (UInt32)value;
+        KCInvalidateSpeedTable(state);
+        snprintf(reply, size, "ok min=%u max=%u\n", state->min_temp, state->max_temp);
+    } else if (strcmp(cmd, "force-speed") == 0) {
+        // "all" or a fan number, "auto" or a speed: digits only, no sign
+        if (strcmp(arg, "all") == 0) {
+            fan = -1;
+        } else {
+            value = strtoul(arg, &end, 10);
+            if (arg[0] == '\0' || arg[strspn(arg, "0123456789")] != '\0' || value >= state->num_fans) {
+                snprintf(reply, size, "error unknown fan \"%s\"\n", arg);
+                return;
+            }
+            fan = (int)value;
+        }
+        if (strcmp(arg2, "auto") == 0) {
+            value = 0;
+        } else if (arg2[0] == '\0' || arg2[strspn(arg2, "0123456789")] != '\0') {
+            snprintf(reply, size, "error inconsistent speed \"%s\"\n", arg2);
+            return;
+        } else {
+            value = strtoul(arg2, &end, 10);
+        }
+        for (i = 0; i < state->num_fans; i++) {
+            if ((fan < 0 || fan == i) && strcmp(arg2, "auto") != 0 &&
+                (value < KC_FAN_MIN_SPEED || value > state->fan[i].max_speed)) {
+                snprintf(reply, size, "error inconsistent speed \"%s\" for fan %d\n", arg2, i);
+                return;
+            }
+        }
+        for (i = 0; i < state->num_fans; i++) {
+            if (fan < 0 || fan == i)
+                state->fan[i].forced_speed = (UInt32)value;
+        }
+        snprintf(reply, size, "ok fan=%s speed=%s\n", arg, value ? arg2 : "auto");
+    } else {
+        snprintf(reply, size, "error unknown command \"%s\"\n", cmd);
+        return;
+    }
+
+    snprintf(msg, sizeof(msg), "%s %s %s", cmd, arg, arg2);
+    KCControlLog(state, msg);
+    state->tick.deadline = _uptime_us();
+}
+
+// Sends a command to the daemon and prints its reply, -c
+kern_return_t KCControlSend(char *path, char *command) {
+    struct sockaddr_un addr;
+    char               buf[KC_LOG_BUFSIZE];
+    ssize_t            n;
+    int                fd, failed = -1;
+
+    if (path == NULL || strlen(path) >= sizeof(addr.sun_path))
+        return kIOReturnBadArgument;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        printf("Error: can't connect to %s, is the daemon running?\n", path);
+        if (fd >= 0)
+            close(fd);
+        return kIOReturnNotFound;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    if (write(fd, command, strlen(command)) < 0 || write(fd, "\n", 1) < 0) {
+        close(fd);
+        return kIOReturnError;
+    }
+    shutdown(fd, SHUT_WR);
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        if (failed < 0)
+            failed = strncmp(buf, "error", n < 5 ? n : 5) == 0;
+        fwrite(buf, 1, n, stdout);
+    }
+    close(fd);
+    return failed == 0 ? kIOReturnSuccess : kIOReturnError;
+}
+
+#pragma mark Load sources
+
+#ifdef __APPLE__
+kern_return_t KCHostStatsOpen(void) {
+    return kIOReturnSuccess;
+}
+
+kern_return_t KCHostStatsRead(UInt64 *busy, UInt64 *total) {
+    host_cpu_load_info_data_t info;
+    mach_msg_type_number_t    count = HOST_CPU_LOAD_INFO_COUNT;
+
+    if (host_statistics(mach_host_self(), HOST_CPU_LOAD_INFO, (host_info_t)&info, &count) != KERN_SUCCESS)
+        return kIOReturnError;
+    *busy = (UInt64)info.cpu_ticks[CPU_STATE_USER] + info.cpu_ticks[CPU_STATE_SYSTEM] + info.cpu_ticks[CPU_STATE_NICE];
+    *total = *busy + info.cpu_ticks[CPU_STATE_IDLE];
+    return kIOReturnSuccess;
+}
+
+void KCHostStatsClose(void) {
+}
+
+KC_LoadSource_t g_kcHostStatsLoad = { "host", KCHostStatsOpen, KCHostStatsRead, KCHostStatsClose };
+#endif
+
+static int g_procStatFd = -1;
+
+kern_return_t KCProcStatOpen(void) {
+    if (g_procStatFd < 0)
+        g_procStatFd = open("/proc/stat", O_RDONLY);
+    return g_procStatFd < 0 ? kIOReturnNotFound : kIOReturnSuccess;
+}
+
+// The first line of /proc/stat: "cpu user nice system idle iowait irq softirq steal ..."
+kern_return_t KCProcStatRead(UInt64 *busy, UInt64 *total) {
+    char               buf[256];
+    unsigned long long ticks[8] = {0};
+    ssize_t            len;
+    int                i;
+
+    len = pread(g_procStatFd, buf, sizeof(buf) - 1, 0);
+    if (len <= 0)
+        return kIOReturnError;
+    buf[len] = '\0';
+    if (sscanf(buf, "cpu %llu %llu %llu %llu %llu %llu %llu %llu", &ticks[0], &ticks[1], &ticks[2],
+               &ticks[3], &ticks[4], &ticks[5], &ticks[6], &ticks[7]) < 4)
+        return kIOReturnError;
+    *total = 0;
+    for (i = 0; i < 8; i++)
+        *total += ticks[i];
+    *busy = *total - ticks[3] - ticks[4];
+    return kIOReturnSuccess;
+}
+
+void KCProcStatClose(void) {
+    if (g_procStatFd >= 0)
+        close(g_procStatFd);
+    g_procStatFd = -1;
+}
+
+KC_LoadSource_t g_kcProcStatLoad = { "proc", KCProcStatOpen, KCProcStatRead, KCProcStatClose };
+
+// Parses "<gain>[:<source>]": the ºC of lead for a full load step (0
+// disables the feed-forward) and the source: "host" (OSX) or "proc" (Linux)
+kern_return_t KCParseLoad(char *arg, KC_Status_t *state) {
+    char *end;
+    double gain = strtod(arg, &end);
+
+    if (end == arg || gain < 0.0 || gain > KC_ABS_MAX_TEMP)
+        return kIOReturnBadArgument;
+    state->load.gain = gain;
+    if (*end == '\0')
+        return kIOReturnSuccess;
+    if (*end != ':')
+        return kIOReturnBadArgument;
+#ifdef __APPLE__
+    if (strcmp(end + 1, g_kcHostStatsLoad.name) == 0) {
+        state->load.source = &g_kcHostStatsLoad;
+        return kIOReturnSuccess;
+    }
+#endif
+    if (strcmp(end + 1, g_kcProcStatLoad.name) == 0) {
+        state->load.source = &g_kcProcStatLoad;
+        return kIOReturnSuccess;
+    }
+    return kIOReturnBadArgument;
+}
+
+// Feeds a sample of the cumulative cpu ticks. Temperature lags power by
+// seconds, so the rise of the short load average over the baseline is
+// turned into a lead (ºC) added to the temperatures the fans follow: the
+// fans ramp as a burst starts, and the lead fades as the baseline catches
+// up and the temperature takes over.
+void KCUpdateLoad(KC_LoadState_t *load, UInt64 busy, UInt64 total, UInt64 now) {
+    double util, dt;
+
+    if (load->last_time != 0 && total > load->last_total) {
+        util = (double)(busy - load->last_busy) / (double)(total - load->last_total);
+        dt = (now - load->last_time) / 1000000.0;
+        load->fast += (util - load->fast) * dt / (KC_LOAD_FAST_TAU + dt);
+        load->slow += (util - load->slow) * dt / (KC_LOAD_SLOW_TAU + dt);
+        load->lead = load->gain * fmax(0.0, load->fast - load->slow);
+    }
+    load->last_busy = busy;
+    load->last_total = total;
+    load->last_time = now;
+}
+
+void KCSampleLoad(KC_Status_t *state, UInt64 now) {
+    KC_LoadState_t *load = &state->load;
+    UInt64         busy, total;
+
+    // a reload may turn the feed-forward off: no lead left behind
+    if (load->source == NULL || load->gain == 0.0) {
+        load->lead = 0.0;
+        return;
+    }
+    if (load->source->read(&busy, &total) != kIOReturnSuccess) {
+        load->lead = 0.0;
+        return;
+    }
+    KCUpdateLoad(load, busy, total, now);
+    if (state->debug)
+        printf("Load: %.0f%% (baseline %.0f%%), lead %+.2fºC\n", load->fast * 100.0, load->slow * 100.0, load->lead);
+}
+
+// The temperature a fan follows: the one of its sensors plus the load lead
+double KCFanTemperature(KC_Status_t *state, int i) {
+    return state->fan[i].cur_temp + state->load.lead;
+}
+
+#pragma mark Polling scheduler
+
+void KCSchedulerInit(KC_Status_t *state) {
+    KC_Scheduler_t *sched = &state->sched;
+
+    sched->interval = sched->min_interval;
+    sched->last_temp = KC_ERROR_READING_TEMP;
+    sched->last_poll = 0;
+    sched->temp_rate = 0.0;
+    sched->started = _uptime_us();
+    sched->wakeups = 0;
+}
+
+// How far (ºC) the fan closest to being throttled is from its min temperature,
+// positive when it's throttled
+double KCThrottleMargin(KC_Status_t *state) {
+    double margin, result = state->cur_temp - (double)state->min_temp;
+    int    i;
+
+    for (i = 0; i < state->num_fans; i++) {
+        KC_FanState_t *fan = &state->fan[i];
+
+        margin = KCFanTemperature(state, i) - (double)(fan->min_temp ? fan->min_temp : state->min_temp);
+        if (i == 0 || margin > result)
+            result = margin;
+    }
+    return result;
+}
+
+// Computes how long to sleep (ms) before the next poll, from the rate of change
+// of the temperature and its distance to the throttling range: while the
+// temperature is flat under min_temp the interval doubles up to max_interval,
+// otherwise it's the time the temperature takes to move KC_POLL_TEMP_STEP ºC.
+UInt32 KCScheduleNextPoll(KC_Status_t *state) {
+    KC_Scheduler_t *sched = &state->sched;
+    UInt64         now = _uptime_us();
+    double         elapsed, rate, speed, interval, margin;
+    UInt32         upper = sched->max_interval;
+
+    sched->wakeups++;
+    if (sched->last_poll != 0 && sched->last_temp != KC_ERROR_READING_TEMP) {
+        elapsed = (now - sched->last_poll) / 1000000.0;
+        if (elapsed > 0.0) {
+            rate = (state->cur_temp - sched->last_temp) / elapsed;
+            sched->temp_rate = 0.7 * sched->temp_rate + 0.3 * rate;
+        }
+    }
+    sched->last_temp = state->cur_temp;
+    sched->last_poll = now;
+    margin = KCThrottleMargin(state);
+
+    // fans are (or are about to be) throttled: don't fall asleep
+    if (margin > -KC_POLL_NEAR_TEMP && upper > KC_POLL_ACTIVE_INTERVAL)
+        upper = KC_POLL_ACTIVE_INTERVAL;
+
+    speed = fabs(sched->temp_rate);
+    if (speed < KC_POLL_FLAT_RATE) {
+        interval = sched->interval * 2.0;
+    } else {
+        interval = 1000.0 * KC_POLL_TEMP_STEP / speed;
+        // rising towards min_temp: get there in a couple of polls at least
+        if (sched->temp_rate > 0.0 && margin < 0.0)
+            interval = fmin(interval, 1000.0 * -margin / sched->temp_rate / 2.0);
+    }
+
+    if (interval > upper)
+        interval = upper;
+    if (interval < sched->min_interval)
+        interval = sched->min_interval;
+    sched->interval = (UInt32)interval;
+
+    if (state->debug)
+        printf("Next poll in %u ms (temperature rate %.3fºC/s)\n", sched->interval, sched->temp_rate);
+
+    return sched->interval;
+}
+
+// Reports the polls done so far against the fixed KC_UPDATE_DELAY schedule
+void KCReportPolling(KC_Status_t *state) {
+    KC_Scheduler_t *sched = &state->sched;
+    char           msg[KC_LOG_BUFSIZE];
+    double         elapsed;
+    UInt64         fixed;
+
+    if (sched->started == 0)
+        return;
+    elapsed = (_uptime_us() - sched->started) / 1000000.0;
+    fixed = (UInt64)(elapsed * 1000000.0 / KC_UPDATE_DELAY);
+    snprintf(msg, sizeof(msg), "Polling: %llu wakeups in %.0f s, %lld saved against a fixed %d ms schedule",
+             (unsigned long long)sched->wakeups, elapsed, (long long)fixed - (long long)sched->wakeups, KC_UPDATE_DELAY/1000);
+    if (state->debug)
+        printf("%s\n", msg);
+    else
+        KCSysLog(LOG_NOTICE, msg);
+}
+
+#pragma mark Speed tables
+
+// Sensor readings are quantized to 1/64 ºC codes, the 2 low bits of an sp78
+// value; finer readings (flt, fp6a) are truncated to the code below.
+SInt32 KCTemperatureCode(double temp) {
+    return (SInt32)(temp * KC_TEMP_SCALE);
+}
+
+// Tabulates the selected algorithm for every code between min_temp and
+// max_temp, evaluating it on a scratch copy of the state. Codes below the
+// table give its first speed, codes above it the speed of the algorithm
+// just past the table.
+kern_return_t KCBuildSpeedTable(KC_Status_t *state, KC_SpeedTable_t *table) {
+    KC_Status_t     scratch = *state;
+    KC_UserCurve_t  *curve = &state->curve;
+    SInt32          base, last;
+    UInt32          count, i;
+    UInt16          *speed;
+    UInt64          start = _uptime_us();
+
+    if (state->compute_fan_speed == NULL || state->max_temp <= state->min_temp)
+        return kIOReturnBadArgument;
+
+    // a user curve spans its own points, whatever the temperature range
+    if (state->compute_fan_speed == &KCCurveSpeedAlghoritm) {
+        if (curve->count == 0)
+            return kIOReturnBadArgument;
+        base = (SInt32)floor(curve->temp[0] * KC_TEMP_SCALE);
+        last = (SInt32)ceil(curve->temp[curve->count - 1] * KC_TEMP_SCALE);
+    } else {
+        base = (SInt32)state->min_temp * KC_TEMP_SCALE;
+        last = (SInt32)state->max_temp * KC_TEMP_SCALE;
+    }
+    count = (UInt32)(last - base) + 1;
+    speed = (UInt16 *)realloc(table->speed, count * sizeof(UInt16));
+    if (speed == NULL)
+        return kIOReturnError;
+
+    table->base = base;
+    for (i = 0; i < count; i++) {
+        scratch.cur_temp = (double)(table->base + (SInt32)i) / KC_TEMP_SCALE;
+        speed[i] = (*state->compute_fan_speed)((void *)&scratch);
+    }
+
+    scratch.cur_temp = (double)(last + 1) / KC_TEMP_SCALE;
+    table->max_speed = (*state->compute_fan_speed)((void *)&scratch);
+    table->speed = speed;
+    table->count = count;
+    table->algorithm = state->compute_fan_speed;
+
+    if (state->debug)
+        printf("Speed table: %u entries (%.1f-%.1fºC) built in %llu us\n", count,
+               (double)base / KC_TEMP_SCALE, (double)last / KC_TEMP_SCALE, (unsigned long long)(_uptime_us() - start));
+    return kIOReturnSuccess;
+}
+
+void KCFreeSpeedTable(KC_Status_t *state) {
+    int i;
+
+    free(state->speed_table.speed);
+    memset(&state->speed_table, 0, sizeof(KC_SpeedTable_t));
+    for (i = 0; i < KC_MAX_FANS; i++) {
+        free(state->fan[i].speed_table.speed);
+        memset(&state->fan[i].speed_table, 0, sizeof(KC_SpeedTable_t));
+    }
+}
+
+// Whoever changes the temperature range or the max speed has to call this,
+// the tables are then rebuilt at the next lookup
+void KCInvalidateSpeedTable(KC_Status_t *state) {
+    int i;
+
+    state->speed_table.algorithm = NULL;
+    for (i = 0; i < KC_MAX_FANS; i++)
+        state->fan[i].speed_table.algorithm = NULL;
+}
+
+static inline UInt16 KCSpeedTableLookup(KC_SpeedTable_t *table, double temp) {
+    SInt32 idx = KCTemperatureCode(temp) - table->base;
+
+    if (idx <= 0)
+        return table->speed[0];
+    if ((UInt32)idx >= table->count)
+        return (UInt16)table->max_speed;
+    return table->speed[idx];
+}
+
+// The curve of a fan: the global one with the fan settings applied
+static void KCFanCurve(KC_Status_t *state, int i, KC_Status_t *curve) {
+    KC_FanState_t *fan = &state->fan[i];
+
+    *curve = *state;
+    if (fan->compute_fan_speed != NULL)
+        curve->compute_fan_speed = fan->compute_fan_speed;
+    if (fan->min_temp != 0)
+        curve->min_temp = fan->min_temp;
+    if (fan->max_temp != 0)
+        curve->max_temp = fan->max_temp;
+    if (fan->max_speed != 0)
+        curve->max_speed = fan->max_speed;
+    if (fan->curve.count != 0)
+        curve->curve = fan->curve;
+    curve->delta_v = (double)curve->max_speed - KC_FAN_MIN_SPEED;
+    curve->cur_temp = fan->cur_temp;
+}
+
+// The new fan speed for the current temperature: a table load. The table is
+// rebuilt at the first lookup after the algorithm is switched (possibly from
+// a signal handler) or the table is invalidated; if it can't be built the
+// algorithm is evaluated.
+UInt16 KCComputeFanSpeed(KC_Status_t *state) {
+    KC_SpeedTable_t *table = &state->speed_table;
+
+    // the PID controller has a state, it can't be tabulated, and the SMC
+    // default doesn't need to be
+    if (state->compute_fan_speed == &KCPIDSpeedAlghoritm)
+        return KCPIDSpeedAlghoritm((void *)state);
+    if (state->compute_fan_speed == &KCResetSpeedAlghoritm)
+        return KCResetSpeedAlghoritm((void *)state);
+    if (table->algorithm != state->compute_fan_speed) {
+        if (KCBuildSpeedTable(state, table) != kIOReturnSuccess)
+            return (*state->compute_fan_speed)((void *)state);
+    }
+    return KCSpeedTableLookup(table, state->cur_temp + state->load.lead);
+}
+
+// The new speed of a fan, from its own table
+UInt16 KCComputeFanSpeedOf(KC_Status_t *state, int i) {
+    KC_FanState_t       *fan = &state->fan[i];
+    KC_SpeedAlgorithm_t algorithm = fan->compute_fan_speed ? fan->compute_fan_speed : state->compute_fan_speed;
+
+    // restoring the SMC default (at shutdown) overrides the fan algorithms
+    if (state->compute_fan_speed == &KCResetSpeedAlghoritm)
+        algorithm = &KCResetSpeedAlghoritm;
+    if (algorithm == &KCPIDSpeedAlghoritm)
+        return KCPIDUpdate(&fan->pid, &state->pid, KCFanTemperature(state, i), state->sample_time,
+                           fan->max_speed ? fan->max_speed : state->max_speed);
+    if (algorithm == &KCResetSpeedAlghoritm)
+        return KCResetSpeedAlghoritm((void *)state);
+    if (fan->speed_table.algorithm != algorithm) {
+        KC_Status_t curve;
+
+        KCFanCurve(state, i, &curve);
+        if (state->debug)
+            printf("Fan [%d]: ", i);
+        if (KCBuildSpeedTable(&curve, &fan->speed_table) != kIOReturnSuccess)
+            return (*algorithm)((void *)&curve);
+    }
+    return KCSpeedTableLookup(&fan->speed_table, KCFanTemperature(state, i));
+}
+
+void KCPrintFanSpeeds(KC_Status_t *state) {
+    int i;
+
+    for (i = 0; i < state->num_fans; i++)
+        printf("Computed new speed of Fan[%d]: %d (%.2fºC)\n", i, KCComputeFanSpeedOf(state, i), KCFanTemperature(state, i));
+}
+
+#pragma mark Temperature filter
+
+// Parses "none", "ema[:<alpha>]", "median[:<window>]" or "both[:<window>[:<alpha>]]"
+kern_return_t KCParseFilter(char *arg, KC_Status_t *state) {
+    KC_TempFilter_t *filter = &state->filter;
+    char            *p, *end;
+    int             mode;
+
+    if (strncmp(arg, "none", 4) == 0) {
+        mode = KC_FILTER_NONE;
+        p = arg + 4;
+    } else if (strncmp(arg, "ema", 3) == 0) {
+        mode = KC_FILTER_EMA;
+        p = arg + 3;
+    } else if (strncmp(arg, "median", 6) == 0) {
+        mode = KC_FILTER_MEDIAN;
+        p = arg + 6;
+    } else if (strncmp(arg, "both", 4) == 0) {
+        mode = KC_FILTER_BOTH;
+        p = arg + 4;
+    } else {
+        return kIOReturnBadArgument;
+    }
+
+    if ((mode & KC_FILTER_MEDIAN) && *p == ':') {
+        filter->window = (UInt32)strtoul(p + 1, &end, 10);
+        if (end == p + 1 || filter->window < 1 || filter->window > KC_FILTER_MAX_WINDOW)
+            return kIOReturnBadArgument;
+        p = end;
     }
-    val.dataSize = i / 2;
-    /*sprintf(val.key, key);*/
-    strncpy(val.key, key, sizeof(UInt32Char_t));
-    val.key[sizeof(UInt32Char_t)-1] = '\0';
-    result = SMCWriteKey2(val, conn);
-    if (result != kIOReturnSuccess)
-        printf("Error: SMCWriteKey() = %08x\n", result);
-	
-    
-    return result;
+    if ((mode & KC_FILTER_EMA) && *p == ':') {
+        filter->alpha = strtod(p + 1, &end);
+        if (end == p + 1 || filter->alpha <= 0.0 || filter->alpha > 1.0)
+            return kIOReturnBadArgument;
+        p = end;
+    }
+    if (*p != '\0')
+        return kIOReturnBadArgument;
+    filter->mode = mode;
+    return kIOReturnSuccess;
 }
 
-double SMCGetTemperature(char *key)
-{
-    SMCVal_t val;
-    kern_return_t result;
+// Pushes a reading of a sensor in its ring buffer and returns it filtered:
+// the median of the last window readings, then their exponential moving
+// average. Readings that failed don't enter the filter.
+double KCFilterSample(KC_TempFilter_t *filter, int sensor, double raw) {
+    double sorted[KC_FILTER_MAX_WINDOW], temp = raw, v;
+    UInt32 n, i, j;
 
-    result = SMCReadKey(key, &val);
-    if (result == kIOReturnSuccess) {
-        // read succeeded - check returned value
-        if (val.dataSize > 0) {
-            if (strcmp(val.dataType, DATATYPE_SP78) == 0) {
-                // convert fp78 value to temperature
-                int intValue = (val.bytes[0] * 256 + val.bytes[1]) >> 2;
-                return intValue / 64.0;
-            }
+    if (filter->mode == KC_FILTER_NONE || raw == KC_ERROR_READING_TEMP)
+        return raw;
+
+    if (filter->mode & KC_FILTER_MEDIAN) {
+        filter->ring[sensor][filter->head[sensor]] = raw;
+        filter->head[sensor] = (filter->head[sensor] + 1) % filter->window;
+        if (filter->count[sensor] < filter->window)
+            filter->count[sensor]++;
+
+        // insertion sort, the window is a handful of samples
+        n = filter->count[sensor];
+        for (i = 0; i < n; i++) {
+            v = filter->ring[sensor][i];
+            for (j = i; j > 0 && sorted[j - 1] > v; j--)
+                sorted[j] = sorted[j - 1];
+            sorted[j] = v;
         }
+        temp = n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2.0;
     }
-    // read failed
-    return 0.0;
+
+    if (filter->mode & KC_FILTER_EMA) {
+        // the first reading seeds the average, whatever its value
+        if (filter->ema_count[sensor] == 0)
+            filter->ema[sensor] = temp;
+        else
+            filter->ema[sensor] += filter->alpha * (temp - filter->ema[sensor]);
+        if (filter->ema_count[sensor] < UINT32_MAX)
+            filter->ema_count[sensor]++;
+        temp = filter->ema[sensor];
+    }
+    return temp;
 }
 
-kern_return_t SMCCountFans(KC_Status_t *state) {
-    kern_return_t result;
-    SMCVal_t      val;
-    
-    result = SMCReadKey("FNum", &val);
-    if (result != kIOReturnSuccess)
-        return kIOReturnError;
-    state->num_fans = _strtoul((char *)val.bytes, val.dataSize, 10);
+// Counts the speed changes and the SMC writes of a fan, and the ones the
+// same fan would have had following the unfiltered temperature (tabulated
+// algorithms only: the PID controller can't be replayed)
+void KCFilterAccount(KC_Status_t *state, int i, UInt16 newSpeed) {
+    KC_FanState_t       *fan = &state->fan[i];
+    KC_TempFilter_t     *filter = &state->filter;
+    KC_FanState_t       shadow;
+    KC_SpeedAlgorithm_t algorithm = fan->compute_fan_speed ? fan->compute_fan_speed : state->compute_fan_speed;
+    UInt16              rawSpeed;
+    double              temp;
 
-    if (state->num_fans > 0) {
-        result = SMCReadKey("F0Mx", &val);
-        if (result != kIOReturnSuccess)
-            return kIOReturnError;
-        state->max_speed = _strtoul((char *)val.bytes, val.dataSize, 10) >> 2;
-	state->delta_v = (double)(state->max_speed-KC_FAN_MIN_SPEED);
+    if (newSpeed != fan->speed && filter->mode != KC_FILTER_NONE)
+        filter->changes++;
+    fan->speed = newSpeed;
+    if (filter->mode == KC_FILTER_NONE)
+        return;
+
+    if (algorithm == &KCPIDSpeedAlghoritm || fan->speed_table.algorithm != algorithm)
+        return;
+    if ((temp = KCRawFanTemperature(state, i)) == KC_ERROR_READING_TEMP)
+        return;
+    rawSpeed = KCSpeedTableLookup(&fan->speed_table, temp);
+    if (rawSpeed != fan->raw_speed)
+        filter->raw_changes++;
+    fan->raw_speed = rawSpeed;
+
+    shadow = *fan;
+    shadow.min_speed = fan->raw_written;
+    shadow.last_direction = fan->raw_direction;
+    if (KCFanNeedsWrite(state, &shadow, rawSpeed)) {
+        fan->raw_direction = rawSpeed > fan->raw_written ? 1 : -1;
+        fan->raw_written = rawSpeed;
+        filter->raw_writes++;
     }
+}
 
+void KCReportFilter(KC_Status_t *state) {
+    KC_TempFilter_t *filter = &state->filter;
+    char            msg[KC_LOG_BUFSIZE];
+
+    if (filter->mode == KC_FILTER_NONE)
+        return;
+    snprintf(msg, sizeof(msg), "Filter: %llu speed changes and %llu SMC writes, %llu and %llu without it",
+             (unsigned long long)filter->changes, (unsigned long long)state->writes,
+             (unsigned long long)filter->raw_changes, (unsigned long long)filter->raw_writes);
     if (state->debug)
-	printf("Number of Fans: %d (max speed %d rpm)\n", state->num_fans, state->max_speed);
-    
+        printf("%s\n", msg);
+    else
+        KCSysLog(LOG_NOTICE, msg);
+}
+
+#pragma mark Per fan curves
+
+KC_SpeedAlgorithm_t KCAlgorithmOf(char alg) {
+    switch (alg) {
+        case 's': return &KCLinearSpeedAlghoritm;
+        case 'c': return &KCLogarithmicSpeedAlghoritm;
+        case 'q': return &KCQuadraticSpeedAlghoritm;
+        case 'b': return &KCCubicSpeedAlghoritm;
+        case 'i': return &KCInverseCubicSpeedAlghoritm;
+        case 'w': return &KCWaveSpeedAlghoritm;
+        case 'p': return &KCPIDSpeedAlghoritm;
+        case 'u': return &KCCurveSpeedAlghoritm;
+    }
+    return NULL;
+}
+
+static kern_return_t KCParseFanTemp(char **p, UInt32 *temp) {
+    char *end;
+    long value;
+
+    if (**p == ':' || **p == '\0')
+        return kIOReturnSuccess;
+    value = strtol(*p, &end, 10);
+    if (end == *p || value < KC_ABS_MIN_TEMP || value >= KC_ABS_MAX_TEMP)
+        return kIOReturnBadArgument;
+    *temp = (UInt32)value;
+    *p = end;
     return kIOReturnSuccess;
 }
 
-kern_return_t SMCUpdateFans(KC_Status_t *state) {
-    kern_return_t result = kIOReturnSuccess;
-    SMCVal_t      val;
-    UInt32Char_t  key;
-    int           i;
-    
-    for (i = 0; i < state->num_fans; i++)
-    {
-        sprintf(key, "F%dMn", i);
-        result = SMCReadKey(key, &val);
-        state->fan[i].min_speed=(UInt32)_strtof(val.bytes, val.dataSize, 2);
+// Parses "<fan>:[<alg>][:[<min>][:[<max>][:<key>[+<key>...]]]]", the empty
+// fields keep the global settings. The sensors are resolved, against the -T
+// ones, by KCResolveFanCurves().
+kern_return_t KCParseFanCurve(char *arg, KC_Status_t *state) {
+    KC_FanState_t *fan;
+    char          *p, *end;
+    long          i;
 
-        sprintf(key, "F%dAc", i);
-        result = SMCReadKey(key, &val);
-        state->fan[i].current_speed=(UInt32)_strtof(val.bytes, val.dataSize, 2);
+    i = strtol(arg, &end, 10);
+    if (end == arg || *end != ':' || i < 0 || i >= KC_MAX_FANS)
+        return kIOReturnBadArgument;
+    fan = &state->fan[i];
+    p = end + 1;
 
-        if (state->debug)
-	    printf("Fan [%d]: Min Speed = %d Current Speed = %d\n", i, state->fan[i].min_speed, state->fan[i].current_speed);
+    if (*p != ':' && *p != '\0') {
+        if ((fan->compute_fan_speed = KCAlgorithmOf(*p)) == NULL)
+            return kIOReturnBadArgument;
+        p++;
     }
-    
-    return result;
+    if (*p == ':') {
+        p++;
+        if (KCParseFanTemp(&p, &fan->min_temp) != kIOReturnSuccess)
+            return kIOReturnBadArgument;
+    }
+    if (*p == ':') {
+        p++;
+        if (KCParseFanTemp(&p, &fan->max_temp) != kIOReturnSuccess)
+            return kIOReturnBadArgument;
+    }
+    if (*p == ':') {
+        if (*(++p) == '\0')
+            return kIOReturnBadArgument;
+        fan->sensor_spec = p;
+    } else if (*p != '\0') {
+        return kIOReturnBadArgument;
+    }
+
+    fan->curve_spec = arg;
+    return kIOReturnSuccess;
 }
 
-kern_return_t SMCSetFanSpeed(KC_Status_t *state) {
-    kern_return_t result = kIOReturnSuccess;
-    SMCVal_t      val;
-    int           i;
-    UInt16        newSpeed = (*state->compute_fan_speed)((void *)state);
-    UInt16        byteVal = newSpeed << 2;
-    char	  *value = (char *)&byteVal;
+// Checks the fans temperature ranges and maps their sensors onto the -T ones
+// (before the '?' sensor is resolved, so that '?' matches it). The reason of
+// a failure is formatted in error.
+kern_return_t KCResolveFanCurves(KC_Status_t *state, char *error, size_t size) {
+    int i, j, len;
 
-    if (state->debug)
-        printf("HexValue = %x\n",byteVal);
+    KCDefaultSensors(state);
+    if (state->compute_fan_speed == &KCCurveSpeedAlghoritm && state->curve.count == 0) {
+        snprintf(error, size, "the user curve algorithm needs a curve (-u)");
+        return kIOReturnBadArgument;
+    }
+    for (i = 0; i < KC_MAX_FANS; i++) {
+        KC_FanState_t *fan = &state->fan[i];
+        UInt32        min_temp = fan->min_temp ? fan->min_temp : state->min_temp;
+        UInt32        max_temp = fan->max_temp ? fan->max_temp : state->max_temp;
+        char          *key = fan->sensor_spec;
 
-    val.bytes[0] = (int)value[1];
-    val.bytes[1] = (int)value[0];
-    val.dataSize = sizeof(byteVal);
+        if (min_temp >= max_temp) {
+            snprintf(error, size, "inconsistent temperature range for Fan[%d]", i);
+            return kIOReturnBadArgument;
+        }
+        if (fan->compute_fan_speed == &KCCurveSpeedAlghoritm && fan->curve.count == 0 && state->curve.count == 0) {
+            snprintf(error, size, "Fan[%d] follows a user curve, none given (-u)", i);
+            return kIOReturnBadArgument;
+        }
 
-    for (i = 0; i < state->num_fans; i++)
-    {
-    	if (state->fan[i].min_speed != newSpeed) {
-	    if (state->debug)
-		printf("Changing speed of Fan[%d] from %d to %d\n",i,state->fan[i].min_speed,newSpeed);
-	    state->fan[i].min_speed = newSpeed;
-            sprintf(val.key, "F%dMn", i);
-	    result = SMCWriteKey(val);
-	} else {
-	    if (state->debug)
-		printf("No need to change min speed of Fan[%d]\n",i);
-	}
+        fan->sensor_mask = 0;
+        while (key != NULL && *key != '\0') {
+            len = strcspn(key, "+");
+            for (j = 0; j < state->num_sensors; j++) {
+                if (strlen(state->sensors[j].key) == len && strncmp(state->sensors[j].key, key, len) == 0)
+                    break;
+            }
+            if (j == state->num_sensors) {
+                snprintf(error, size, "the sensors of Fan[%d] must be listed in -T", i);
+                return kIOReturnBadArgument;
+            }
+            fan->sensor_mask |= 1 << j;
+            key += len;
+            if (*key == '+')
+                key++;
+        }
     }
-    return result;
+    return kIOReturnSuccess;
 }
 
-kern_return_t KCFindCPUSensor(KC_Status_t *state) {
-    kern_return_t result;
-    SMCKeyData_t  inputStructure;
-    SMCKeyData_t  outputStructure;
-    double        cur_temp, max_temp;
-    
-    int           totalKeys, i;
-    UInt32Char_t  key;
-    SMCVal_t      val;
-    
-    totalKeys = SMCReadIndexCount();
-    for (i = 0; i < totalKeys; i++)
-    {
-        memset(&inputStructure, 0, sizeof(SMCKeyData_t));
-        memset(&outputStructure, 0, sizeof(SMCKeyData_t));
-        memset(&val, 0, sizeof(SMCVal_t));
-        
-        inputStructure.data8 = SMC_CMD_READ_INDEX;
-        inputStructure.data32 = i;
-        
-        result = SMCCall(KERNEL_INDEX_SMC, &inputStructure, &outputStructure);
-        if (result != kIOReturnSuccess)
+#pragma mark User curves
+
+// Fritsch-Carlson: the tangents of a cubic Hermite spline that neither
+// overshoots nor oscillates, so the speed never goes down while the
+// temperature goes up (unless the points do)
+static void KCCurveSlopes(KC_UserCurve_t *curve) {
+    double secant[KC_CURVE_MAX_POINTS], a, b, t;
+    UInt32 n = curve->count, k;
+
+    for (k = 0; k < n - 1; k++)
+        secant[k] = (curve->rpm[k + 1] - curve->rpm[k]) / (curve->temp[k + 1] - curve->temp[k]);
+    curve->slope[0] = secant[0];
+    curve->slope[n - 1] = secant[n - 2];
+    for (k = 1; k < n - 1; k++)
+        curve->slope[k] = secant[k - 1] * secant[k] <= 0.0 ? 0.0 : (secant[k - 1] + secant[k]) / 2.0;
+    for (k = 0; k < n - 1; k++) {
+        if (secant[k] == 0.0) {
+            curve->slope[k] = curve->slope[k + 1] = 0.0;
             continue;
-        
-        _ultostr(key, outputStructure.key);
-        
-	if (key[0] == 'T' && key[1] == 'C') {
-	    cur_temp = SMCGetTemperature(key);
-            if (state->debug)
-                printf("Sensor \"%s\", Temperature %.2f°C\n",key,cur_temp);
-	   
-	    if (cur_temp >= max_temp && cur_temp < KC_WAKEUP_IGNORE_TEMP) {
-	        max_temp = cur_temp;
-                strncpy(state->temp_key, key, sizeof(state->temp_key));  
-	    }
-	}
+        }
+        a = curve->slope[k] / secant[k];
+        b = curve->slope[k + 1] / secant[k];
+        if (a * a + b * b > 9.0) {
+            t = 3.0 / sqrt(a * a + b * b);
+            curve->slope[k] = t * a * secant[k];
+            curve->slope[k + 1] = t * b * secant[k];
+        }
     }
+}
 
-    if (state->debug)
-        printf("Using \"%s\" as CPU Temperature Sensor\n",state->temp_key);
-    
+// Parses "[<fan>=][linear,|cubic,]<ºC>:<rpm>,<ºC>:<rpm>...": at least 2
+// points, temperatures increasing. Without a fan it's the global curve,
+// which becomes the algorithm, otherwise the curve of that fan.
+kern_return_t KCParseUserCurve(char *arg, KC_Status_t *state) {
+    KC_UserCurve_t curve;
+    char           *p = arg, *end;
+    double         temp, rpm;
+    long           fan = -1;
+
+    if ((end = strchr(arg, '=')) != NULL) {
+        fan = strtol(arg, &p, 10);
+        if (p != end || fan < 0 || fan >= KC_MAX_FANS)
+            return kIOReturnBadArgument;
+        p = end + 1;
+    }
+    memset(&curve, 0, sizeof(curve));
+    curve.mode = KC_CURVE_LINEAR;
+    if (strncmp(p, "linear,", 7) == 0) {
+        p += 7;
+    } else if (strncmp(p, "cubic,", 6) == 0) {
+        curve.mode = KC_CURVE_CUBIC;
+        p += 6;
+    }
+
+    while (*p != '\0') {
+        if (curve.count == KC_CURVE_MAX_POINTS)
+            return kIOReturnBadArgument;
+        temp = strtod(p, &end);
+        if (end == p || *end != ':')
+            return kIOReturnBadArgument;
+        p = end + 1;
+        rpm = strtod(p, &end);
+        if (end == p || temp < KC_ABS_MIN_TEMP || temp >= KC_ABS_MAX_TEMP ||
+            (curve.count > 0 && temp <= curve.temp[curve.count - 1]) ||
+            rpm < KC_FAN_MIN_SPEED || rpm > UINT16_MAX)
+            return kIOReturnBadArgument;
+        curve.temp[curve.count] = temp;
+        curve.rpm[curve.count] = rpm;
+        curve.count++;
+        if (*end == ',' && end[1] != '\0')
+            end++;
+        else if (*end != '\0')
+            return kIOReturnBadArgument;
+        p = end;
+    }
+    if (curve.count < 2)
+        return kIOReturnBadArgument;
+    KCCurveSlopes(&curve);
+    curve.spec = arg;
+
+    if (fan < 0) {
+        state->curve = curve;
+        state->compute_fan_speed = &KCCurveSpeedAlghoritm;
+    } else {
+        state->fan[fan].curve = curve;
+        state->fan[fan].compute_fan_speed = &KCCurveSpeedAlghoritm;
+    }
     return kIOReturnSuccess;
 }
 
+// The speed of the curve at a temperature, flat outside of its points
+double KCCurveEval(const KC_UserCurve_t *curve, double temp) {
+    double h, s, s2, s3;
+    UInt32 k = 1;
+
+    if (temp <= curve->temp[0])
+        return curve->rpm[0];
+    if (temp >= curve->temp[curve->count - 1])
+        return curve->rpm[curve->count - 1];
+    while (temp > curve->temp[k])
+        k++;
+    h = curve->temp[k] - curve->temp[k - 1];
+    s = (temp - curve->temp[k - 1]) / h;
+    if (curve->mode == KC_CURVE_LINEAR)
+        return curve->rpm[k - 1] + s * (curve->rpm[k] - curve->rpm[k - 1]);
+    s2 = s * s;
+    s3 = s2 * s;
+    return (2 * s3 - 3 * s2 + 1) * curve->rpm[k - 1] + (s3 - 2 * s2 + s) * h * curve->slope[k - 1] +
+           (-2 * s3 + 3 * s2) * curve->rpm[k] + (s3 - s2) * h * curve->slope[k];
+}
+
+// Like the other algorithms, the SMC default up to the first point; the
+// cost of the points is paid once, when the speed table is built
+UInt16 KCCurveSpeedAlghoritm(void *structure) {
+    KC_Status_t	*state = (KC_Status_t *)structure;
+    double      rpm;
+
+    if (state->curve.count == 0 || state->cur_temp <= state->curve.temp[0])
+	return KC_SMC_DEF_SPEED;
+    rpm = KCCurveEval(&state->curve, state->cur_temp);
+    if (state->max_speed != 0 && rpm > state->max_speed)
+	rpm = state->max_speed;
+    return (UInt16)rpm;
+}
+
+#pragma mark Speed algorithms
+
 UInt16 KCLinearSpeedAlghoritm(void *structure) {
     KC_Status_t	*state = (KC_Status_t *)structure;
     double curTemp = state->cur_temp;
@@ -899,6 +4830,79 @@ UInt16 KCWaveSpeedAlghoritm(void *structure) {
     return newSpeed;
 }
 
+#pragma mark PID controller
+
+// One step of a PID controller holding the temperature at cfg->target, from
+// the sample taken at now (us). The derivative is taken on the temperature,
+// not on the error, so changing the target doesn't kick the fans, and it's
+// low pass filtered against the sensor quantization. The integral only moves
+// while the output isn't saturated, or when it pulls the output back from
+// saturation (anti-windup). Speeds under the fan hardware minimum are raised
+// by the SMC, so the output grows continuously from the SMC default speed
+// instead of jumping to KC_FAN_MIN_SPEED.
+UInt16 KCPIDUpdate(KC_PIDState_t *pid, KC_PIDConfig_t *cfg, double temp, UInt64 now, UInt32 max_speed) {
+    double error = temp - cfg->target;
+    double dt = 0.0, integral, output;
+
+    // asked twice for the same sample (debug mode does)
+    if (pid->last_time != 0 && now < pid->last_time + KC_PID_MIN_DT)
+        return pid->output;
+
+    if (pid->last_time != 0 && now - pid->last_time <= KC_PID_MAX_DT)
+        dt = (now - pid->last_time) / 1000000.0;
+    else
+        pid->derivative = 0.0;
+
+    integral = pid->integral;
+    if (dt > 0.0) {
+        pid->derivative += dt / (cfg->tau + dt) * ((temp - pid->last_temp) / dt - pid->derivative);
+        integral += cfg->ki * error * dt;
+    }
+
+    output = cfg->kp * error + integral + cfg->kd * pid->derivative;
+    if ((output <= max_speed || error < 0.0) && (output >= 0.0 || error > 0.0))
+        pid->integral = fmax(0.0, fmin(integral, (double)max_speed));
+    output = cfg->kp * error + pid->integral + cfg->kd * pid->derivative;
+
+    if (output < 1.0)
+        pid->output = KC_SMC_DEF_SPEED;
+    else if (output > max_speed)
+        pid->output = (UInt16)max_speed;
+    else
+        pid->output = (UInt16)output;
+    pid->last_temp = temp;
+    pid->last_time = now;
+    return pid->output;
+}
+
+UInt16 KCPIDSpeedAlghoritm(void *structure) {
+    KC_Status_t	*state = (KC_Status_t *)structure;
+
+    return KCPIDUpdate(&state->pid_state, &state->pid, state->cur_temp + state->load.lead, state->sample_time, state->max_speed);
+}
+
+// Parses "<target>[:<kp>[:<ki>[:<kd>[:<tau>]]]]"
+kern_return_t KCParsePID(char *arg, KC_Status_t *state) {
+    KC_PIDConfig_t cfg = state->pid;
+    double         *field[5] = {&cfg.target, &cfg.kp, &cfg.ki, &cfg.kd, &cfg.tau};
+    char           *p = arg, *end;
+    int            i;
+
+    for (i = 0; i < 5; i++) {
+        *field[i] = strtod(p, &end);
+        if (end == p || *field[i] < 0.0)
+            return kIOReturnBadArgument;
+        p = end;
+        if (*p != ':')
+            break;
+        p++;
+    }
+    if (*p != '\0' || cfg.target < KC_ABS_MIN_TEMP || cfg.target >= KC_ABS_MAX_TEMP)
+        return kIOReturnBadArgument;
+    state->pid = cfg;
+    return kIOReturnSuccess;
+}
+
 UInt16 KCResetSpeedAlghoritm(void *structure) {
     return (UInt16)KC_SMC_DEF_SPEED;
 }
@@ -947,6 +4951,20 @@ void KCSelectAlgothitm(char alg, KC_Status_t *state) {
 	    else
 	        KCSysLog(LOG_NOTICE, "Selected Speed Computing Algorithm: 3-Steps (Wave)");
             break;
+        case 'p':
+	    state->compute_fan_speed=&KCPIDSpeedAlghoritm;
+	    if (state->debug)
+		printf("Selected Speed Computing Algorithm: PID\n");
+	    else
+	        KCSysLog(LOG_NOTICE, "Selected Speed Computing Algorithm: PID");
+            break;
+        case 'u':
+	    state->compute_fan_speed=&KCCurveSpeedAlghoritm;
+	    if (state->debug)
+		printf("Selected Speed Computing Algorithm: user curve\n");
+	    else
+	        KCSysLog(LOG_NOTICE, "Selected Speed Computing Algorithm: user curve");
+            break;
         case 'r':
 	    state->compute_fan_speed=&KCResetSpeedAlghoritm;
 	    if (state->debug)
@@ -957,25 +4975,30 @@ void KCSelectAlgothitm(char alg, KC_Status_t *state) {
 
 void KCSwitchAlgothitm(int signal, KC_Status_t *state) {
     int     idx = 0;
-    char    algs[6] = {'q','s','c','b','i','w'};
-    void    *impl[6] = {&KCQuadraticSpeedAlghoritm,
+    char    algs[7] = {'q','s','c','b','i','w','p'};
+    void    *impl[7] = {&KCQuadraticSpeedAlghoritm,
                         &KCLinearSpeedAlghoritm,
 			&KCLogarithmicSpeedAlghoritm,
 			&KCCubicSpeedAlghoritm,
 			&KCInverseCubicSpeedAlghoritm,
-			&KCWaveSpeedAlghoritm};
+			&KCWaveSpeedAlghoritm,
+			&KCPIDSpeedAlghoritm};
     
-    while (impl[idx] != state->compute_fan_speed)
+    // the SMC default isn't in the sequence, it counts as the first one
+    while (idx < sizeof(algs) && impl[idx] != state->compute_fan_speed)
     	idx++;
+    if (idx == sizeof(algs))
+        idx = 0;
     
     switch (signal) {
     	case SIGUSR1:
-	    KCSelectAlgothitm(algs[++idx%sizeof(algs)], gbl_state);
+	    idx = (idx + 1) % sizeof(algs);
+	    break;
 	case SIGUSR2:
-	    KCSelectAlgothitm(algs[(--idx+sizeof(algs))%sizeof(algs)], gbl_state);
-	default:
-	    KCSelectAlgothitm(algs[idx], gbl_state);
+	    idx = (idx + sizeof(algs) - 1) % sizeof(algs);
+	    break;
 	}
+    KCSelectAlgothitm(algs[idx], state);
 }
 
 void KCRegisterSignalHandler() {
@@ -993,10 +5016,14 @@ void KCRegisterSignalHandler() {
 	printf("\ncan't catch SIGQUIT\n");
     if (signal(SIGABRT, KCSigHandler) == SIG_ERR)
 	printf("\ncan't catch SIGABRT\n");
+    // a control client going away shows up as EPIPE
+    signal(SIGPIPE, SIG_IGN);
 }
 
-void KCSigHandler(int sigNum) {
+// Handles a signal in the event loop, out of signal context (see KCSigHandler())
+void KCHandleSignal(int sigNum) {
     char    msg[KC_LOG_BUFSIZE];
+    int     i;
 
     sprintf(msg, "Received Signal %d\n",sigNum);
     if (gbl_state->debug)
@@ -1018,12 +5045,26 @@ void KCSigHandler(int sigNum) {
 	    /* Reset SMC Min Speed before exit */
 	    if (gbl_state->debug)
 	       printf("Restoring SMC Fan Speed to default value.\n");
+	    for (i = 0; i < KC_MAX_FANS; i++)
+	        gbl_state->fan[i].forced_speed = 0;
             KCSelectAlgothitm('r', gbl_state);
 	    SMCSetFanSpeed(gbl_state);
-	    if (gbl_state->debug)
+	    KCReportPolling(gbl_state);
+	    KCReportTicks(gbl_state);
+	    KCReportWrites(gbl_state);
+	    KCReportFilter(gbl_state);
+	    KCTraceClose(gbl_state);
+	    KCShmClose(gbl_state);
+	    KCControlClose(gbl_state);
+	    if (gbl_state->load.source != NULL)
+	        gbl_state->load.source->close();
+	    if (gbl_state->debug) {
+	       SMCDumpCallStats(stdout);
 	       printf("Bye.\n");
+	    }
 	    else
 	       KCSysLog(LOG_NOTICE, "Restored SMC default values, shutting down");
+	    KCLogStop();
 	    smc_close();
 	    exit(0);
             break;
@@ -1032,9 +5073,33 @@ void KCSigHandler(int sigNum) {
 
 kern_return_t KCDumpOptions(FILE *fp, KC_Status_t *state) {
 	kern_return_t retVal = 0;
+	char          sensors[KC_MAX_SENSORS * 32];
+	int           i;
 
+	KCFormatSensors(sensors, sizeof(sensors), state);
 	fprintf(fp,"%s-T%s",KC_PLIST_PRE_ARGUMENT,KC_PLIST_POST_ARGUMENT);
-	fprintf(fp,"%s%s%s",KC_PLIST_PRE_ARGUMENT,state->temp_key,KC_PLIST_POST_ARGUMENT);
+	fprintf(fp,"%s%s%s",KC_PLIST_PRE_ARGUMENT,sensors,KC_PLIST_POST_ARGUMENT);
+
+	for (i = 0; i < KC_MAX_FANS; i++) {
+		if (state->fan[i].curve_spec != NULL) {
+			fprintf(fp,"%s-F%s",KC_PLIST_PRE_ARGUMENT,KC_PLIST_POST_ARGUMENT);
+			fprintf(fp,"%s%s%s",KC_PLIST_PRE_ARGUMENT,state->fan[i].curve_spec,KC_PLIST_POST_ARGUMENT);
+		}
+		if (state->fan[i].curve.count != 0) {
+			fprintf(fp,"%s-u%s",KC_PLIST_PRE_ARGUMENT,KC_PLIST_POST_ARGUMENT);
+			fprintf(fp,"%s%s%s",KC_PLIST_PRE_ARGUMENT,state->fan[i].curve.spec,KC_PLIST_POST_ARGUMENT);
+		}
+	}
+
+	if (state->curve.count != 0) {
+		fprintf(fp,"%s-u%s",KC_PLIST_PRE_ARGUMENT,KC_PLIST_POST_ARGUMENT);
+		fprintf(fp,"%s%s%s",KC_PLIST_PRE_ARGUMENT,state->curve.spec,KC_PLIST_POST_ARGUMENT);
+	}
+
+	if (state->sensor_policy != KC_SENSOR_MAX) {
+		fprintf(fp,"%s-A%s",KC_PLIST_PRE_ARGUMENT,KC_PLIST_POST_ARGUMENT);
+		fprintf(fp,"%smean%s",KC_PLIST_PRE_ARGUMENT,KC_PLIST_POST_ARGUMENT);
+	}
 
 	if (state->min_temp != KC_DEF_MIN_TEMP) {
 		fprintf(fp,"%s-m%s",KC_PLIST_PRE_ARGUMENT,KC_PLIST_POST_ARGUMENT);
@@ -1046,6 +5111,69 @@ kern_return_t KCDumpOptions(FILE *fp, KC_Status_t *state) {
 		fprintf(fp,"%s%d%s",KC_PLIST_PRE_ARGUMENT,state->max_temp,KC_PLIST_POST_ARGUMENT);
 	}
 
+	if (state->sched.min_interval != KC_POLL_MIN_INTERVAL || state->sched.max_interval != KC_POLL_MAX_INTERVAL) {
+		fprintf(fp,"%s-p%s",KC_PLIST_PRE_ARGUMENT,KC_PLIST_POST_ARGUMENT);
+		fprintf(fp,"%s%u:%u%s",KC_PLIST_PRE_ARGUMENT,state->sched.min_interval,state->sched.max_interval,KC_PLIST_POST_ARGUMENT);
+	}
+
+	if (state->deadband != KC_FAN_DEADBAND || state->hysteresis != KC_FAN_HYSTERESIS) {
+		fprintf(fp,"%s-D%s",KC_PLIST_PRE_ARGUMENT,KC_PLIST_POST_ARGUMENT);
+		fprintf(fp,"%s%u:%u%s",KC_PLIST_PRE_ARGUMENT,state->deadband,state->hysteresis,KC_PLIST_POST_ARGUMENT);
+	}
+
+	if (state->pid.target != KC_PID_TARGET || state->pid.kp != KC_PID_KP || state->pid.ki != KC_PID_KI ||
+	    state->pid.kd != KC_PID_KD || state->pid.tau != KC_PID_TAU) {
+		fprintf(fp,"%s-P%s",KC_PLIST_PRE_ARGUMENT,KC_PLIST_POST_ARGUMENT);
+		fprintf(fp,"%s%g:%g:%g:%g:%g%s",KC_PLIST_PRE_ARGUMENT,state->pid.target,state->pid.kp,
+		        state->pid.ki,state->pid.kd,state->pid.tau,KC_PLIST_POST_ARGUMENT);
+	}
+
+	if (state->filter.mode != KC_FILTER_NONE || state->filter.window != KC_FILTER_DEF_WINDOW ||
+	    state->filter.alpha != KC_FILTER_DEF_ALPHA) {
+		static const char *modes[] = {"none", "ema", "median", "both"};
+
+		fprintf(fp,"%s-S%s",KC_PLIST_PRE_ARGUMENT,KC_PLIST_POST_ARGUMENT);
+		fprintf(fp,"%s%s",KC_PLIST_PRE_ARGUMENT,modes[state->filter.mode]);
+		if (state->filter.mode & KC_FILTER_MEDIAN)
+			fprintf(fp,":%u",state->filter.window);
+		if (state->filter.mode & KC_FILTER_EMA)
+			fprintf(fp,":%g",state->filter.alpha);
+		fprintf(fp,"%s",KC_PLIST_POST_ARGUMENT);
+	}
+
+	if (state->load.gain != KC_LOAD_GAIN) {
+		fprintf(fp,"%s-U%s",KC_PLIST_PRE_ARGUMENT,KC_PLIST_POST_ARGUMENT);
+		fprintf(fp,"%s%g",KC_PLIST_PRE_ARGUMENT,state->load.gain);
+		if (state->load.source != NULL)
+			fprintf(fp,":%s",state->load.source->name);
+		fprintf(fp,"%s",KC_PLIST_POST_ARGUMENT);
+	}
+
+	if (state->key_index_file == NULL || strcmp(state->key_index_file, KC_KEY_INDEX_FILE) != 0) {
+		fprintf(fp,"%s-I%s",KC_PLIST_PRE_ARGUMENT,KC_PLIST_POST_ARGUMENT);
+		fprintf(fp,"%s%s%s",KC_PLIST_PRE_ARGUMENT,state->key_index_file ? state->key_index_file : "none",KC_PLIST_POST_ARGUMENT);
+	}
+
+	if (state->control_socket == NULL || strcmp(state->control_socket, KC_CONTROL_SOCKET) != 0) {
+		fprintf(fp,"%s-C%s",KC_PLIST_PRE_ARGUMENT,KC_PLIST_POST_ARGUMENT);
+		fprintf(fp,"%s%s%s",KC_PLIST_PRE_ARGUMENT,state->control_socket ? state->control_socket : "none",KC_PLIST_POST_ARGUMENT);
+	}
+
+	if (state->config_file != NULL) {
+		fprintf(fp,"%s-k%s",KC_PLIST_PRE_ARGUMENT,KC_PLIST_POST_ARGUMENT);
+		fprintf(fp,"%s%s%s",KC_PLIST_PRE_ARGUMENT,state->config_file,KC_PLIST_POST_ARGUMENT);
+	}
+
+	if (g_smcPool.size != 0) {
+		fprintf(fp,"%s-j%s",KC_PLIST_PRE_ARGUMENT,KC_PLIST_POST_ARGUMENT);
+		fprintf(fp,"%s%d%s",KC_PLIST_PRE_ARGUMENT,g_smcPool.size,KC_PLIST_POST_ARGUMENT);
+	}
+
+	if (state->trace_file != NULL) {
+		fprintf(fp,"%s-o%s",KC_PLIST_PRE_ARGUMENT,KC_PLIST_POST_ARGUMENT);
+		fprintf(fp,"%s%s:%u%s",KC_PLIST_PRE_ARGUMENT,state->trace_file,state->trace_size,KC_PLIST_POST_ARGUMENT);
+	}
+
 	if (state->compute_fan_speed == &KCQuadraticSpeedAlghoritm) {
 		fprintf(fp,"%s-a%s",KC_PLIST_PRE_ARGUMENT,KC_PLIST_POST_ARGUMENT);
 		fprintf(fp,"%sq%s",KC_PLIST_PRE_ARGUMENT,KC_PLIST_POST_ARGUMENT);
@@ -1064,15 +5192,46 @@ kern_return_t KCDumpOptions(FILE *fp, KC_Status_t *state) {
 	} else if (state->compute_fan_speed == &KCWaveSpeedAlghoritm) {
                 fprintf(fp,"%s-a%s",KC_PLIST_PRE_ARGUMENT,KC_PLIST_POST_ARGUMENT);
                 fprintf(fp,"%sw%s",KC_PLIST_PRE_ARGUMENT,KC_PLIST_POST_ARGUMENT);
+	} else if (state->compute_fan_speed == &KCPIDSpeedAlghoritm) {
+                fprintf(fp,"%s-a%s",KC_PLIST_PRE_ARGUMENT,KC_PLIST_POST_ARGUMENT);
+                fprintf(fp,"%sp%s",KC_PLIST_PRE_ARGUMENT,KC_PLIST_POST_ARGUMENT);
+	} else if (state->compute_fan_speed == &KCCurveSpeedAlghoritm) {
+                fprintf(fp,"%s-a%s",KC_PLIST_PRE_ARGUMENT,KC_PLIST_POST_ARGUMENT);
+                fprintf(fp,"%su%s",KC_PLIST_PRE_ARGUMENT,KC_PLIST_POST_ARGUMENT);
         }
 	return retVal;
 }
 
-void KCSysLog(int level, char *msg) {
-    setlogmask (LOG_UPTO (LOG_NOTICE));
-    openlog ("keep-cool", LOG_CONS | LOG_PID | LOG_NDELAY, LOG_DAEMON);
-    syslog (level, "%s", msg);
-    closelog();
+// Parses the "<deadband>[:<hysteresis>]" rpm values
+kern_return_t KCParseDeadband(char *arg, KC_Status_t *state) {
+    char *end;
+    long deadband, hysteresis;
+
+    deadband = strtol(arg, &end, 10);
+    hysteresis = state->hysteresis;
+    if (*end == ':')
+        hysteresis = strtol(end + 1, &end, 10);
+    if (*end != '\0' || deadband < 0 || hysteresis < 0 || deadband + hysteresis > KC_FAN_MIN_SPEED)
+        return kIOReturnBadArgument;
+    state->deadband = (UInt32)deadband;
+    state->hysteresis = (UInt32)hysteresis;
+    return kIOReturnSuccess;
+}
+
+// Parses the "<min>[:<max>]" polling interval bounds
+kern_return_t KCParsePollBounds(char *arg, KC_Status_t *state) {
+    char *end;
+    long min, max;
+
+    min = strtol(arg, &end, 10);
+    max = min;
+    if (*end == ':')
+        max = strtol(end + 1, &end, 10);
+    if (*end != '\0' || min < 10 || max < min || max > 60000)
+        return kIOReturnBadArgument;
+    state->sched.min_interval = (UInt32)min;
+    state->sched.max_interval = (UInt32)max;
+    return kIOReturnSuccess;
 }
 
 kern_return_t KCWritePlistFile(KC_Status_t *state) {
@@ -1091,14 +5250,22 @@ kern_return_t KCWritePlistFile(KC_Status_t *state) {
     return retVal;
 }
 
+#ifndef KC_NO_MAIN
 int main(int argc, char *argv[])
 {
-    int c, errors_count = 0;
+    int c, i;
     char	  msg[KC_LOG_BUFSIZE];
+    UInt64        startup_start, startup_time;
+    int           warm_start;
     extern char   *optarg;
     
     kern_return_t result;
     int           op = OP_NONE;
+    char          *replay_file = NULL;
+    char          *control_command = NULL;
+    KC_Watch_t    watch;
+    KC_ShmStatus_t shm_status;
+    int           sensors_given = 0;
 
     KC_Status_t kc_state = { "?", 
        			     KC_DEF_MIN_TEMP, 
@@ -1116,16 +5283,77 @@ int main(int argc, char *argv[])
 			     (char)0,
 			     &KCQuadraticSpeedAlghoritm};
 
-    while ((c = getopt(argc, argv, "a:Lls:nrfvdtT:m:M:g")) != -1)
+    kc_state.key_index_file = KC_KEY_INDEX_FILE;
+    kc_state.sensor_policy = KC_SENSOR_MAX;
+    kc_state.filter.mode = KC_FILTER_NONE;
+    kc_state.filter.window = KC_FILTER_DEF_WINDOW;
+    kc_state.filter.alpha = KC_FILTER_DEF_ALPHA;
+    kc_state.load.gain = KC_LOAD_GAIN;
+#ifdef __APPLE__
+    kc_state.load.source = &g_kcHostStatsLoad;
+#else
+    kc_state.load.source = &g_kcProcStatLoad;
+#endif
+    kc_state.pid.target = KC_PID_TARGET;
+    kc_state.pid.kp = KC_PID_KP;
+    kc_state.pid.ki = KC_PID_KI;
+    kc_state.pid.kd = KC_PID_KD;
+    kc_state.pid.tau = KC_PID_TAU;
+    kc_state.deadband = KC_FAN_DEADBAND;
+    kc_state.hysteresis = KC_FAN_HYSTERESIS;
+    kc_state.sched.min_interval = KC_POLL_MIN_INTERVAL;
+    kc_state.sched.max_interval = KC_POLL_MAX_INTERVAL;
+    kc_state.control_socket = KC_CONTROL_SOCKET;
+
+    while ((c = getopt(argc, argv, "a:A:B:c:C:D:F:I:j:k:Llo:p:P:R:s:S:nrfvdtT:m:M:gu:U:w:")) != -1)
     {
         switch(c)
         {
 	    case 'a':
 	    	KCSelectAlgothitm(optarg[0], &kc_state);
 		break;
+            case 'B':
+                if (SMCSelectTransport(optarg) != kIOReturnSuccess) {
+                    printf("Error: unknown or malformed SMC backend \"%s\"\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'c':
+                op = OP_CONTROL;
+                control_command = optarg;
+                break;
+            case 'C':
+                kc_state.control_socket = strcmp(optarg, "none") == 0 ? NULL : optarg;
+                break;
+            case 'D':
+                if (KCParseDeadband(optarg, &kc_state) != kIOReturnSuccess) {
+                    printf("Error: inconsistent value for deadband parameter\n");
+                    return 1;
+                }
+                break;
+            case 'I':
+                kc_state.key_index_file = strcmp(optarg, "none") == 0 ? NULL : optarg;
+                break;
+            case 'j':
+                if (atoi(optarg) < 1) {
+                    printf("Error: inconsistent value for SMC connections parameter\n");
+                    return 1;
+                }
+                SMCPoolSetSize(atoi(optarg));
+                break;
+            case 'k':
+                kc_state.config_file = optarg;
+                break;
             case 'L':
                 op = OP_LIST;
                 break;
+            case 'w':
+                if (KCParseWatch(optarg, &watch) != kIOReturnSuccess) {
+                    printf("Error: inconsistent value for watch parameter\n");
+                    return 1;
+                }
+                op = OP_WATCH;
+                break;
             case 'l':
                 op = OP_READ_FAN;
                 break;
@@ -1135,6 +5363,22 @@ int main(int argc, char *argv[])
             case 'g':
 	        op = OP_GENERATE_PLIST;
 		break;
+            case 'R':
+                op = OP_REPLAY;
+                replay_file = optarg;
+                break;
+            case 'o':
+                if (KCParseTrace(optarg, &kc_state) != kIOReturnSuccess) {
+                    printf("Error: inconsistent value for trace file parameter\n");
+                    return 1;
+                }
+                break;
+            case 'p':
+                if (KCParsePollBounds(optarg, &kc_state) != kIOReturnSuccess) {
+                    printf("Error: inconsistent value for polling interval parameter\n");
+                    return 1;
+                }
+                break;
             case 's':
 	    	op = OP_SIMULATE;
                 kc_state.cur_temp = strtod(optarg, NULL);
@@ -1157,8 +5401,51 @@ int main(int argc, char *argv[])
                 kc_state.debug = (char)1;
                 break;
             case 'T': 
-                strncpy(kc_state.temp_key, optarg, sizeof(kc_state.temp_key));   //fix for buffer overflow
-                kc_state.temp_key[sizeof(kc_state.temp_key) - 1] = '\0';
+                if (KCParseSensors(optarg, &kc_state) != kIOReturnSuccess) {
+                    printf("Error: inconsistent value for temperature sensors parameter\n");
+                    return 1;
+                }
+                sensors_given = 1;
+                break;
+            case 'S':
+                if (KCParseFilter(optarg, &kc_state) != kIOReturnSuccess) {
+                    printf("Error: inconsistent value for temperature filter parameter\n");
+                    return 1;
+                }
+                break;
+            case 'u':
+                if (KCParseUserCurve(optarg, &kc_state) != kIOReturnSuccess) {
+                    printf("Error: inconsistent value for user curve parameter\n");
+                    return 1;
+                }
+                break;
+            case 'U':
+                if (KCParseLoad(optarg, &kc_state) != kIOReturnSuccess) {
+                    printf("Error: inconsistent value for load feed-forward parameter\n");
+                    return 1;
+                }
+                break;
+            case 'P':
+                if (KCParsePID(optarg, &kc_state) != kIOReturnSuccess) {
+                    printf("Error: inconsistent value for PID parameter\n");
+                    return 1;
+                }
+                break;
+            case 'F':
+                if (KCParseFanCurve(optarg, &kc_state) != kIOReturnSuccess) {
+                    printf("Error: inconsistent value for fan curve parameter\n");
+                    return 1;
+                }
+                break;
+            case 'A':
+                if (strcmp(optarg, "max") == 0)
+                    kc_state.sensor_policy = KC_SENSOR_MAX;
+                else if (strcmp(optarg, "mean") == 0)
+                    kc_state.sensor_policy = KC_SENSOR_MEAN;
+                else {
+                    printf("Error: unknown sensors aggregation policy %s\n", optarg);
+                    return 1;
+                }
                 break;
             case 'm': 
                 kc_state.min_temp = strtol(optarg, NULL, 10);
@@ -1166,6 +5453,7 @@ int main(int argc, char *argv[])
                     printf("Error: inconsistent value for minimum temperature parameter\n");
 		    return 1;
 		}
+		KCInvalidateSpeedTable(&kc_state);
                 break;
             case 'M': 
                 kc_state.max_temp = strtol(optarg, NULL, 10);
@@ -1173,6 +5461,7 @@ int main(int argc, char *argv[])
                     printf("Error: inconsistent value for Maximum temperature parameter\n");
 		    return 1;
 		}
+		KCInvalidateSpeedTable(&kc_state);
                 break;
             
             default:
@@ -1186,9 +5475,33 @@ int main(int argc, char *argv[])
         usage(argv[0]);
         return 1;
     }
+
+    if (KCResolveFanCurves(&kc_state, msg, sizeof(msg)) != kIOReturnSuccess) {
+        printf("Error: %s\n", msg);
+        return 1;
+    }
+    if (op == OP_REPLAY)
+        return KCReplay(&kc_state, replay_file) == kIOReturnSuccess ? 0 : 1;
+    if (op == OP_CONTROL)
+        return KCControlSend(kc_state.control_socket, control_command) == kIOReturnSuccess ? 0 : 1;
+
+    // while the daemon runs -l, and -t for its sensors, don't touch the SMC
+    if ((op == OP_READ_FAN || (op == OP_READ_TEMP && !sensors_given)) &&
+        KCShmRead(&shm_status) == kIOReturnSuccess) {
+        if (kc_state.debug)
+            printf("Reading the status published by the daemon\n");
+        if (op == OP_READ_FAN)
+            KCShmPrintFans(&shm_status);
+        else
+            KCShmPrintTemperature(&shm_status);
+        return 0;
+    }
     
+    startup_start = _uptime_us();
     smc_init();
-    if (kc_state.temp_key[0] == '?') {
+    warm_start = (KCLoadKeyIndex(&kc_state) == kIOReturnSuccess);
+    // the watch mode reads its own keys, no need to guess the CPU sensor
+    if (kc_state.temp_key[0] == '?' && op != OP_WATCH) {
         result = KCFindCPUSensor(&kc_state);
         if (result != kIOReturnSuccess) {
              sprintf(msg,"Error: KCFindCPUSensor() = %08x\n", result);
@@ -1197,6 +5510,11 @@ int main(int argc, char *argv[])
              return 1;
 	}
     }
+    KCResolveSensors(&kc_state);
+    startup_time = _uptime_us() - startup_start;
+    if (kc_state.debug)
+        printf("Startup: %s start in %llu us, %u SMC calls\n", warm_start ? "warm" : "cold",
+               (unsigned long long)startup_time, SMCCallCount());
 
     switch(op)
     {
@@ -1206,6 +5524,12 @@ int main(int argc, char *argv[])
                 printf("Error: SMCPrintAll() = %08x\n", result);
             break;
 
+        case OP_WATCH:
+            result = KCWatch(&kc_state, &watch);
+            if (result != kIOReturnSuccess)
+                printf("Error: KCWatch() = %08x\n", result);
+            break;
+
         case OP_READ_FAN:
             result = SMCPrintFans();
             if (result != kIOReturnSuccess)
@@ -1213,11 +5537,13 @@ int main(int argc, char *argv[])
             break;
 
         case OP_READ_TEMP:
-	    kc_state.cur_temp = SMCGetTemperature(kc_state.temp_key);
+	    KCReadTemperature(&kc_state);
 	    if (kc_state.cur_temp == 0.0 )
                     printf("Error: SMCGetTemperature() can't read value\n");
-            else
+            else if (kc_state.num_sensors == 1)
 		    printf("SMC Sensor %s: Temperature = %.2fºC\n",kc_state.temp_key,kc_state.cur_temp);
+            else
+		    KCPrintSensors(&kc_state);
 	    break;
 	
 	case OP_GENERATE_PLIST:
@@ -1229,15 +5555,19 @@ int main(int argc, char *argv[])
 	    break;
 
         case OP_RUNONCE:
-	    kc_state.cur_temp = SMCGetTemperature(kc_state.temp_key);
+	    KCReadTemperature(&kc_state);
 	    if (kc_state.cur_temp == 0.0 ) {
                     printf("Error: SMCGetTemperature() can't read value from sensor %s\n",kc_state.temp_key);
 		    break;
             }
 
         case OP_SIMULATE:
+	    // every sensor reads the simulated temperature
+	    for (i = 0; i < kc_state.num_sensors; i++)
+	        kc_state.sensors[i].raw = kc_state.sensors[i].temp = kc_state.cur_temp;
+	    KCUpdateFanTemperatures(&kc_state);
 	    if (kc_state.debug)
-	    	printf("Sensor %s, current temperature: %.2fºC\n",kc_state.temp_key, kc_state.cur_temp);
+	    	KCPrintSensors(&kc_state);
 
 	    result = SMCCountFans(&kc_state);
             if (result != kIOReturnSuccess)
@@ -1248,7 +5578,7 @@ int main(int argc, char *argv[])
                 printf("Error: SMCUpdateFans() = %08x\n", result);
 
 	    if (kc_state.debug)
-	    	printf("Computed new fan speed: %d\n", (*kc_state.compute_fan_speed)((void *)&kc_state));
+	    	KCPrintFanSpeeds(&kc_state);
 
             if (!(kc_state.dry_run)) {
 		    result = SMCSetFanSpeed(&kc_state);
@@ -1259,74 +5589,48 @@ int main(int argc, char *argv[])
 
         case OP_RUNFOREVER:
 	    gbl_state = &kc_state;
+	    if (KCSignalPipeOpen() != kIOReturnSuccess) {
+	        KCSysLog(LOG_CRIT, "Can't create the signal pipe");
+	        return 1;
+	    }
             KCRegisterSignalHandler();
+	    if (KCLogStart() != kIOReturnSuccess)
+	        KCSysLog(LOG_WARNING, "Can't start the log thread, logging synchronously");
+	    if (KCConfigOpen(&kc_state) != kIOReturnSuccess) {
+	        printf("Error: can't load the configuration file %s\n", kc_state.config_file);
+	        KCLogStop();
+	        return 1;
+	    }
 
-	    sprintf(msg, "Keep-Cool (Version %s) Started.",VERSION);  
+	    sprintf(msg, "Keep-Cool (Version %s) Started (%s start in %.1f ms).",VERSION,
+	            warm_start ? "warm" : "cold", startup_time / 1000.0);  
 	    KCSysLog(LOG_NOTICE, msg);
 
+	    // before the tick keys are built, so that they include the actual speeds
+	    if (KCShmOpen(&kc_state) != kIOReturnSuccess)
+	        KCSysLog(LOG_WARNING, "Can't create the status segment " KC_SHM_NAME ", clients will read the SMC");
 	    SMCCountFans(&kc_state);
-	    while (OP_RUNFOREVER) {
-	        kc_state.cur_temp = SMCGetTemperature(kc_state.temp_key);
-	        if (kc_state.cur_temp == KC_ERROR_READING_TEMP) {
-                    sprintf(msg,"Error: SMCGetTemperature() can't read value");
-		    KCSysLog(LOG_WARNING, msg);
-		    errors_count++;
-	            usleep(KC_UPDATE_DELAY*4);
-		    if (errors_count >= KC_ABORT_TRESHOLD) {
-		        sprintf(msg, "Too many SMC I/O errors (%d).. aborting.", errors_count);
-		        KCSysLog(LOG_CRIT, msg);
-		    	KCSigHandler(SIGABRT);
-		    } else {	
-		    	continue;
-                    }
-                } else if (kc_state.cur_temp > KC_WAKEUP_IGNORE_TEMP) {
-	            if (kc_state.debug)
-	    	        printf("Ignoring Temperature reading from sensor %s (too high)\n..just awaken from stand-by?.\n",kc_state.temp_key);
-		    errors_count++;
-	            usleep(KC_UPDATE_DELAY*2);
-		    if (errors_count >= KC_ABORT_TRESHOLD) {
-		        sprintf(msg, "Too many SMC I/O errors (%d).. aborting.", errors_count);
-		        KCSysLog(LOG_CRIT, msg);
-		    	KCSigHandler(SIGABRT);
-		    } else {	
-		    	continue;
-                    }
-		}
-
-	        if (kc_state.debug)
-	    	    printf("\nSensor %s, current temperature: %.2fºC\n",kc_state.temp_key, kc_state.cur_temp);
-
-	        result = SMCUpdateFans(&kc_state);
-                if (result != kIOReturnSuccess) {
-		    errors_count++;
-                    sprintf(msg, "Error: SMCUpdateFans() = %08x\n", result);
-		    KCSysLog(LOG_WARNING, msg);
-		}
-
-	        if (kc_state.debug)
-	    	    printf("Computed new fan speed: %d\n", (*kc_state.compute_fan_speed)((void *)&kc_state));
-
-                if (!(kc_state.dry_run)) {
-		    result = SMCSetFanSpeed(&kc_state);
-                    if (result != kIOReturnSuccess) {
-                        sprintf(msg, "Error: SMCSetFanSpeed() = %08x\n", result);
-		        KCSysLog(LOG_WARNING, msg);
-			errors_count++;
-                    } else {
-		        errors_count = 0;
-                    }
-	        }
-
-		if (errors_count >= KC_ABORT_TRESHOLD) {
-		    KCSysLog(LOG_CRIT, "Too many SMC I/O errors.. aborting.");
-		    KCSigHandler(SIGQUIT);
-	        }
-
-	        usleep(KC_UPDATE_DELAY);
-            }
+	    if (kc_state.load.source != NULL && kc_state.load.source->open() != kIOReturnSuccess) {
+	        KCSysLog(LOG_WARNING, "Can't read the CPU load, feed-forward disabled");
+	        kc_state.load.source = NULL;
+	    }
+	    if (KCTraceOpen(&kc_state) != kIOReturnSuccess) {
+	        sprintf(msg, "Can't write the trace file %s, tracing disabled", kc_state.trace_file);
+	        KCSysLog(LOG_WARNING, msg);
+	    }
+	    if (KCControlOpen(&kc_state) != kIOReturnSuccess) {
+	        sprintf(msg, "Can't listen on the control socket %s, runtime control disabled", kc_state.control_socket);
+	        KCSysLog(LOG_WARNING, msg);
+	    }
+	    KCSchedulerInit(&kc_state);
+	    KCTickEngineInit(&kc_state.tick);
+	    KCEventLoop(&kc_state);
             break;
     }
     
+    if (kc_state.debug)
+        SMCDumpCallStats(stdout);
     smc_close();
     return 0;
 }
+#endif
@@ -23,6 +23,32 @@
 #define __SMC_H__
 #endif
 
+#ifdef __APPLE__
+#include <IOKit/IOKitLib.h>
+#else
+/*
+ * Minimal IOKit compatibility definitions: on non OSX hosts keep-cool is
+ * built against the simulated SMC backend only (see smc-sim.c).
+ */
+#include <stdint.h>
+#include <arpa/inet.h>
+
+typedef uint8_t               UInt8;
+typedef uint16_t              UInt16;
+typedef uint32_t              UInt32;
+typedef uint64_t              UInt64;
+typedef int8_t                SInt8;
+typedef int16_t               SInt16;
+typedef int32_t               SInt32;
+typedef int                   kern_return_t;
+typedef unsigned int          io_connect_t;
+
+#define kIOReturnSuccess      0
+#define kIOReturnError        ((kern_return_t)0xe00002bc)
+#define kIOReturnBadArgument  ((kern_return_t)0xe00002c2)
+#define kIOReturnNotFound     ((kern_return_t)0xe00002f0)
+#endif
+
 #define VERSION               "1.0.1"
 
 #define OP_NONE               0
@@ -33,6 +59,9 @@
 #define OP_RUNONCE            5
 #define OP_RUNFOREVER         6
 #define OP_GENERATE_PLIST     7
+#define OP_REPLAY             8
+#define OP_WATCH              9
+#define OP_CONTROL            10
 
 #define KERNEL_INDEX_SMC      2
 
@@ -42,6 +71,14 @@
 #define SMC_CMD_READ_KEYINFO  9
 #define SMC_CMD_READ_PLIMIT   11
 #define SMC_CMD_READ_VERS     12
+#define SMC_CMD_MAX           16
+
+#define SMC_RESULT_SUCCESS    0
+#define SMC_RESULT_NOT_FOUND  132
+
+#define SMC_POOL_MAX          8       /* SMC connections enumerating the keys */
+#define SMC_POOL_DEF          4
+#define SMC_POOL_CHUNK        16      /* key indexes a worker takes at a time */
 
 #define DATATYPE_FP1F         "fp1f"
 #define DATATYPE_FP4C         "fp4c"
@@ -72,20 +109,105 @@
 #define DATATYPE_SI16         "si16"
 
 #define DATATYPE_PWM          "{pwm"
+#define DATATYPE_FLT          "flt "
+
+/* A data type packed the way the SMC reports it */
+#define SMC_TYPE(a,b,c,d)     (((UInt32)(a) << 24) | ((UInt32)(b) << 16) | ((UInt32)(c) << 8) | (UInt32)(d))
 
 #define KC_UPDATE_DELAY         500000  /* 1000000 ms = 1 second */
 #define KC_MAX_FANS   		5
+#define KC_MAX_SENSORS		8
+#define KC_TICK_KEYS		(KC_MAX_SENSORS + 2*KC_MAX_FANS)
+#define KC_SENSOR_MAX		'x'
+#define KC_SENSOR_MEAN		'w'
 #define KC_SMC_DEF_SPEED     	0
+#define KC_CURVE_MAX_POINTS	16
+#define KC_CURVE_LINEAR		0
+#define KC_CURVE_CUBIC		1	/* monotone cubic (Fritsch-Carlson) */
 #define KC_FAN_MIN_SPEED     	2000
+#define KC_FAN_DEADBAND		100	/* rpm */
+#define KC_FAN_HYSTERESIS	50	/* rpm */
 #define KC_ABS_MIN_TEMP		30
 #define KC_ABS_MAX_TEMP		120
 #define KC_DEF_MIN_TEMP	 	60
 #define KC_DEF_MAX_TEMP	 	92
 #define KC_ERROR_READING_TEMP   0.0
+#define KC_TEMP_SCALE		64	/* sp78 codes per ºC, the 2 low bits are dropped */
 #define KC_WAKEUP_IGNORE_TEMP   120.0
 #define KC_ABORT_TRESHOLD	20
 
+#define KC_PID_TARGET		70.0	/* ºC */
+#define KC_PID_KP		400.0	/* rpm/ºC */
+#define KC_PID_KI		10.0	/* rpm/(ºC s) */
+#define KC_PID_KD		400.0	/* rpm s/ºC */
+#define KC_PID_TAU		5.0	/* s, time constant of the derivative filter */
+#define KC_PID_MIN_DT		10000	/* us, samples closer than this are the same sample */
+#define KC_PID_MAX_DT		30000000 /* us, longer pauses restart the controller */
+
+#define KC_FILTER_NONE		0
+#define KC_FILTER_EMA		1
+#define KC_FILTER_MEDIAN	2
+#define KC_FILTER_BOTH		(KC_FILTER_EMA | KC_FILTER_MEDIAN)
+#define KC_FILTER_MAX_WINDOW	9	/* samples */
+#define KC_FILTER_DEF_WINDOW	3	/* samples */
+#define KC_FILTER_DEF_ALPHA	0.5
+
+#define KC_LOAD_GAIN		0.0	/* ºC of lead for a full load step, off unless -U */
+#define KC_LOAD_HINT_GAIN	8.0	/* the gain suggested by the usage */
+#define KC_LOAD_FAST_TAU	2.0	/* s, time constant of the load average */
+#define KC_LOAD_SLOW_TAU	60.0	/* s, time constant of the baseline load */
+
+#define KC_POLL_MIN_INTERVAL	100	/* ms */
+#define KC_POLL_MAX_INTERVAL	4000	/* ms */
+#define KC_POLL_ACTIVE_INTERVAL	1000	/* ms, longest interval while fans are throttled */
+#define KC_POLL_TEMP_STEP	0.5	/* ºC we accept the temperature to move between two polls */
+#define KC_POLL_FLAT_RATE	0.05	/* ºC/s under which the temperature is flat */
+#define KC_POLL_NEAR_TEMP	2.0	/* ºC under min_temp still polled as if throttling */
+
 #define KC_LOG_BUFSIZE		512
+#define KC_LOG_QUEUE		64		/* messages waiting for syslog */
+#define KC_LOG_REPEAT_FLUSH	30		/* s, a pending repeat count is logged after */
+#define KC_LOG_GENERAL		0		/* message classes, each one rate limited */
+#define KC_LOG_SENSOR		1
+#define KC_LOG_SMC		2
+#define KC_LOG_CLASSES		3
+#ifdef __APPLE__
+#define KC_KEY_INDEX_FILE	"/var/db/m.c.m.keepcool.keys"
+#else
+#define KC_KEY_INDEX_FILE	"/var/tmp/m.c.m.keepcool.keys"
+#endif
+#define KC_KEY_INDEX_MAGIC	0x4b434b49	/* "KCKI" */
+#define KC_KEY_INDEX_VERSION	1
+#define KC_TRACE_MAGIC		0x4b435452	/* "KCTR" */
+#define KC_TRACE_VERSION	1
+#define KC_TRACE_RING		256		/* records, a power of 2 */
+#define KC_TRACE_DEF_SIZE	4096		/* KiB */
+#define KC_TRACE_MIN_SIZE	64		/* KiB */
+#define KC_TRACE_FLUSH		1		/* s */
+#define KC_TRACE_NO_TEMP	0x01		/* the sensors couldn't be read */
+#define KC_TRACE_IGNORED	0x02		/* too high a reading, fans left alone */
+#define KC_TRACE_SMC_ERROR	0x04		/* an SMC read or write failed */
+#define KC_REPLAY_MAX_SPEED	6200		/* rpm, a fan when the trace doesn't tell */
+#define KC_REPLAY_BUCKET	1000		/* rpm, width of the speed histogram bars */
+#define KC_REPLAY_BUCKETS	7
+#define KC_REPLAY_MAX_GAP	10		/* s, longer gaps weren't polled */
+#define KC_CONTROL_SOCKET	"/var/run/m.c.m.keepcool.sock"
+#define KC_CONTROL_MAX_CLIENTS	4
+#define KC_CONTROL_LINE		256		/* bytes, longest command */
+#define KC_CONFIG_MAX_SIZE	65536		/* bytes */
+#define KC_CONFIG_SETTLE	200		/* ms, from a change of the file to its reload */
+#define KC_SHM_NAME		"/m.c.m.keepcool"
+#define KC_SHM_MAGIC		0x4b435348	/* "KCSH" */
+#define KC_SHM_VERSION		1
+#define KC_SHM_RETRIES		1000		/* reads overlapping a publish, before giving up */
+#define KC_WATCH_MAX_KEYS	32
+#define KC_WATCH_DEF_INTERVAL	1000		/* ms */
+#define KC_WATCH_DEF_FLUSH	1000		/* ms, records wait at most this long */
+#define KC_WATCH_FLUSH_LINE	0		/* flush after every record */
+#define KC_WATCH_FLUSH_FULL	-1		/* flush only when the buffer is full */
+#define KC_WATCH_BUFSIZE	65536
+#define KC_WATCH_JSON		0		/* NDJSON, one object per line */
+#define KC_WATCH_CSV		1
 #define KC_PLIST_FILENAME	"m.c.m.keepcool.plist"
 #define KC_PLIST_HEADER		"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" \"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n<plist version=\"1.0\">\n<dict>\n\t<key>Disabled</key>\n\t<false/>\n\t<key>GroupName</key>\n\t<string>wheel</string>\n\t<key>UserName</key>\n\t<string>root</string>\n\t<key>KeepAlive</key>\n\t<true/>\n\t<key>Label</key>\n\t<string>m.c.m.keepcool</string>\n\t<key>ProgramArguments</key>\n\t<array>\n\t<string>/usr/local/sbin/keep-cool</string>\n\t\t<string>-f</string>\n"
 #define KC_PLIST_PRE_ARGUMENT   "\t\t<string>"
@@ -131,18 +253,304 @@ typedef struct {
 
 typedef char              UInt32Char_t[5];
 
+typedef struct SMCDecoder SMCDecoder_t;
+
 typedef struct {
   UInt32Char_t            key;
   UInt32                  dataSize;
   UInt32Char_t            dataType;
   SMCBytes_t              bytes;
+  const SMCDecoder_t      *decoder;       /* NULL when the type isn't known */
 } SMCVal_t;
 
+// A key resolved once by SMCResolveKey2(): the input structure of its SMC
+// call is built up front, a read sends it as is and a write only changes
+// its bytes
+typedef struct {
+  UInt32Char_t            key;
+  UInt32Char_t            dataType;
+  const SMCDecoder_t      *decoder;
+  char                    resolved;       /* 0: retried on the next access */
+  SMCKeyData_t            request;
+} SMCKeyHandle_t;
+
+// How to read a value of a data type: decoded to a number, and printed
+struct SMCDecoder {
+  UInt32                  dataType;       /* packed */
+  UInt32                  dataSize;
+  double                  (*decode)(const SMCVal_t *, double);
+  double                  scale;          /* the raw value is divided by it */
+  void                    (*print)(SMCVal_t);
+};
+
+typedef struct {
+  const char              *name;
+  kern_return_t           (*open)(io_connect_t *conn);
+  kern_return_t           (*call)(int index, SMCKeyData_t *inputStructure, SMCKeyData_t *outputStructure, io_connect_t conn);
+  kern_return_t           (*close)(io_connect_t conn);
+} SMCTransport_t;
+
+typedef struct {
+  UInt32                  key;
+  UInt32                  dataType;
+  UInt8                   dataSize;
+  UInt8                   dataAttributes;
+  UInt16                  reserved;
+} KC_KeyIndexEntry_t;
+
+typedef struct {
+  UInt32                  magic;
+  UInt32                  version;
+  UInt32                  key_count;
+  SMCKeyData_vers_t       smc_vers;
+  UInt32Char_t            sensor;
+  KC_KeyIndexEntry_t      entry[];
+} KC_KeyIndexHeader_t;
+
+// One control tick, as recorded in the trace file (64 bytes).
+// Temperatures are codes (ºC * KC_TEMP_SCALE), 0 when a sensor failed.
+typedef struct {
+  UInt64                  time;           /* us since boot, when the sensors were read */
+  UInt32                  tick_us;        /* duration of the tick */
+  UInt32                  smc_us;         /* time spent reading the SMC */
+  UInt16                  smc_calls;
+  UInt8                   num_sensors;
+  UInt8                   num_fans;
+  SInt16                  temp;           /* aggregated, filtered */
+  SInt16                  lead;           /* load feed-forward */
+  SInt16                  raw[KC_MAX_SENSORS];
+  UInt16                  speed[KC_MAX_FANS]; /* computed */
+  UInt16                  actual[KC_MAX_FANS]; /* F<n>Ac */
+  UInt16                  errors;
+  UInt16                  flags;          /* KC_TRACE_*, 0: a complete tick */
+} KC_TraceRecord_t;
+
+// The trace file is a header followed by a fixed number of record slots,
+// written in a circle: record n goes in slot n % capacity.
+typedef struct {
+  UInt32                  magic;
+  UInt32                  version;
+  UInt32                  record_size;
+  UInt32                  capacity;       /* slots */
+  UInt64                  next;           /* records written so far */
+  UInt16                  max_speed[KC_MAX_FANS]; /* F<n>Mx */
+  UInt8                   reserved[40 - 2*KC_MAX_FANS];
+} KC_TraceHeader_t;
+
+typedef struct {
+  UInt32                  min_speed;      /* F<n>Mn, the speed keep-cool set */
+  UInt32                  current_speed;  /* F<n>Ac */
+  UInt32                  max_speed;      /* F<n>Mx */
+  UInt32                  speed;          /* last computed speed */
+  double                  temp;           /* ºC the fan follows */
+} KC_ShmFan_t;
+
+typedef struct {
+  UInt64                  time;           /* us since the epoch, when the sensors were read */
+  UInt64                  ticks;
+  double                  temp;           /* ºC, aggregated and filtered */
+  double                  lead;           /* ºC, load feed-forward */
+  UInt32                  min_temp;
+  UInt32                  max_temp;
+  UInt32                  errors;         /* SMC errors in a row */
+  char                    algorithm;      /* as given to -a, 'r' for the SMC default */
+  char                    dry_run;
+  UInt8                   num_fans;
+  UInt8                   num_sensors;
+  KC_ShmFan_t             fan[KC_MAX_FANS];
+  UInt32Char_t            sensor_key[KC_MAX_SENSORS];
+  double                  sensor_temp[KC_MAX_SENSORS]; /* ºC, filtered */
+} KC_ShmStatus_t;
+
+// The status segment (KC_SHM_NAME) the daemon publishes at every tick.
+// seq is odd while the status is being written: readers copy the status,
+// then check that seq didn't move meanwhile.
+typedef struct {
+  UInt32                  magic;
+  UInt32                  version;
+  UInt32                  size;           /* of the whole segment */
+  UInt32                  pid;            /* of the daemon */
+  UInt32                  seq;
+  UInt32                  reserved;
+  KC_ShmStatus_t          status;
+} KC_ShmSegment_t;
+
+typedef struct {
+  int                     fd;
+  int                     flush;          /* ms, or KC_WATCH_FLUSH_* */
+  UInt64                  last_flush;     /* us */
+  UInt64                  bytes;
+  UInt64                  flushes;
+  int                     error;          /* errno of the failed write, 0 if none */
+  size_t                  len;
+  char                    buf[KC_WATCH_BUFSIZE];
+} KC_Writer_t;
+
+typedef struct {
+  UInt32Char_t            keys[KC_WATCH_MAX_KEYS];
+  int                     count;
+  UInt32                  interval;       /* ms */
+  int                     format;         /* KC_WATCH_JSON or KC_WATCH_CSV */
+  int                     flush;          /* ms, or KC_WATCH_FLUSH_* */
+} KC_Watch_t;
+
+typedef UInt16 (*KC_SpeedAlgorithm_t)(void *);
+
+typedef struct {
+  KC_SpeedAlgorithm_t     algorithm;      /* NULL when invalid */
+  SInt32                  base;           /* temperature code of min_temp */
+  UInt32                  count;
+  UInt32                  max_speed;      /* above the table */
+  UInt16                  *speed;         /* speed for each code from base */
+} KC_SpeedTable_t;
+
+// A fan curve given by its points (-u), tabulated like the other algorithms
+typedef struct {
+  int                     mode;           /* KC_CURVE_* */
+  UInt32                  count;          /* 0: no curve */
+  double                  temp[KC_CURVE_MAX_POINTS];      /* ºC, increasing */
+  double                  rpm[KC_CURVE_MAX_POINTS];
+  double                  slope[KC_CURVE_MAX_POINTS];     /* rpm/ºC, KC_CURVE_CUBIC */
+  char                    *spec;          /* -u argument */
+} KC_UserCurve_t;
+
+typedef struct {
+  double                  target;         /* ºC */
+  double                  kp;             /* rpm/ºC */
+  double                  ki;             /* rpm/(ºC s) */
+  double                  kd;             /* rpm s/ºC */
+  double                  tau;            /* s, derivative filter */
+} KC_PIDConfig_t;
+
+typedef struct {
+  double                  integral;       /* rpm */
+  double                  derivative;     /* ºC/s, filtered */
+  double                  last_temp;
+  UInt64                  last_time;      /* us, 0 before the first sample */
+  UInt16                  output;
+} KC_PIDState_t;
+
 typedef struct {
   UInt32	min_speed;
   UInt32	current_speed;
+  SInt8		last_direction;
+  UInt32	max_speed;		/* F<n>Mx */
+  KC_SpeedAlgorithm_t compute_fan_speed;	/* NULL: the global algorithm */
+  UInt32	min_temp;		/* 0: the global one */
+  UInt32	max_temp;		/* 0: the global one */
+  char		*sensor_spec;		/* sensors driving the fan, NULL: all of them */
+  UInt32	sensor_mask;
+  char		*curve_spec;		/* -F argument */
+  double	cur_temp;
+  KC_SpeedTable_t speed_table;
+  KC_PIDState_t	pid;
+  UInt16	speed;			/* last computed speed */
+  UInt16	raw_speed;		/* the same, without the filter */
+  UInt16	raw_written;		/* the last write without the filter */
+  SInt8		raw_direction;
+  UInt32	forced_speed;		/* set through the control socket, 0: none */
+  KC_UserCurve_t curve;			/* -u <fan>=..., none: the global one */
+  SMCKeyHandle_t min_key;		/* F<n>Mn, resolved for writes */
 } KC_FanState_t;
 
+typedef struct {
+  UInt32                  min_interval;   /* ms */
+  UInt32                  max_interval;   /* ms */
+  UInt32                  interval;       /* ms, interval before the next poll */
+  double                  last_temp;
+  UInt64                  last_poll;      /* us */
+  double                  temp_rate;      /* ºC/s, smoothed */
+  UInt64                  started;        /* us */
+  UInt64                  wakeups;
+} KC_Scheduler_t;
+
+typedef struct {
+  const char              *name;
+  kern_return_t           (*open)(void);
+  kern_return_t           (*read)(UInt64 *busy, UInt64 *total);  /* cumulative cpu ticks */
+  void                    (*close)(void);
+} KC_LoadSource_t;
+
+typedef struct {
+  KC_LoadSource_t         *source;        /* NULL: no feed-forward */
+  double                  gain;           /* ºC for a full load step */
+  double                  fast;           /* cpu utilization (0-1), short average */
+  double                  slow;           /* cpu utilization (0-1), baseline */
+  double                  lead;           /* ºC added to the temperatures */
+  UInt64                  last_busy;
+  UInt64                  last_total;
+  UInt64                  last_time;      /* us */
+} KC_LoadState_t;
+
+typedef struct {
+  UInt64                  deadline;       /* us, monotonic */
+  UInt64                  started;        /* us, start of the current tick */
+  UInt64                  ticks;
+  UInt64                  overruns;
+  UInt64                  skipped;
+  UInt64                  jitter_sum;     /* us */
+  UInt64                  jitter_max;     /* us */
+  UInt64                  work_max;       /* us */
+} KC_TickEngine_t;
+
+typedef struct {
+  UInt32Char_t            key;
+  double                  weight;
+  double                  offset;         /* ºC, added to the reading */
+  double                  temp;           /* last reading, filtered */
+  double                  raw;            /* last reading */
+} KC_Sensor_t;
+
+typedef struct {
+  int                     mode;           /* KC_FILTER_* */
+  UInt32                  window;         /* median window, samples */
+  double                  alpha;          /* EMA weight of a new sample */
+  double                  ring[KC_MAX_SENSORS][KC_FILTER_MAX_WINDOW];
+  UInt32                  head[KC_MAX_SENSORS];
+  UInt32                  count[KC_MAX_SENSORS];
+  double                  ema[KC_MAX_SENSORS];
+  UInt32                  ema_count[KC_MAX_SENSORS];  /* 0: not seeded yet */
+  UInt64                  changes;        /* speed changes computed */
+  UInt64                  raw_changes;    /* speed changes without the filter */
+  UInt64                  raw_writes;     /* SMC writes without the filter */
+} KC_TempFilter_t;
+
+// The settings of a fan in a configuration (see KC_FanState_t)
+typedef struct {
+  KC_SpeedAlgorithm_t     compute_fan_speed;
+  UInt32                  min_temp;
+  UInt32                  max_temp;
+  char                    *sensor_spec;
+  UInt32                  sensor_mask;
+  char                    *curve_spec;
+  KC_UserCurve_t          curve;
+} KC_FanConfig_t;
+
+// The settings a configuration file can change, read-only once loaded: a
+// reload builds a new one and the control loop switches to it between two
+// ticks (see KCConfigReload())
+typedef struct {
+  UInt64                  generation;     /* 0: the command line */
+  KC_Sensor_t             sensors[KC_MAX_SENSORS];
+  UInt32                  num_sensors;
+  char                    sensor_policy;
+  UInt32                  min_temp;
+  UInt32                  max_temp;
+  UInt16                  (*compute_fan_speed)(void *);
+  KC_FanConfig_t          fan[KC_MAX_FANS];
+  UInt32                  min_interval;   /* ms */
+  UInt32                  max_interval;   /* ms */
+  int                     filter_mode;
+  UInt32                  filter_window;
+  double                  filter_alpha;
+  UInt32                  deadband;
+  UInt32                  hysteresis;
+  KC_PIDConfig_t          pid;
+  double                  load_gain;
+  KC_UserCurve_t          curve;
+  char                    text[];         /* the file, the specs point into it */
+} KC_Config_t;
+
 typedef struct {
   UInt32Char_t            temp_key;
   UInt32                  min_temp;
@@ -155,37 +563,194 @@ typedef struct {
   char			  debug;
   char			  dry_run;
   UInt16                  (*compute_fan_speed)(void *);
+  SMCKeyHandle_t          tick_keys[KC_TICK_KEYS];
+  UInt32                  tick_key_count;
+  char                    *key_index_file;
+  KC_Scheduler_t          sched;
+  KC_TickEngine_t         tick;
+  int                     errors_count;
+  UInt32                  deadband;
+  UInt32                  hysteresis;
+  UInt64                  writes;
+  UInt64                  writes_elided;
+  KC_SpeedTable_t         speed_table;
+  KC_Sensor_t             sensors[KC_MAX_SENSORS];
+  UInt32                  num_sensors;
+  char                    sensor_policy;
+  UInt64                  sample_time;    /* us, when the sensors were read */
+  KC_PIDConfig_t          pid;
+  KC_PIDState_t           pid_state;
+  KC_LoadState_t          load;
+  KC_TempFilter_t         filter;
+  char                    *trace_file;
+  UInt32                  trace_size;     /* KiB */
+  char                    *control_socket; /* NULL: no control socket */
+  char                    *config_file;   /* NULL: no configuration file */
+  const KC_Config_t       *config;        /* in use, NULL: the command line */
+  KC_UserCurve_t          curve;          /* -u */
 } KC_Status_t;
 
 
 UInt32 _strtoul(char *str, int size, int base);
+void _ultostr(char *str, UInt32 val);
 float _strtof(unsigned char *str, int size, int e);
+UInt64 _uptime_us(void);
+void printVal(SMCVal_t val);
+const SMCDecoder_t *SMCDecoderOf(UInt32 dataType, UInt32 dataSize);
+double SMCDecodeValue(const SMCVal_t *);
 
 void smc_init();
 void smc_close();
 kern_return_t SMCReadKey(UInt32Char_t key, SMCVal_t *val);
+kern_return_t SMCReadKeys(UInt32Char_t *keys, int count, SMCVal_t *vals);
+kern_return_t SMCResolveKey(UInt32Char_t key, UInt8 cmd, SMCKeyHandle_t *handle);
+kern_return_t SMCReadHandles(SMCKeyHandle_t *handles, int count, SMCVal_t *vals);
+kern_return_t SMCWriteHandle(SMCKeyHandle_t *handle, const SMCBytes_t bytes, UInt32 size);
 kern_return_t SMCWriteSimple(UInt32Char_t key,char *wvalue,io_connect_t conn);
 
 kern_return_t SMCOpen(io_connect_t *conn);
 kern_return_t SMCClose(io_connect_t conn);
+kern_return_t SMCGetKeyInfo(UInt32 key, SMCKeyData_keyInfo_t *keyInfo, io_connect_t conn);
+int SMCKeyInfoCacheLookup(UInt32 key, SMCKeyData_keyInfo_t *keyInfo);
+void SMCKeyInfoCacheInsert(UInt32 key, SMCKeyData_keyInfo_t *keyInfo);
+void SMCKeyInfoCacheReserve(UInt32 keys);
+void SMCKeyInfoCacheReset(void);
+UInt32 SMCReadIndexCount(void);
+kern_return_t SMCReadKeyAtIndex(UInt32 index, UInt32 *key);
+kern_return_t SMCReadKeyAtIndex2(UInt32 index, UInt32 *key, io_connect_t conn);
+void SMCPoolSetSize(int size);
+int SMCPoolSize(void);
+kern_return_t SMCScanKeys(UInt32 prefix, UInt32 mask, UInt32 *keys, SMCVal_t *vals, UInt32 count);
+kern_return_t SMCReadVersion(SMCKeyData_vers_t *vers);
+kern_return_t SMCPrintAll(void);
+kern_return_t SMCCall2(int index, SMCKeyData_t *inputStructure, SMCKeyData_t *outputStructure, io_connect_t conn);
 kern_return_t SMCReadKey2(UInt32Char_t key, SMCVal_t *val,io_connect_t conn);
+kern_return_t SMCReadKeys2(UInt32Char_t *keys, int count, SMCVal_t *vals, io_connect_t conn);
+kern_return_t SMCWriteKey2(SMCVal_t writeVal, io_connect_t conn);
+kern_return_t SMCResolveKey2(UInt32Char_t key, UInt8 cmd, SMCKeyHandle_t *handle, io_connect_t conn);
+kern_return_t SMCReadHandles2(SMCKeyHandle_t *handles, int count, SMCVal_t *vals, io_connect_t conn);
+kern_return_t SMCWriteHandle2(SMCKeyHandle_t *handle, const SMCBytes_t bytes, UInt32 size, io_connect_t conn);
+kern_return_t SMCSelectTransport(char *spec);
+UInt32 SMCCallCount(void);
+void SMCDumpCallStats(FILE *);
+
+extern SMCTransport_t *g_smcTransport;
+#ifdef __APPLE__
+extern SMCTransport_t g_smcIOKitTransport;
+#endif
+extern SMCTransport_t g_smcSimTransport;
+kern_return_t SMCSimConfigure(char *args);
 
 void KCRegisterSignalHandler();
 void KCSigHandler(int);
+void KCHandleSignal(int);
+kern_return_t KCSignalPipeOpen(void);
+void KCEventLoop(KC_Status_t *);
+kern_return_t KCControlOpen(KC_Status_t *);
+void KCControlClose(KC_Status_t *);
+void KCControlCommand(KC_Status_t *, char *, char *, size_t);
+kern_return_t KCControlSend(char *, char *);
+kern_return_t KCConfigOpen(KC_Status_t *);
+kern_return_t KCConfigReload(KC_Status_t *);
+void KCConfigCapture(KC_Status_t *, KC_Config_t *);
+void KCConfigApply(const KC_Config_t *, KC_Status_t *);
+kern_return_t KCConfigParse(char *, KC_Status_t *, KC_Config_t **);
+kern_return_t KCParseDeadband(char *, KC_Status_t *);
+kern_return_t KCParsePollBounds(char *, KC_Status_t *);
 void KCSelectAlgothitm(char, KC_Status_t *);
 void KCSwitchAlgothitm(int, KC_Status_t *);
 void KCSysLog(int, char *);
+void KCSysLogClass(int, int, char *);
+kern_return_t KCLogStart(void);
+void KCLogStop(void);
+double SMCDecodeTemperature(SMCVal_t *);
 double SMCGetTemperature(char *);
 kern_return_t KCFindCPUSensor(KC_Status_t *);
+kern_return_t KCLoadKeyIndex(KC_Status_t *);
+kern_return_t KCWriteKeyIndex(KC_Status_t *, UInt32 *, UInt32);
 kern_return_t KCWritePlistFile(KC_Status_t *);
 kern_return_t KCDumpOptions(FILE *, KC_Status_t *);
 kern_return_t SMCCountFans(KC_Status_t *);
+void SMCFanKey(UInt32Char_t, int, const char *);
+void SMCPrepareTickKeys(KC_Status_t *);
 kern_return_t SMCUpdateFans(KC_Status_t *);
+kern_return_t SMCRefreshState(KC_Status_t *);
 kern_return_t SMCSetFanSpeed(KC_Status_t *);
+void KCTickEngineInit(KC_TickEngine_t *);
+void KCTickEngineWait(KC_TickEngine_t *, char);
+void KCTickEngineStart(KC_TickEngine_t *, char);
+void KCTickEngineAdvance(KC_TickEngine_t *, UInt64);
+void KCReportTicks(KC_Status_t *);
+void KCReportWrites(KC_Status_t *);
+int KCFanNeedsWrite(KC_Status_t *, KC_FanState_t *, UInt16);
+int KCStepFanSpeed(KC_Status_t *, int, UInt16 *);
+UInt64 KCControlTick(KC_Status_t *);
+void KCSchedulerInit(KC_Status_t *);
+double KCThrottleMargin(KC_Status_t *);
+UInt32 KCScheduleNextPoll(KC_Status_t *);
+void KCReportPolling(KC_Status_t *);
+SInt32 KCTemperatureCode(double);
+kern_return_t KCBuildSpeedTable(KC_Status_t *, KC_SpeedTable_t *);
+void KCFreeSpeedTable(KC_Status_t *);
+void KCInvalidateSpeedTable(KC_Status_t *);
+kern_return_t SMCGetTemperatures(UInt32Char_t *, int, double *);
+kern_return_t KCParseSensors(char *, KC_Status_t *);
+void KCDefaultSensors(KC_Status_t *);
+void KCResolveSensors(KC_Status_t *);
+void KCFormatSensors(char *, size_t, KC_Status_t *);
+double KCAggregateTemperature(KC_Status_t *);
+kern_return_t KCReadTemperature(KC_Status_t *);
+void KCPrintSensors(KC_Status_t *);
+UInt16 KCComputeFanSpeed(KC_Status_t *);
+UInt16 KCComputeFanSpeedOf(KC_Status_t *, int);
+void KCPrintFanSpeeds(KC_Status_t *);
+KC_SpeedAlgorithm_t KCAlgorithmOf(char);
+kern_return_t KCParseFanCurve(char *, KC_Status_t *);
+kern_return_t KCParseUserCurve(char *, KC_Status_t *);
+double KCCurveEval(const KC_UserCurve_t *, double);
+kern_return_t KCResolveFanCurves(KC_Status_t *, char *, size_t);
+void KCUpdateFanTemperatures(KC_Status_t *);
+double KCAggregateSensors(KC_Status_t *, UInt32);
 UInt16 KCLinearSpeedAlghoritm(void *);
 UInt16 KCLogarithmicSpeedAlghoritm(void *);
 UInt16 KCQuadraticSpeedAlghoritm(void *);
 UInt16 KCCubicSpeedAlghoritm(void *);
 UInt16 KCInverseCubicSpeedAlghoritm(void *);
 UInt16 KCWaveSpeedAlghoritm(void *);
+UInt16 KCCurveSpeedAlghoritm(void *);
 UInt16 KCResetSpeedAlghoritm(void *);
+UInt16 KCPIDSpeedAlghoritm(void *);
+kern_return_t KCParseLoad(char *, KC_Status_t *);
+void KCSampleLoad(KC_Status_t *, UInt64);
+void KCUpdateLoad(KC_LoadState_t *, UInt64, UInt64, UInt64);
+double KCFanTemperature(KC_Status_t *, int);
+kern_return_t KCParseFilter(char *, KC_Status_t *);
+double KCFilterSample(KC_TempFilter_t *, int, double);
+void KCFilterAccount(KC_Status_t *, int, UInt16);
+void KCReportFilter(KC_Status_t *);
+kern_return_t KCParseTrace(char *, KC_Status_t *);
+kern_return_t KCTraceOpen(KC_Status_t *);
+int KCTracePush(const KC_TraceRecord_t *);
+void KCTraceTick(KC_Status_t *, UInt64, UInt64, UInt32, UInt16);
+void KCTraceClose(KC_Status_t *);
+kern_return_t KCReplay(KC_Status_t *, char *);
+kern_return_t KCShmOpen(KC_Status_t *);
+void KCShmWrite(KC_ShmSegment_t *, KC_Status_t *);
+void KCShmPublish(KC_Status_t *);
+void KCShmClose(KC_Status_t *);
+kern_return_t KCShmSnapshot(KC_ShmSegment_t *, KC_ShmStatus_t *);
+kern_return_t KCShmRead(KC_ShmStatus_t *);
+void KCShmPrintTemperature(KC_ShmStatus_t *);
+void KCShmPrintFans(KC_ShmStatus_t *);
+void KCWriterInit(KC_Writer_t *, int, int);
+void KCWriterPrintf(KC_Writer_t *, const char *, ...);
+int KCWriterFlush(KC_Writer_t *);
+void KCWriterEndRecord(KC_Writer_t *);
+kern_return_t KCParseWatch(char *, KC_Watch_t *);
+void KCWatchHeader(KC_Watch_t *, KC_Writer_t *);
+void KCWatchRecord(KC_Watch_t *, KC_Writer_t *, double, SMCVal_t *);
+kern_return_t KCWatch(KC_Status_t *, KC_Watch_t *);
+extern KC_LoadSource_t g_kcProcStatLoad;
+extern KC_LoadSource_t g_kcHostStatsLoad;
+UInt16 KCPIDUpdate(KC_PIDState_t *, KC_PIDConfig_t *, double, UInt64, UInt32);
+kern_return_t KCParsePID(char *, KC_Status_t *);
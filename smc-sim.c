@@ -0,0 +1,362 @@
+/*
+ * Apple System Management Control (SMC) Tool
+ * Simulated SMC backend for keep-cool
+ * Copyright (C) 2026 The keep-cool contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * An in-memory SMC that answers the same commands as the AppleSMC kernel
+ * service (read index, read key info, read/write bytes, read version).
+ * It lets keep-cool run, and be profiled, on hosts without an SMC.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "keep-cool.h"
+
+#define SMC_SIM_NUM_FANS      2
+
+typedef struct {
+    UInt32                key;
+    UInt32                dataType;
+    UInt32                dataSize;
+    SMCBytes_t            bytes;
+} SMCSimKey_t;
+
+typedef struct {
+    const char            *key;
+    const char            *dataType;
+    double                value;
+} SMCSimSensor_t;
+
+static const SMCSimSensor_t g_simSensors[] = {
+    { "TA0P", DATATYPE_SP78, 32.25 },
+    { "TC0D", DATATYPE_SP78, 58.50 },
+    { "TC0H", DATATYPE_SP78, 55.75 },
+    { "TC0P", DATATYPE_SP78, 54.00 },
+    { "TC1C", DATATYPE_SP78, 57.25 },
+    { "TC2C", DATATYPE_SP78, 56.50 },
+    { "TG0P", DATATYPE_SP78, 51.00 },
+    { "Th0H", DATATYPE_SP78, 49.50 },
+    { "Ts0P", DATATYPE_SP78, 34.00 },
+    { "Tm0P", DATATYPE_FP6A, 41.50 },
+    { "Tp09", DATATYPE_FLT,  53.25 },
+};
+
+/* Factory minimum and maximum speed of each simulated fan (rpm) */
+static const UInt32 g_simFanLimits[SMC_SIM_NUM_FANS][2] = {
+    { 1200, 6200 },
+    { 1300, 5800 },
+};
+
+static SMCSimKey_t  *g_simKeys = NULL;
+static UInt32       g_simKeyCount = 0;
+static UInt32       g_simLatency = 0;
+static UInt32       g_simExtraKeys = 0;
+static io_connect_t g_simNextConn = 1;
+/* Connections may be used from several threads: the latency is paid in
+   parallel, the keys are accessed one call at a time */
+static pthread_mutex_t g_simLock = PTHREAD_MUTEX_INITIALIZER;
+
+static UInt32 SMCSimPack(const char *str)
+{
+    return ((UInt32)(unsigned char)str[0] << 24) | ((UInt32)(unsigned char)str[1] << 16) |
+           ((UInt32)(unsigned char)str[2] << 8) | (UInt32)(unsigned char)str[3];
+}
+
+static void SMCSimPutUInt(SMCSimKey_t *k, UInt32 value)
+{
+    UInt32 i;
+
+    for (i = 0; i < k->dataSize; i++)
+        k->bytes[i] = (value >> ((k->dataSize - 1 - i) * 8)) & 0xff;
+}
+
+static void SMCSimPutSP78(SMCSimKey_t *k, double value)
+{
+    SInt16 raw = (SInt16)(value * 256.0);
+
+    k->bytes[0] = ((UInt16)raw >> 8) & 0xff;
+    k->bytes[1] = (UInt16)raw & 0xff;
+}
+
+static void SMCSimPutFP6A(SMCSimKey_t *k, double value)
+{
+    UInt16 raw = (UInt16)(value * 1024.0);
+
+    k->bytes[0] = raw >> 8;
+    k->bytes[1] = raw & 0xff;
+}
+
+/* Apple Silicon SMCs report floats, little endian */
+static void SMCSimPutFlt(SMCSimKey_t *k, double value)
+{
+    union { UInt32 u; float f; } v;
+
+    v.f = (float)value;
+    k->bytes[0] = v.u & 0xff;
+    k->bytes[1] = (v.u >> 8) & 0xff;
+    k->bytes[2] = (v.u >> 16) & 0xff;
+    k->bytes[3] = v.u >> 24;
+}
+
+static void SMCSimPutFPE2(SMCSimKey_t *k, UInt32 rpm)
+{
+    UInt16 raw = (UInt16)(rpm << 2);
+
+    k->bytes[0] = raw >> 8;
+    k->bytes[1] = raw & 0xff;
+}
+
+static UInt32 SMCSimGetFPE2(SMCSimKey_t *k)
+{
+    return ((k->bytes[0] << 8) | k->bytes[1]) >> 2;
+}
+
+static SMCSimKey_t *SMCSimAdd(const char *key, const char *dataType, UInt32 dataSize)
+{
+    SMCSimKey_t *k = &g_simKeys[g_simKeyCount++];
+
+    memset(k, 0, sizeof(SMCSimKey_t));
+    k->key = SMCSimPack(key);
+    k->dataType = SMCSimPack(dataType);
+    k->dataSize = dataSize;
+    return k;
+}
+
+static int SMCSimCompare(const void *a, const void *b)
+{
+    UInt32 ka = ((const SMCSimKey_t *)a)->key;
+    UInt32 kb = ((const SMCSimKey_t *)b)->key;
+
+    return (ka > kb) - (ka < kb);
+}
+
+static SMCSimKey_t *SMCSimFind(UInt32 key)
+{
+    SMCSimKey_t probe;
+
+    probe.key = key;
+    return (SMCSimKey_t *)bsearch(&probe, g_simKeys, g_simKeyCount, sizeof(SMCSimKey_t), SMCSimCompare);
+}
+
+static kern_return_t SMCSimBuild(void)
+{
+    char        key[5];
+    UInt32      capacity, i;
+    SMCSimKey_t *k;
+
+    capacity = 3 + SMC_SIM_NUM_FANS * 6 + sizeof(g_simSensors)/sizeof(g_simSensors[0]) + g_simExtraKeys;
+    g_simKeys = calloc(capacity, sizeof(SMCSimKey_t));
+    if (g_simKeys == NULL)
+        return kIOReturnError;
+    g_simKeyCount = 0;
+
+    SMCSimAdd("#KEY", DATATYPE_UINT32, 4);
+    k = SMCSimAdd("FNum", DATATYPE_UINT8, 1);
+    SMCSimPutUInt(k, SMC_SIM_NUM_FANS);
+    SMCSimAdd("FS! ", DATATYPE_UINT16, 2);
+
+    for (i = 0; i < SMC_SIM_NUM_FANS; i++)
+    {
+        snprintf(key, sizeof(key), "F%uID", i);
+        k = SMCSimAdd(key, "{fds", 16);
+        snprintf((char *)k->bytes + 4, sizeof(k->bytes) - 4, i == 0 ? "Left side" : "Right side");
+        snprintf(key, sizeof(key), "F%uAc", i);
+        SMCSimPutFPE2(SMCSimAdd(key, DATATYPE_FPE2, 2), g_simFanLimits[i][0]);
+        snprintf(key, sizeof(key), "F%uMn", i);
+        SMCSimPutFPE2(SMCSimAdd(key, DATATYPE_FPE2, 2), g_simFanLimits[i][0]);
+        snprintf(key, sizeof(key), "F%uMx", i);
+        SMCSimPutFPE2(SMCSimAdd(key, DATATYPE_FPE2, 2), g_simFanLimits[i][1]);
+        snprintf(key, sizeof(key), "F%uSf", i);
+        SMCSimPutFPE2(SMCSimAdd(key, DATATYPE_FPE2, 2), g_simFanLimits[i][0]);
+        snprintf(key, sizeof(key), "F%uTg", i);
+        SMCSimPutFPE2(SMCSimAdd(key, DATATYPE_FPE2, 2), g_simFanLimits[i][0]);
+    }
+
+    for (i = 0; i < sizeof(g_simSensors)/sizeof(g_simSensors[0]); i++)
+    {
+        if (strcmp(g_simSensors[i].dataType, DATATYPE_FLT) == 0)
+            SMCSimPutFlt(SMCSimAdd(g_simSensors[i].key, g_simSensors[i].dataType, 4), g_simSensors[i].value);
+        else if (strcmp(g_simSensors[i].dataType, DATATYPE_FP6A) == 0)
+            SMCSimPutFP6A(SMCSimAdd(g_simSensors[i].key, g_simSensors[i].dataType, 2), g_simSensors[i].value);
+        else
+            SMCSimPutSP78(SMCSimAdd(g_simSensors[i].key, g_simSensors[i].dataType, 2), g_simSensors[i].value);
+    }
+
+    /* Filler keys, to emulate machines exposing several hundred keys */
+    for (i = 0; i < g_simExtraKeys; i++)
+    {
+        snprintf(key, sizeof(key), "z%03X", i & 0xfff);
+        k = SMCSimAdd(key, DATATYPE_UINT8, 1);
+        k->key += (i >> 12) << 24;
+        SMCSimPutUInt(k, i & 0xff);
+    }
+
+    qsort(g_simKeys, g_simKeyCount, sizeof(SMCSimKey_t), SMCSimCompare);
+    SMCSimPutUInt(SMCSimFind(SMCSimPack("#KEY")), g_simKeyCount);
+
+    return kIOReturnSuccess;
+}
+
+// Parses "<latency_us>[:<extra_keys>]" (both optional)
+kern_return_t SMCSimConfigure(char *args)
+{
+    char *end;
+
+    /* a new configuration rebuilds the key table at the next open */
+    free(g_simKeys);
+    g_simKeys = NULL;
+    g_simKeyCount = 0;
+    g_simLatency = 0;
+    g_simExtraKeys = 0;
+
+    if (*args == '\0')
+        return kIOReturnSuccess;
+
+    g_simLatency = (UInt32)strtoul(args, &end, 10);
+    if (*end == ':')
+        g_simExtraKeys = (UInt32)strtoul(end + 1, &end, 10);
+    if (*end != '\0')
+        return kIOReturnBadArgument;
+
+    return kIOReturnSuccess;
+}
+
+kern_return_t SMCSimOpen(io_connect_t *conn)
+{
+    pthread_mutex_lock(&g_simLock);
+    if (g_simKeys == NULL && SMCSimBuild() != kIOReturnSuccess)
+    {
+        pthread_mutex_unlock(&g_simLock);
+        printf("Error: can't allocate the simulated SMC\n");
+        return kIOReturnError;
+    }
+
+    *conn = g_simNextConn++;
+    pthread_mutex_unlock(&g_simLock);
+    return kIOReturnSuccess;
+}
+
+kern_return_t SMCSimClose(io_connect_t conn)
+{
+    return kIOReturnSuccess;
+}
+
+kern_return_t SMCSimCall(int index, SMCKeyData_t *inputStructure, SMCKeyData_t *outputStructure, io_connect_t conn)
+{
+    SMCSimKey_t     *k;
+    struct timespec delay;
+    UInt32          fan;
+
+    if (index != KERNEL_INDEX_SMC || conn == 0 || g_simKeys == NULL)
+        return kIOReturnBadArgument;
+
+    if (g_simLatency > 0)
+    {
+        delay.tv_sec = g_simLatency / 1000000;
+        delay.tv_nsec = (g_simLatency % 1000000) * 1000;
+        nanosleep(&delay, NULL);
+    }
+
+    outputStructure->result = SMC_RESULT_SUCCESS;
+
+    pthread_mutex_lock(&g_simLock);
+    switch (inputStructure->data8)
+    {
+        case SMC_CMD_READ_INDEX:
+            if (inputStructure->data32 >= g_simKeyCount)
+            {
+                outputStructure->result = SMC_RESULT_NOT_FOUND;
+                break;
+            }
+            outputStructure->key = g_simKeys[inputStructure->data32].key;
+            break;
+
+        case SMC_CMD_READ_KEYINFO:
+            k = SMCSimFind(inputStructure->key);
+            if (k == NULL)
+            {
+                memset(&outputStructure->keyInfo, 0, sizeof(outputStructure->keyInfo));
+                outputStructure->result = SMC_RESULT_NOT_FOUND;
+                break;
+            }
+            outputStructure->keyInfo.dataSize = k->dataSize;
+            outputStructure->keyInfo.dataType = k->dataType;
+            outputStructure->keyInfo.dataAttributes = 0;
+            break;
+
+        case SMC_CMD_READ_BYTES:
+            k = SMCSimFind(inputStructure->key);
+            if (k == NULL)
+            {
+                outputStructure->result = SMC_RESULT_NOT_FOUND;
+                break;
+            }
+            memcpy(outputStructure->bytes, k->bytes, sizeof(SMCBytes_t));
+            break;
+
+        case SMC_CMD_WRITE_BYTES:
+            k = SMCSimFind(inputStructure->key);
+            if (k == NULL)
+            {
+                outputStructure->result = SMC_RESULT_NOT_FOUND;
+                break;
+            }
+            if (inputStructure->keyInfo.dataSize != k->dataSize)
+            {
+                pthread_mutex_unlock(&g_simLock);
+                return kIOReturnBadArgument;
+            }
+            memcpy(k->bytes, inputStructure->bytes, k->dataSize);
+
+            /* Like the real SMC, a fan never spins below its minimum speed */
+            if ((k->key & 0xff00ffff) == SMCSimPack("F\0Mn"))
+            {
+                fan = ((k->key >> 16) & 0xff) - '0';
+                if (fan < SMC_SIM_NUM_FANS)
+                {
+                    UInt32 rpm = SMCSimGetFPE2(k);
+                    if (rpm < g_simFanLimits[fan][0])
+                        rpm = g_simFanLimits[fan][0];
+                    if (rpm > g_simFanLimits[fan][1])
+                        rpm = g_simFanLimits[fan][1];
+                    SMCSimPutFPE2(SMCSimFind(SMCSimPack("F\0Ac") | (k->key & 0x00ff0000)), rpm);
+                }
+            }
+            break;
+
+        case SMC_CMD_READ_VERS:
+            outputStructure->vers.major = 1;
+            outputStructure->vers.minor = 7;
+            outputStructure->vers.build = 5;
+            outputStructure->vers.release = 0x100 + g_simKeyCount;
+            break;
+
+        default:
+            pthread_mutex_unlock(&g_simLock);
+            return kIOReturnBadArgument;
+    }
+    pthread_mutex_unlock(&g_simLock);
+
+    return kIOReturnSuccess;
+}
+
+SMCTransport_t g_smcSimTransport = { "sim", SMCSimOpen, SMCSimCall, SMCSimClose };